@@ -1995,7 +1995,14 @@ void ControlsBox::update_backend_delta()
     */
     fps_float = fw->delta;
     fps = QString::number(fps_float, 'f', 1).rightJustified(6, ' ');
-    fps_label.setText(QString("FPS @ backend:%1").arg(fps));
+    if(fw->senderDelta > 0)
+    {
+        // Network cameras also tell us the rate the sensor is running at.
+        QString sensorFps = QString::number(fw->senderDelta, 'f', 1).rightJustified(6, ' ');
+        fps_label.setText(QString("FPS @ backend:%1 sensor:%2").arg(fps).arg(sensorFps));
+    } else {
+        fps_label.setText(QString("FPS @ backend:%1").arg(fps));
+    }
 }
 void ControlsBox::setFrameNumber(int number)
 {
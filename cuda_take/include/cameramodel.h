@@ -18,6 +18,26 @@ struct camControlType {
     bool exit = false;
 };
 
+// Data integrity counters for network cameras. A packet is one chunk of a frame.
+struct camStreamStatsType {
+    uint64_t completeFrames = 0;
+    uint64_t incompleteFrames = 0; // frames with at least one chunk missing
+    uint64_t lostPackets = 0; // chunks missing from finished frames
+    uint64_t latePackets = 0; // packets that arrived after their frame was finished, or twice
+    int lastDamagedFirstRow = -1; // rows missing data in the most recent incomplete frame
+    int lastDamagedLastRow = -1;
+    uint64_t bufferFrames = 0; // frames the receive buffer holds
+    uint64_t lagFrames = 0; // finished frames waiting for the consumer
+    uint64_t maxLagFrames = 0;
+    uint64_t lapEvents = 0; // times the consumer fell a whole buffer behind
+    // From the timestamps the camera puts on its frames, 0 if it sends none:
+    double senderFps = 0; // sensor frame rate, independent of how fast we process frames
+    double senderJitterMicros = 0;
+    double senderDriftPpm = 0; // sensor clock against ours, positive when the sensor runs fast
+    uint64_t senderSkippedFrames = 0; // stamped by the sender but never received
+    uint64_t senderRateChanges = 0;
+};
+
 
 class CameraModel
 {
@@ -65,6 +85,10 @@ public:
     virtual void setCamControlPtr(camControlType* p) =0;
 
     virtual bool isRunning() { return running.load(); }
+    virtual camStreamStatsType getStreamStats() { return camStreamStatsType(); }
+    // Kernel receive times (CLOCK_REALTIME ns) of the first and last packet of the frame
+    // getFrameWait returned last. False for sources that do not know them.
+    virtual bool getFrameArrival(uint64_t *firstPacketNs, uint64_t *lastPacketNs) { (void)firstPacketNs; (void)lastPacketNs; return false; }
 
     int getFrameWidth() const { return frame_width; }
     int getFrameHeight() const { return frame_height; }
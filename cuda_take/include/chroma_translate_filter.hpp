@@ -11,6 +11,7 @@
 #include "camera_types.h"
 #include "constants.h"
 #include <stdint.h>
+#include <stddef.h>
 
 /*! \file
  * \brief A filter which converts parallel data from the camera link to a corrected image.
@@ -19,9 +20,11 @@
  * This function takes the pixel data from the chroma detector, which comes through as eight parallel pixels from each tap,
  * and distributes them evenly among the taps to re-create the actual image. Additionally, the pixels are inverted in magnitude
  * based on the raw image. 0xffff represents the maximum pixel value for the 16-bit data.
+ *
+ * apply_raw_correction() is the version used on the acquisition path. It copies a frame out of the camera buffer and
+ * applies the 2s compliment flip, the magnitude inversion, and the status pixel in a single pass over the data.
  */
 
-static uint16_t pic_buffer[MAX_SIZE];
 static int hardware;
 static unsigned int frHeight;
 static unsigned int frWidth;
@@ -31,5 +34,8 @@ static unsigned int MAX_VAL;
 void setup_filter(camera_t camera_type);
 void setup_filter(unsigned int frHeight, unsigned int frWidth);
 uint16_t * apply_chroma_translate_filter(uint16_t * picture);
+void apply_raw_correction(uint16_t * out, const uint16_t * in, size_t pixels,
+                          bool remap, bool invert, unsigned int invFactor,
+                          int statusPixel = -1, uint16_t statusValue = 0);
 
 #endif /* CHROMA_TRANSLATE_FILTER_H_ */
@@ -16,7 +16,12 @@ const static unsigned int FFT_MEAN_BUFFER_LENGTH = 500;
 const static unsigned int FFT_INPUT_LENGTH = 256; // Must be 256, will fail silently otherwise
 static const unsigned int MAX_FFT_SIZE = 4096;
 static const unsigned int MAX_N = 500;
-static const unsigned int CPU_FRAME_BUFFER_SIZE = 1500; // The frame ring buffer size in number of frame_c structs
+static const unsigned int CPU_FRAME_BUFFER_SIZE = 1500; // The default frame ring buffer size in number of frame_c structs
+static const unsigned int MIN_CPU_FRAME_BUFFER_SIZE = 64; // The smallest ring buffer allowed by the --ringframes option
+static const unsigned int SAVE_QUEUE_DEPTH = 512; // Frames that may be waiting to be written to disk before frames are dropped
+static const unsigned int ZERO_COPY_MIN_FRAME_BUFFER_SIZE = SAVE_QUEUE_DEPTH + MIN_CPU_FRAME_BUFFER_SIZE; // Smallest ring buffer when saving pins ring frames
+static const unsigned int SAVE_AVERAGING_BANDS = 2; // Threads (row bands) used to sum frames for averaged recordings
+static const unsigned int MEAN_FILTER_BANDS = 4; // Threads (row bands) used to calculate the mean profiles
 static const unsigned int GPU_FRAME_BUFFER_SIZE = MAX_N*3/2; //1500
 static const unsigned int BLOCK_SIZE = 20; // This is not used by default.
 
@@ -0,0 +1,92 @@
+#ifndef DIRECT_WRITER_HPP_
+#define DIRECT_WRITER_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+
+// Define USE_IO_URING (and link with -luring) to submit writes through io_uring.
+// Without it, batches are written with pwrite by a helper thread.
+#ifdef USE_IO_URING
+#include <liburing.h>
+#endif
+
+#include "cudalog.h"
+
+/*! \file
+ * \brief Batched, page-cache-bypassing writer for raw recordings.
+ *
+ * Frames handed to write() are packed into large, block-aligned batch buffers. A full batch is written to the
+ * file with O_DIRECT, so long recordings do not fill the page cache and then stall in writeback. Writes are
+ * asynchronous: through io_uring, or a pwrite helper thread when io_uring is not built in or not available. Up
+ * to DIRECT_WRITER_BATCH_COUNT batches are outstanding at once. If the filesystem refuses O_DIRECT the writer
+ * falls back to normal buffered I/O using the same batches.
+ */
+
+static const size_t DIRECT_WRITER_ALIGNMENT = 4096; // Must be a multiple of the device logical block size
+static const size_t DIRECT_WRITER_BATCH_BYTES = 8*1024*1024; // Must be a multiple of DIRECT_WRITER_ALIGNMENT
+static const unsigned int DIRECT_WRITER_BATCH_COUNT = 4; // Number of batch buffers, and writes that may be in flight
+static const off_t DIRECT_WRITER_PREALLOC_STEP = 256*1024*1024; // Preallocation step for recordings of unknown length
+
+class direct_writer
+{
+public:
+    direct_writer();
+    ~direct_writer();
+
+    /*! \brief Create fname. expectedBytes is used to preallocate the file, pass 0 when the length is unknown. */
+    bool open(const std::string &fname, size_t expectedBytes);
+    /*! \brief Append bytes to the file. The data is copied, so the caller may reuse it immediately. */
+    bool write(const void *data, size_t bytes);
+    /*! \brief Flush the final partial batch, wait for all writes, and trim the file to the bytes written. */
+    bool close();
+
+    bool isOpen() { return fd >= 0; }
+    bool usingDirectIO() { return directIO; }
+
+private:
+    struct batch {
+        unsigned char *buf;
+        size_t used;
+        off_t offset;
+        bool inFlight;
+    };
+
+    bool submitBatch(unsigned int b, size_t length);
+    bool waitForBatch(unsigned int b);
+    bool preallocate(off_t upTo);
+    bool pwriteBatch(unsigned int b);
+    void pwriteLoop();
+    void release();
+
+    int fd;
+    bool directIO;
+    std::atomic <bool> failed;
+    batch batches[DIRECT_WRITER_BATCH_COUNT];
+    unsigned int currentBatch;
+    off_t submitOffset; // file offset of the next batch to be submitted
+    off_t logicalBytes; // bytes handed to write(), the final file length
+    off_t allocatedBytes;
+
+    // pwrite helper thread, writes queued batches in order.
+    std::thread pwriter;
+    std::mutex pwriteLock; // guards pwriteQueue, pwriteStop and batch inFlight flags
+    std::condition_variable pwriteQueued;
+    std::condition_variable pwriteDone;
+    std::deque <unsigned int> pwriteQueue;
+    bool pwriteStop;
+
+#ifdef USE_IO_URING
+    struct io_uring ring;
+    bool ringValid;
+    bool reapOne();
+#endif
+};
+
+#endif /* DIRECT_WRITER_HPP_ */
@@ -0,0 +1,32 @@
+#ifndef FRAME_ACCUMULATOR_HPP_
+#define FRAME_ACCUMULATOR_HPP_
+
+#include <cstdint>
+
+/*! \brief Running per-pixel sum of 16-bit frames, used to write averaged recordings.
+ * \paragraph
+ *
+ * Each frame is added into a 32-bit integer accumulator as soon as it arrives, so only one frame's worth of state is held
+ * no matter how many frames are averaged. The sum is exact for up to 65537 frames. The per-pixel loops are written for
+ * the compiler to vectorize, and with more than one band the rows are split across OpenMP threads.
+ */
+class frame_accumulator {
+public:
+    frame_accumulator(unsigned int width, unsigned int height, unsigned int bands = 1);
+    ~frame_accumulator();
+
+    void add(const uint16_t * frame);
+    /*! \brief Write the mean of the frames added so far into out and start a new sum. */
+    void mean(float * out);
+    void reset();
+    unsigned int count() { return frames; }
+
+private:
+    uint32_t * accum;
+    unsigned int width;
+    unsigned int height;
+    unsigned int bands;
+    unsigned int frames;
+};
+
+#endif /* FRAME_ACCUMULATOR_HPP_ */
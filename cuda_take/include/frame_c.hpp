@@ -5,6 +5,7 @@
  *      Author: nlevy
  */
 #include <atomic>
+#include <cstdlib>
 #include "constants.h"
 #include "cuda.h"
 #include "cuda_runtime.h"
@@ -18,58 +19,129 @@
 /*! \brief The data structure which contains all data for a frame.
  *
  * The memory for a frame is page-locked at the host to save time during memory transfers to the device. By defining the macro
- * USE_PINNED_MEMORY, we are specifying to use heap arrays for the raw data and standard deviation data (which is filtered on the
- * device) using a page-locked format. The GPU uses this format by default. The other memory can be allocated as static arrays.
+ * USE_PINNED_MEMORY, we are specifying to use page-locked memory for the raw data and standard deviation data (which is filtered on the
+ * device). The GPU uses this format by default. The other memory is regular heap memory.
  * This procedure is standard as defined by the CUDA manual.
+ *
+ * A frame_c does not own its buffers. They are carved out of a frame_arena, which sizes them to the real frame geometry
+ * once it is known, rather than to MAX_WIDTH x MAX_HEIGHT.
  */
 
 struct frame_c{
-#ifdef USE_PINNED_MEMORY
-	uint16_t * raw_data_ptr;
-
-	float * std_dev_data;
-	uint32_t * std_dev_histogram;
-#else
-	uint16_t raw_data_ptr[MAX_SIZE];
-	float std_dev_data[MAX_SIZE];
-	uint32_t std_dev_histogram[NUMBER_OF_BINS];
-#endif
+        uint16_t * raw_data_ptr;
+        float * std_dev_data;
+        uint32_t * std_dev_histogram;
 
         uint16_t * image_data_ptr;
 
-        float dark_subtracted_data[MAX_SIZE];
-        float vertical_mean_profile[MAX_HEIGHT]; //These can use regular C++ allocation because they do not have to deal w/cuda
-        float vertical_mean_profile_lh[MAX_HEIGHT];
-        float vertical_mean_profile_rh[MAX_HEIGHT];
-        float horizontal_mean_profile[MAX_WIDTH];
+        float * dark_subtracted_data;
+        float * vertical_mean_profile; // height entries, see frame_arena
+        float * vertical_mean_profile_lh;
+        float * vertical_mean_profile_rh;
+        float * horizontal_mean_profile; // width entries, see frame_arena
         float fftMagnitude[FFT_INPUT_LENGTH/2];
+        unsigned int width; // geometry the buffers were sized for
+        unsigned int height;
+        uint64_t wire_first_ns; // kernel receive time of the first and last packet, CLOCK_REALTIME ns, 0 if unknown
+        uint64_t wire_last_ns;
         std::atomic_int_least8_t async_filtering_done;
         std::atomic_int_least8_t has_valid_std_dev; //1 indicates doing std. dev, 2 indicates done with std. dev
+        std::atomic_int_least8_t save_pinned; //1 while the saving thread still needs raw_data_ptr, see take_object::queueFrameForSaving
 
         frame_c() {
             reset();
-#ifdef USE_PINNED_MEMORY
-            HANDLE_ERROR(cudaMallocHost( (void **)&raw_data_ptr, MAX_SIZE*sizeof(uint16_t), cudaHostAllocPortable));
-            HANDLE_ERROR(cudaMallocHost( (void **)&std_dev_data, MAX_SIZE*sizeof(float), cudaHostAllocPortable));
-            HANDLE_ERROR(cudaMallocHost( (void **)&std_dev_histogram, NUMBER_OF_BINS*sizeof(uint32_t), cudaHostAllocPortable));
-#endif
+            save_pinned = 0;
+            raw_data_ptr = NULL;
+            std_dev_data = NULL;
+            std_dev_histogram = NULL;
+            image_data_ptr = NULL;
+            dark_subtracted_data = NULL;
+            vertical_mean_profile = NULL;
+            vertical_mean_profile_lh = NULL;
+            vertical_mean_profile_rh = NULL;
+            horizontal_mean_profile = NULL;
+            width = 0;
+            height = 0;
+            wire_first_ns = 0;
+            wire_last_ns = 0;
         }
         void reset()
         {
             async_filtering_done = 0;
             has_valid_std_dev = 0;
         }
+};
+
+/*! \brief Backing memory for a ring of frame_c slots.
+ *
+ * All slots share two allocations: one page-locked block holding every slot's raw, standard deviation, and histogram
+ * buffers, and one regular block for the dark subtracted data and the profiles. Each buffer starts on a 64 byte boundary.
+ */
+class frame_arena {
+public:
+    frame_arena() : pinned(NULL), host(NULL) {}
+    ~frame_arena() { release(); }
 
+    void allocate(frame_c * frames, size_t count, unsigned int width, unsigned int height)
+    {
+        release();
+        const size_t pixels = (size_t)width*height;
+        const size_t rawBytes = roundUp(pixels*sizeof(uint16_t));
+        const size_t stdDevBytes = roundUp(pixels*sizeof(float));
+        const size_t histBytes = roundUp(NUMBER_OF_BINS*sizeof(uint32_t));
+        const size_t dsfBytes = roundUp(pixels*sizeof(float));
+        // The profiles get one spare entry, as mean_filter steps one past a zero-size range,
+        // and the vertical ones are at least FFT_INPUT_LENGTH long for the crosshair FFT.
+        const size_t vertEntries = (height + 1 > FFT_INPUT_LENGTH) ? height + 1 : FFT_INPUT_LENGTH;
+        const size_t vertBytes = roundUp(vertEntries*sizeof(float));
+        const size_t horizBytes = roundUp((width + 1)*sizeof(float));
+        const size_t pinnedStride = rawBytes + stdDevBytes + histBytes;
+        const size_t hostStride = dsfBytes + 3*vertBytes + horizBytes;
 
-	~frame_c()
-	{
 #ifdef USE_PINNED_MEMORY
-		HANDLE_ERROR(cudaFreeHost(raw_data_ptr));
-		HANDLE_ERROR(cudaFreeHost(std_dev_data));
-		HANDLE_ERROR(cudaFreeHost(std_dev_histogram));
+        HANDLE_ERROR(cudaMallocHost( (void **)&pinned, count*pinnedStride, cudaHostAllocPortable));
+#else
+        pinned = (unsigned char *)aligned_alloc(64, count*pinnedStride);
 #endif
+        host = (unsigned char *)aligned_alloc(64, count*hostStride);
+
+        for(size_t f=0; f < count; f++)
+        {
+            unsigned char * p = pinned + f*pinnedStride;
+            frames[f].raw_data_ptr = (uint16_t *)p;
+            frames[f].std_dev_data = (float *)(p + rawBytes);
+            frames[f].std_dev_histogram = (uint32_t *)(p + rawBytes + stdDevBytes);
+
+            unsigned char * h = host + f*hostStride;
+            frames[f].dark_subtracted_data = (float *)h;
+            frames[f].vertical_mean_profile = (float *)(h + dsfBytes);
+            frames[f].vertical_mean_profile_lh = (float *)(h + dsfBytes + vertBytes);
+            frames[f].vertical_mean_profile_rh = (float *)(h + dsfBytes + 2*vertBytes);
+            frames[f].horizontal_mean_profile = (float *)(h + dsfBytes + 3*vertBytes);
+            frames[f].width = width;
+            frames[f].height = height;
+        }
+    }
+
+    void release()
+    {
+        if(pinned != NULL)
+        {
+#ifdef USE_PINNED_MEMORY
+            HANDLE_ERROR(cudaFreeHost(pinned));
+#else
+            free(pinned);
+#endif
+            pinned = NULL;
+        }
+        free(host);
+        host = NULL;
+    }
 
-	}
+private:
+    static size_t roundUp(size_t bytes) { return (bytes + 63) & ~(size_t)63; }
+    unsigned char * pinned;
+    unsigned char * host;
 };
 
 #endif /* FRAME_C_HPP_ */
@@ -0,0 +1,74 @@
+#ifndef FRAME_PIPELINE_HPP_
+#define FRAME_PIPELINE_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+
+#include "frame_c.hpp"
+#include "latency_histogram.hpp"
+
+/*! \brief An ordered list of named processing stages that every acquired frame is passed through.
+ * \paragraph
+ *
+ * take_object builds one pipeline in start() and every camera source (EDT, RTP, XIO files) feeds it, so the
+ * per-frame work is written once instead of once per acquisition loop. Stages run in the order they were added,
+ * on the calling thread. Each stage can be switched off at runtime, and each is timed into a latency_histogram
+ * so that the cost of the individual steps can be read back while running. Timers are entries without a function,
+ * for intervals measured outside of run(), such as the wait for the camera.
+ */
+
+struct pipelineStageStats {
+    uint64_t frames;
+    uint64_t totalNanos;
+    uint64_t maxNanos;
+};
+
+class frame_pipeline {
+public:
+    typedef std::function<void(frame_c *)> stageFunction;
+
+    frame_pipeline();
+
+    /*! \brief Append a stage. Returns the stage index. Must not be called while frames are being processed. */
+    unsigned int addStage(const std::string &name, stageFunction fn, bool enabled = true);
+    /*! \brief Append a stage that runs bypass instead of fn while it is disabled, for stages later ones depend on. */
+    unsigned int addStage(const std::string &name, stageFunction fn, stageFunction bypass, bool enabled = true);
+    /*! \brief Append a timer, which run() skips. Durations are added with record(). */
+    unsigned int addTimer(const std::string &name);
+    void record(unsigned int stage, uint64_t nanos);
+
+    /*! \brief Run every enabled stage on frame. */
+    void run(frame_c * frame);
+
+    unsigned int stageCount();
+    std::string stageName(unsigned int stage);
+    int findStage(const std::string &name);
+
+    bool setStageEnabled(unsigned int stage, bool enabled);
+    bool setStageEnabled(const std::string &name, bool enabled);
+    bool stageEnabled(unsigned int stage);
+
+    void setTiming(bool enabled);
+    bool timingEnabled();
+    pipelineStageStats getStageStats(unsigned int stage);
+    latency_histogram * getStageHistogram(unsigned int stage);
+    /*! \brief One line per stage: frames, mean, p50, p90, p99 and max, in microseconds. */
+    std::string latencyReport();
+    void resetStats();
+
+private:
+    struct stage {
+        std::string name;
+        stageFunction fn;
+        stageFunction bypass; // run instead of fn while disabled, may be empty
+        std::atomic<bool> enabled;
+        latency_histogram latency;
+    };
+    std::deque<stage> stages; // deque, since stage holds atomics and cannot be moved
+    std::atomic<bool> timing;
+};
+
+#endif /* FRAME_PIPELINE_HPP_ */
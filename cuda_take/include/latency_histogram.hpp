@@ -0,0 +1,40 @@
+#ifndef LATENCY_HISTOGRAM_HPP_
+#define LATENCY_HISTOGRAM_HPP_
+
+#include <atomic>
+#include <cstdint>
+
+/*! \brief Fixed-bucket histogram of durations in nanoseconds.
+ * \paragraph
+ *
+ * Buckets are logarithmic with four sub-buckets per power of two, so any recorded value is reported to within 25%,
+ * from nanoseconds up to several seconds, in a fixed 1 kB of counters. Recording is a handful of instructions and
+ * never allocates or locks. One thread records; any thread may read, and sees counts that are at worst a few
+ * samples out of date.
+ */
+class latency_histogram {
+public:
+    static const unsigned int bucketCount = 128;
+
+    latency_histogram();
+
+    void record(uint64_t nanos);
+    void reset();
+
+    uint64_t count();
+    uint64_t sum();
+    uint64_t max();
+    /*! \brief Smallest bucket bound that at least fraction (0.0 to 1.0) of the samples fall at or below. */
+    uint64_t percentile(double fraction);
+
+    static unsigned int bucketFor(uint64_t nanos);
+    static uint64_t bucketUpperBound(unsigned int bucket);
+
+private:
+    std::atomic<uint64_t> buckets[bucketCount];
+    std::atomic<uint64_t> samples;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> maxNanos;
+};
+
+#endif /* LATENCY_HISTOGRAM_HPP_ */
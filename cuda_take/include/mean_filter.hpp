@@ -3,8 +3,10 @@
 #include <cstdint>
 #include <ccomplex>
 #include <mutex>
+#include <condition_variable>
 #include <boost/thread.hpp>
 #include <atomic>
+#include <vector>
 #include "frame_c.hpp"
 #include "fft.hpp"
 #include "constants.h"
@@ -13,8 +15,10 @@
  * \paragraph
  *
  * The Mean Filter calculates the vertical and horizontal mean values of the data and the FFT in a separate thread from the
- * main producer loop. Each time an instance of the mean filter is called, it is opened in a new boost thread, which is deallocated
- * at the end of the calculation. The type of FFT and whether or not to use dark subtracted data is determined outside of the scope
+ * main producer loop. The filter owns one worker thread, which sleeps on a condition variable until start_mean() is called.
+ * update() stores a complete parameter set under a lock, and the worker copies that set before each calculation, so it never
+ * sees half of one frame's parameters and half of the next. If frames arrive faster than the means can be calculated, the
+ * worker skips to the most recent one. The type of FFT and whether or not to use dark subtracted data is determined outside of the scope
  * of this filter, so we must pass in this information, along with the coorinates from which to perform the mean, as parameters.
  * By default, a frame mean will simply be a mean using the frame's geometry as input parameters.
  *
@@ -27,6 +31,25 @@ static float mean_ring_buffer[FFT_MEAN_BUFFER_LENGTH];
 static std::atomic_uint_least16_t mean_ring_buffer_head;
 enum FFT_t {PLANE_MEAN, VERT_CROSS, TAP_PROFIL};
 
+/*! \brief Everything the mean filter needs to know about one frame, handed to the worker by value. */
+struct meanParams {
+    frame_c * frame;
+    unsigned long frame_count;
+    int beginCol;
+    int width;
+    int beginRow;
+    int height;
+    int frWidth;
+    bool useDSF;
+    int FFTtype;
+    int lh_start;
+    int lh_end;
+    int cent_start;
+    int cent_end;
+    int rh_start;
+    int rh_end;
+};
+
 class mean_filter {
 public:
     mean_filter(frame_c * frame,
@@ -72,17 +95,23 @@ public:
     // Ridiculous parameter list lol :P
 
 	void start_mean();
-	void calculate_means();
 	void wait_mean();
 
 	fft myFFT;
 
 private:
         boost::thread mean_thread;
-        std::atomic<bool> doThreadWork;
-        std::atomic<bool> runningMF;
+        bool runningMF; // guarded by locking_mutex
         std::mutex locking_mutex;
+        std::condition_variable workReady;
+        std::condition_variable workDone;
+        meanParams pending; // latest parameters from update(), guarded by locking_mutex
+        uint64_t requestedSeq; // incremented by start_mean()
+        uint64_t completedSeq; // last request the worker has finished
         void threadEntry();
+        void calculate_means();
+
+        // The parameters of the calculation in progress. Only the worker thread uses these.
         int beginCol;
         int width;
         int beginRow;
@@ -103,6 +132,7 @@ private:
 	unsigned int mean_ring_buffer_fft_head;
 	unsigned long frame_count;
 	frame_c * frame;
+	std::vector<float> horizontal_partial; // one horizontal profile per row band, summed after the sweep
 };
 
 #endif /* MEAN_FILTER_HPP */
@@ -2,6 +2,7 @@
 #define OSUTILS_H
 
 #include <dirent.h>
+#include <sched.h>
 #include <sys/stat.h>
 
 #include <vector>
@@ -14,6 +15,15 @@ namespace os
     void listdir(std::vector<std::string> &out, const std::string &directory);
     std::string getext(const std::string &f);
     std::string trim(const std::string &value);
+
+    // CPU lists are written like the kernel's, e.g. "2", "2,3" or "0-3,8".
+    bool parseCpuList(const std::string &list, cpu_set_t *set);
+    // Pin the calling thread to cpuList (NULL to leave its affinity alone), and run it
+    // SCHED_FIFO at fifoPriority (0 to leave it SCHED_OTHER). error says what failed.
+    bool tuneThread(const char *cpuList, int fifoPriority, std::string &error);
+    // Pin every thread the process has now. Threads started later inherit the affinity of
+    // the thread that starts them.
+    bool pinProcess(const char *cpuList, std::string &error);
 }
 
 
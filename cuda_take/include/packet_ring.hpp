@@ -0,0 +1,75 @@
+#ifndef PACKET_RING_HPP_
+#define PACKET_RING_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+
+#include "cudalog.h"
+
+/*! \file
+ * \brief Memory-mapped AF_PACKET (TPACKET_V3) receive ring for UDP streams.
+ *
+ * The kernel writes every IPv4 UDP datagram for one destination port straight into a ring of blocks shared
+ * with this process. The reader waits for a whole block at a time, walks the packets in it, parses the IP and
+ * UDP headers itself, and hands back pointers to the UDP payloads inside the ring. There is no system call and
+ * no kernel-to-user copy per packet. Opening the ring needs CAP_NET_RAW.
+ *
+ * A block is handed to the reader once it is full or PACKET_RING_RETIRE_MS after its first packet, so at low
+ * data rates this adds up to that much latency.
+ */
+
+static const unsigned int PACKET_RING_BLOCK_BYTES = 1024*1024; // Must be a multiple of the page size
+static const unsigned int PACKET_RING_BLOCKS = 64;
+static const unsigned int PACKET_RING_FRAME_BYTES = 2048; // Only used for the ring geometry with TPACKET_V3
+static const unsigned int PACKET_RING_RETIRE_MS = 2;
+
+class packet_ring
+{
+public:
+    packet_ring();
+    ~packet_ring();
+
+    /*! \brief Open a ring on interface ifname (NULL for all interfaces) for UDP datagrams to udpPort.
+     * destAddr, in network byte order, limits it to one destination address, INADDR_ANY for any. */
+    bool open(const char *ifname, uint16_t udpPort, in_addr_t destAddr);
+    void close();
+    bool isOpen() { return fd >= 0; }
+
+    /*! \brief Wait up to timeoutMs (-1 for ever) for the next block of packets. */
+    bool nextBlock(int timeoutMs);
+    /*! \brief The next UDP payload in the current block. False once the block is used up.
+     * timestampNs, if given, gets the kernel receive time (CLOCK_REALTIME nanoseconds). */
+    bool nextDatagram(uint8_t **data, size_t *len, uint64_t *timestampNs = NULL);
+    /*! \brief Give the current block back to the kernel. The payloads in it must not be used after this. */
+    void releaseBlock();
+
+    /*! \brief Log the kernel's counts of packets received and dropped for lack of ring space. */
+    void logStatistics();
+
+    uint64_t ignoredPackets() { return ignored; }
+
+    /*! \brief Find the UDP payload of an IPv4 packet of caplen bytes starting at ip. Returns false unless it is an
+     * unfragmented UDP datagram for udpPort (network byte order) and, unless destAddr is INADDR_ANY, destAddr. */
+    static bool udpPayload(uint8_t *ip, size_t caplen, uint16_t udpPort, in_addr_t destAddr, uint8_t **data, size_t *len);
+
+private:
+    packet_ring(const packet_ring &);
+    packet_ring &operator=(const packet_ring &);
+
+    bool attachFilter();
+
+    int fd;
+    uint8_t *map;
+    size_t mapBytes;
+    unsigned int currentBlock;
+    struct tpacket_block_desc *block; // current block, NULL if none is held
+    uint8_t *nextPacket;
+    unsigned int packetsLeft;
+    uint16_t port; // network byte order
+    in_addr_t address;
+    uint64_t ignored; // packets in the ring that were not for us, or were not parseable
+};
+
+#endif /* PACKET_RING_HPP_ */
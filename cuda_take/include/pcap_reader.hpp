@@ -0,0 +1,72 @@
+#ifndef PCAP_READER_HPP_
+#define PCAP_READER_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "cudalog.h"
+
+/*! \file
+ * \brief Reader for UDP datagrams in pcap and pcapng capture files.
+ *
+ * The file is memory-mapped and walked record by record. Each record is taken apart down to the UDP payload,
+ * which is returned as a pointer into the mapping, along with the capture timestamp in nanoseconds. Only IPv4
+ * UDP datagrams for one destination port are returned; everything else is skipped. Ethernet (with or without
+ * 802.1Q tags), Linux cooked (SLL and SLL2), raw IP and BSD loopback captures are understood, which covers
+ * tcpdump, Wireshark and dumpcap output.
+ */
+
+class pcap_reader
+{
+public:
+    pcap_reader();
+    ~pcap_reader();
+
+    /*! \brief Open a capture and check its format. udpPort is the destination port to return datagrams for. */
+    bool open(const std::string &fname, uint16_t udpPort);
+    void close();
+    bool isOpen() { return map != NULL; }
+
+    /*! \brief The next datagram, valid until the reader is closed. False at the end of the file. */
+    bool nextDatagram(uint8_t **data, size_t *len, uint64_t *timestampNs);
+    /*! \brief Start over at the first record. */
+    void rewind();
+
+    uint64_t datagramCount() { return datagrams; }
+    uint64_t ignoredCount() { return ignored; }
+
+private:
+    pcap_reader(const pcap_reader &);
+    pcap_reader &operator=(const pcap_reader &);
+
+    // Capture file link types:
+    enum { LINK_NULL = 0, LINK_ETHERNET = 1, LINK_RAW = 101, LINK_LINUX_SLL = 113, LINK_LINUX_SLL2 = 276, LINK_IPV4 = 228 };
+    static const unsigned int MAX_INTERFACES = 16;
+
+    bool nextPcapRecord(uint8_t **pkt, size_t *caplen, uint32_t *linkType, uint64_t *timestampNs);
+    bool nextPcapngRecord(uint8_t **pkt, size_t *caplen, uint32_t *linkType, uint64_t *timestampNs);
+    void readInterfaceBlock(const uint8_t *body, size_t bodyBytes);
+    bool ipPacket(uint8_t *pkt, size_t caplen, uint32_t linkType, uint8_t **ip, size_t *ipBytes);
+    uint16_t get16(const uint8_t *p);
+    uint32_t get32(const uint8_t *p);
+
+    int fd;
+    uint8_t *map;
+    size_t mapBytes;
+    size_t pos;
+    size_t firstRecord;
+    bool pcapng;
+    bool swapped; // file byte order differs from ours
+    bool nanosecondTimestamps; // pcap only
+    uint32_t pcapLinkType;
+    unsigned int interfaceCount; // pcapng, per section
+    uint32_t interfaceLinkType[MAX_INTERFACES];
+    uint64_t interfaceTicksPerSecond[MAX_INTERFACES];
+    uint16_t port; // network byte order
+    uint64_t lastTimestampNs; // for pcapng simple packet blocks, which have none
+    uint64_t datagrams;
+    uint64_t ignored;
+};
+
+#endif /* PCAP_READER_HPP_ */
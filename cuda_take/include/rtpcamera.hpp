@@ -8,6 +8,7 @@
 #include <iostream>
 #include <cstring>
 #include <chrono>
+#include <atomic>
 #include <pthread.h>
 
 
@@ -45,15 +46,20 @@ using std::cout;
 using std::endl;
 
 // This struct is shared among many of the static functions.
+// The gstreamer thread fills buffer[currentFrameNumber], then publishes it by storing
+// doneFrameNumber and incrementing frameCounter (release). getFrameWait() watches frameCounter.
 typedef struct
 {
-    GMainLoop *loop;
-    GstElement *sourcePipe;
-    GstElement *sinkPipe;
+    GMainLoop *loop = NULL;
+    GstElement *sourcePipe = NULL;
+    GstElement *sinkPipe = NULL;
     unsigned int currentFrameNumber = 0; // being written to
-    unsigned int doneFrameNumber = 0; // good frame to copy out
-    uint64_t frameCounter = 0;
-    uint16_t **buffer;
+    std::atomic<unsigned int> doneFrameNumber{0}; // most recent complete frame
+    std::atomic<uint64_t> frameCounter{0};
+    uint16_t **buffer = NULL;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    bool sizeWarned = false; // logged a sample that did not match the frame size
 } ProgramData;
 
 
@@ -63,6 +69,9 @@ static GstFlowReturn on_new_sample_from_sink_gray(GstElement * elt, ProgramData
 static gboolean on_source_message (GstBus * bus, GstMessage * message, ProgramData * data);
 static void siphonDataRGB (GstMapInfo* map, ProgramData *data);
 static void siphonDataGray (GstMapInfo* map, ProgramData *data);
+static size_t sampleRowStride(GstMapInfo* map, ProgramData *data, size_t rowBytes);
+static void publishFrame(ProgramData *data);
+static void unpackRGB24(uint16_t * __restrict out, const uint8_t * __restrict in, size_t pixels);
 
 
 class RTPCamera : public CameraModel
@@ -93,10 +102,9 @@ private:
     int port;
     int frWidth;
     int frHeight;
-    unsigned int *currentFrameNumber = 0;
-    unsigned int *doneFrameNumber = 0;
-    unsigned int lastFrameDelivered = 0;
-    uint64_t *frameCounter = 0;
+    std::atomic<unsigned int> *doneFrameNumber = NULL;
+    std::atomic<uint64_t> *frameCounter = NULL;
+    uint64_t lastFrameCountDelivered = 0;
     bool haveInitialized = false;
     bool loopRunning = false;
     bool destructorRunning = false;
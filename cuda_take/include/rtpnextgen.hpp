@@ -8,9 +8,17 @@
 #include <iostream>
 #include <iomanip>
 #include <cstring>
+#include <cerrno>
 #include <chrono>
 #include <thread>
 #include <pthread.h>
+#include <atomic>
+#include <climits>
+#include <deque>
+#include <mutex>
+#include <linux/futex.h>
+#include <linux/filter.h>
+#include <sys/syscall.h>
 
 #include <cstdint>
 #include <cstring>
@@ -19,7 +27,11 @@
 #include <netinet/in.h>
 
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <ifaddrs.h>
+#include <vector>
 
 #ifndef IFNAMSIZ
 #define IFNAMSIZ (16)
@@ -29,15 +41,39 @@
 #include "cameramodel.h"
 #include "constants.h"
 #include "cudalog.h"
+#include "packet_ring.hpp"
+#include "pcap_reader.hpp"
+#include "sender_clock.hpp"
 #include "takeoptions.h"
 
 
 #define RTPNG_TIMEOUT_DURATION 100
-// Safe level seems to be about 30.
-// We will use a level of 5 for testing.
-#define networkPacketBufferFrames (300)
 #define rtpConstructedFrameBufferCount (3)
 
+// The packet buffers are sized once the first RTPNG_SIZING_FRAMES frames have been
+// measured, or after RTPNG_SIZING_TIMEOUT_MS if the stream has no end of frame markers.
+// Their depth is options.rtpBufferSeconds of data, within these limits:
+#define RTPNG_SIZING_FRAMES (4)
+#define RTPNG_SIZING_TIMEOUT_MS (2000)
+#define RTPNG_SIZING_DEFAULT_FPS (100) // used when the frame rate could not be measured
+#define RTPNG_MIN_RING_FRAMES (16)
+#define RTPNG_MAX_RING_FRAMES (4096)
+#define RTPNG_HUGE_PAGE_BYTES (2*1024*1024)
+
+// Upper limit for the --rtpbatch option, the number of packets taken per recvmmsg call.
+#define RTPNG_MAX_BATCH (256)
+// Room for the ancillary data of one packet, the SO_TIMESTAMPNS receive time:
+#define RTPNG_CONTROL_BYTES (64)
+
+// Entry in the packet chunk index table for a packet that is not part of the frame.
+#define RTPNG_NO_CHUNK (0xFFFF)
+
+// Upper limit for --rtpshards.
+#define RTPNG_MAX_SHARDS (16)
+// With several shards, how long a finished frame may wait for another shard
+// to finish an earlier frame before it is delivered out of order.
+#define RTPNG_REORDER_WINDOW_US (5000)
+
 #define NG_FRAME_WAIT_MIN_DELAY_US (1)
 #define MAX_FRAME_WAIT_TAPS (100000)
 
@@ -60,9 +96,12 @@ struct SRTPData {
     size_t	      m_uRTPChunkSize;
     size_t	      m_uRTPChunkCnt;
     uint16_t	  m_uFrameStartSeq;
+    uint16_t      m_uNextFrameStartSeq; // where the frame after this one begins, once known
+    bool          m_bNextFrameStartKnown;
     uint16_t      m_uSequenceNumber;
     uint32_t      m_uSource;
-    uint32_t      m_timestamp;
+    uint32_t      m_timestamp; // of the latest packet
+    uint32_t      m_uFrameTimestamp; // of the frame being assembled
 };
 
 
@@ -80,27 +119,31 @@ public:
     void streamLoop(); // This should be its own thread and is effectivly the producer of image data.
     virtual camControlType* getCamControlPtr();
     virtual void setCamControlPtr(camControlType* p);
+    virtual camStreamStatsType getStreamStats();
+    virtual bool getFrameArrival(uint64_t *firstPacketNs, uint64_t *lastPacketNs);
 
 private:
+    rtpnextgen(takeOptionsType opts, int shardIndex, rtpnextgen *parent); // one receive shard
     bool initialize(); // all setup functions
     std::streambuf *coutbuf;
     takeOptionsType options;
     const char* interface;
     bool rtprgb = true;
     bool firstChunk = true;
-    bool waitingForFirstFrame = true;
+    std::atomic<bool> waitingForFirstFrame{true};
     uint32_t sourceNumber = 0;
     uint32_t lastTimeStamp = 0;
     int port;
     int frWidth;
     int frHeight;
     unsigned int currentFrameNumber = 0;
-    unsigned int doneFrameNumber = 0;
+    std::atomic<unsigned int> doneFrameNumber{0}; // published by the receive thread with release ordering
     unsigned int lastFrameDelivered = 0;
     uint64_t frameCounterNetworkSocket = 0;
     uint64_t framesDeliveredCounter = 0;
     uint64_t lagLevel = 0;
     uint64_t lagLevelPrior = 0;
+    uint64_t maxLagLevel = 0;
 
     uint64_t lagEventCounter = 0;
     uint64_t lapEventCounter = 0;
@@ -114,28 +157,179 @@ private:
 
     bool receiveFromWaiting = false;
 
+    // Frame handoff. frameReadySeq is bumped after each frame is published in doneFrameNumber
+    // and is also the futex word the consumer sleeps on.
+    std::atomic<uint32_t> frameReadySeq{0};
+    std::atomic<int> frameWaiters{0};
+    unsigned int spinBudgetMicros = 0; // adapted between 0 and options.rtpSpinMicros
+    uint64_t frameWaitSpinCounter = 0;
+    uint64_t frameWaitBlockCounter = 0;
+    void publishFrame();
+    void wakeFrameWaiters();
+    bool waitForFrame(unsigned int lastDelivered);
+    void sleepOnFrameSeq(uint32_t seq, long timeoutMicros);
+
+    // Sharded receive (--rtpshards). The camera that take_object talks to owns the shards
+    // and has no socket of its own. Each shard is a full receiver with its own thread,
+    // socket and frame slots, and reports every finished frame to the owner, which keeps
+    // them in RTP timestamp order for getFrameWait. A frame is held back while another
+    // shard is still assembling a frame with an earlier timestamp.
+    struct shardFrame {
+        uint32_t timestamp;
+        int shard;
+        unsigned int slot;
+        steady_clock::time_point arrival;
+    };
+    int shardIndex = -1; // -1 unless this is a shard
+    rtpnextgen *parentCam = NULL;
+    bool reusePort = false;
+    std::atomic<bool> assembling{false}; // this shard has received part of a frame
+    std::atomic<uint32_t> assemblingTimestamp{0}; // timestamp of that frame
+    std::vector<rtpnextgen*> shards;
+    std::vector<std::thread> shardThreads;
+    std::mutex shardMutex; // guards the members below
+    std::deque<shardFrame> orderedFrames; // sorted by timestamp
+    unsigned int shardQueued[RTPNG_MAX_SHARDS] = {0};
+    uint32_t lastDeliveredTimestamp = 0;
+    bool deliveredAny = false;
+    uint64_t reorderTimeoutCounter = 0;
+    uint64_t outOfOrderCounter = 0;
+    void shardFrameReady(int shard, unsigned int slot, uint32_t timestamp);
+    uint16_t* shardFrameData(unsigned int slot);
+    uint16_t* getShardedFrameWait(CameraModel::camStatusEnum *stat);
+    static bool timestampBefore(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+
     camControlType *camcontrol = NULL;
     uint16_t *guaranteedBufferFrames[rtpConstructedFrameBufferCount] = {NULL};
     uint16_t *timeoutFrame = NULL;
     size_t frameBufferSizeBytes = 0;
     size_t uRxSizePrior = 0;
     size_t chunksPerFramePrior = 0;
-
-    uint8_t *largePacketBuffer[networkPacketBufferFrames] = {NULL};
+    bool timestampPerFrame = false; // the sender's RTP timestamp changes only between frames
+    uint64_t missedMarkerCounter = 0;
+
+    // The packet buffers are sized from the stream itself. Until then, packets are only measured
+    // (chunk size, packets per frame and frame rate) and are not kept. All slots live in one
+    // huge-page backed region.
+    bool ringSized = false;
+    int sizingFrames = -1; // frames measured, -1 until the first end of frame marker
+    size_t sizingPackets = 0; // packets in the frame being measured
+    size_t sizingMaxPackets = 0;
+    size_t sizingLargestPacket = 0;
+    steady_clock::time_point sizingStart;
+    steady_clock::time_point sizingFirstPacket;
+    bool sizingStarted = false;
+    void RTPPumpMeasure( SRTPData& rtp );
+    void RTPMeasurePacket( uint8_t* pPacket, size_t uRxSize, steady_clock::time_point now );
+    void allocateRing(size_t packetBytes, size_t packetsPerFrame, double fps);
+    void releaseRing();
+    uint8_t *ringRegion = NULL;
+    size_t ringRegionBytes = 0;
+    bool ringHugePages = false;
+
+    int ringFrames = 0; // slots of largePacketBuffer in use
+    size_t slotBytes = 0; // bytes per slot
+    size_t packetStride = 0; // largest packet, including its header
+    std::vector<uint8_t*> largePacketBuffer;
     //                        [lpbFramePos][lpbPos]
     int lpbPos = 0;
     int lpbFramePos = 0;
 
-    size_t packetSizeBuffer[networkPacketBufferFrames][1024]; // buffer to hold the size of incomming packets.
+    size_t packetsPerSlot = 0; // entries per slot in the tables below
+    std::vector<uint32_t> packetSizeTable; // size of each incoming packet, zero after the last one of a frame.
+    uint32_t* packetSizes(int slot) { return &packetSizeTable[(size_t)slot*packetsPerSlot]; }
     //                     [psbFramePos][psbPos];
     int psbFramePos = 0;
     int psbPos = 0;
+    std::vector<uint16_t> packetChunkTable; // chunk index of each stored packet, or RTPNG_NO_CHUNK to skip it
+    uint16_t* packetChunkIndex(int slot) { return &packetChunkTable[(size_t)slot*packetsPerSlot]; }
+
+    // Packet loss accounting. Bit n of chunkMap(slot) is set when chunk n of that frame arrives.
+    // Missing chunks are zero-filled, so a lost packet never shifts the rest of the frame.
+    size_t chunkMapWords = 0;
+    std::vector<uint64_t> chunkMapTable;
+    uint64_t* chunkMap(int slot) { return &chunkMapTable[(size_t)slot*chunkMapWords]; }
+    std::vector<size_t> slotChunkSize;
+    std::atomic<uint64_t> completeFrameCounter{0};
+    std::atomic<uint64_t> incompleteFrameCounter{0};
+    std::atomic<uint64_t> lostPacketCounter{0};
+    std::atomic<uint64_t> latePacketCounter{0};
+    std::atomic<int> lastDamagedFirstRow{-1};
+    std::atomic<int> lastDamagedLastRow{-1};
+    bool chunkMapOverflowWarned = false;
+    size_t expectedChunks(int slot);
+    void zeroMissingChunks(uint8_t *frame, int slot);
+
+    // Kernel receive times (SO_TIMESTAMPNS, CLOCK_REALTIME nanoseconds, 0 if unknown) of the first and
+    // last packet of each frame. packetWireNs is the time of the packet being processed.
+    uint64_t packetWireNs = 0;
+    uint64_t frameWireFirstNs = 0;
+    uint64_t frameWireLastNs = 0;
+    std::vector<uint64_t> slotWireFirstNs;
+    std::vector<uint64_t> slotWireLastNs;
+    uint64_t deliveredWireFirstNs = 0; // of the frame getFrameWait returned last
+    uint64_t deliveredWireLastNs = 0;
+    sender_clock senderClock; // fed by the receive thread, or by every shard's
+    void addSenderStats(camStreamStatsType &st);
+    uint8_t batchControl[RTPNG_MAX_BATCH][RTPNG_CONTROL_BYTES];
+    void setBatchControl(struct msghdr &mh, unsigned int k);
+    static uint64_t kernelReceiveNs(struct msghdr &mh);
+    void noteDelivered(rtpnextgen *source, unsigned int slot);
+
+    // Batched receive:
+    unsigned int batchSize = 1;
+    size_t batchStride = 0; // space given to each packet of a batch, the largest packet seen so far
+    struct mmsghdr batchMsgs[RTPNG_MAX_BATCH];
+    struct iovec batchIov[RTPNG_MAX_BATCH];
+    uint64_t batchCallCounter = 0;
+    uint64_t batchPacketCounter = 0;
+    uint64_t truncatedPacketCounter = 0;
+
+    // Direct placement (--rtpdirect), payloads go straight to their place in the frame:
+    bool directPlacement = false;
+    size_t directChunkSize = 0; // payload bytes per packet, 0 until learned
+    uint8_t directHeaders[RTPNG_MAX_BATCH][16];
+    struct iovec directIov[RTPNG_MAX_BATCH][2]; // header, payload
+    int directBatchNext = 0; // first packet of the batch not yet placed
+    int directBatchGot = 0;
+    bool directBatchStaged = false;
+    std::vector<uint8_t> directScratch; // holds the rest of a batch after a misprediction
+    uint64_t directMoveCounter = 0;
+
+    // Packet ring receive (--rtpring). The UDP socket stays bound, so the port is claimed
+    // and the sender gets no ICMP errors, but it is given a filter that drops everything.
+    packet_ring *ring = NULL;
+    void RTPPumpRing( SRTPData& rtp );
+
+    // Capture file replay (--rtpreplay), packets come from a pcap or pcapng file instead of the network.
+    pcap_reader *replay = NULL;
+    bool replayStarted = false;
+    bool replayDone = false;
+    uint64_t replayFirstNs = 0; // capture time of the first packet
+    steady_clock::time_point replayStart; // when it was replayed
+    bool openSocket();
+    bool openReplay();
+    void RTPPumpReplay( SRTPData& rtp );
+    void RTPIngestPacket( SRTPData& rtp, uint8_t* pPacket, size_t uRxSize, steady_clock::time_point arrival, uint64_t wireNs );
 
 
     SRTPData rtp;
     bool g_bRunning = false;
     void RTPGetNextOutputBuffer( SRTPData& rtp, bool bLastBufferReady );
     void RTPPump( SRTPData& rtp );
+    void RTPPumpBatch( SRTPData& rtp );
+    void RTPPumpDirect( SRTPData& rtp );
+    void RTPProcessPacket( SRTPData& rtp, ssize_t uRxSize );
+    void RTPPlacePayload( SRTPData& rtp, uint8_t* pHeader, uint8_t* pPayload, size_t uRxSize );
+    void RTPStageBatchTail();
+    bool RTPAcceptHeader( SRTPData& rtp, uint8_t* pHeader, size_t uRxSize, bool& bMarker, size_t& uChunkSize, uint16_t& uSeqNumber );
+    bool RTPChunkOffset( SRTPData& rtp, uint16_t uSeqNumber, size_t uChunkSize, size_t& uOffset, size_t& uChunkIndex );
+    bool RTPNextFrameStarted( SRTPData& rtp, uint16_t uSeqNumber, size_t uChunkSize );
+    void RTPMarkerSeen( SRTPData& rtp, uint16_t uSeqNumber );
+    size_t RTPFrameChunks( SRTPData& rtp );
+    void RTPMarkChunk( size_t uChunkIndex );
+    void RTPEndOfFrame( SRTPData& rtp, const uint8_t* pFrameData );
+    bool RTPCheckRoom( size_t bytes );
     bool RTPExtract( uint8_t* pBuffer, size_t uSize, bool& bMarker, uint8_t** ppData, size_t& uChunkSize, uint16_t& uSeqNumber,
         uint8_t &uVer, bool& bPadding, bool& bExtension, uint8_t& uCRSCCount, uint8_t& uPayloadType, uint32_t& uTimeStamp, uint32_t& uSource
         );
@@ -147,8 +341,8 @@ private:
     bool getIfAddr(const char* ifString, in_addr *addr);
 
     // Performance metrics:
-    int durationOfMemoryCopy_microSec[networkPacketBufferFrames] = {0};
-    int frameReceive_microSec[networkPacketBufferFrames] = {0};
+    std::vector<int> durationOfMemoryCopy_microSec;
+    std::vector<int> frameReceive_microSec;
 
     void debugMessage(const char* msg);
     void debugMessage(const std::string msg);
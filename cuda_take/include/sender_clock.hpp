@@ -0,0 +1,55 @@
+#ifndef SENDER_CLOCK_HPP_
+#define SENDER_CLOCK_HPP_
+
+#include <cstdint>
+#include <mutex>
+
+/*! \brief Frame rate, jitter and clock drift of a network camera, from the timestamps it sends.
+ * \paragraph
+ *
+ * The frame rate take_object reports comes from the length of its own loop, so a slow stage looks the same as a
+ * slow sensor. This tracks the sender side instead: each frame's RTP timestamp, which the camera stamps on its own
+ * clock, against the local time the frame arrived. From that come the sensor frame period, frames the sender
+ * stamped but which never arrived, the RFC 3550 interarrival jitter, and how fast the sender clock runs compared
+ * to ours. Frames may be fed from several threads, such as receive shards, so they can come slightly out of
+ * order; any thread may read the statistics.
+ */
+
+struct senderClockStats {
+    double fps = 0; // sensor frame rate, 0 until two frames have been seen
+    double jitterMicros = 0; // RFC 3550 interarrival jitter
+    double driftPpm = 0; // positive when the sender clock runs fast, 0 for the first few seconds
+    uint64_t frames = 0;
+    uint64_t skippedFrames = 0; // frames the timestamps say were sent but never seen
+    uint64_t rateChanges = 0; // times the sensor frame period changed
+    uint64_t discontinuities = 0; // timestamp jumps, treated as a restart of the stream
+};
+
+class sender_clock {
+public:
+    explicit sender_clock(uint32_t clockRate = 90000);
+
+    /*! \brief A frame stamped rtpTimestamp by the sender arrived at localNs (nanoseconds, any fixed epoch). */
+    void frame(uint32_t rtpTimestamp, uint64_t localNs);
+    senderClockStats stats();
+    void reset();
+
+private:
+    void restart(uint32_t rtpTimestamp, uint64_t localNs);
+
+    std::mutex lock;
+    const uint32_t rate;
+    bool started;
+    uint32_t lastTimestamp;
+    uint64_t lastLocalNs;
+    uint64_t baseLocalNs; // start of the drift measurement
+    uint64_t elapsedTicks; // sender clock since baseLocalNs, unwrapped
+    double periodTicks; // sensor frame period, 0 until known
+    unsigned int periodMisses; // frames in a row that did not fit periodTicks
+    double candidatePeriod;
+    uint64_t pendingSkips; // skipped frames counted during the current run of misses
+    double jitterNs;
+    senderClockStats st;
+};
+
+#endif /* SENDER_CLOCK_HPP_ */
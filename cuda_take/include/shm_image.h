@@ -20,6 +20,8 @@
 #define shmWidth (1280)
 #define shmFrameBufferSize (10)
 #define shmFilenameBufferSize (256)
+#define shmLatencyStageCount (12)
+#define shmLatencyNameLength (16)
 
 // Shared Memory Segment statusByte:
 #define SHM_STATUS_READY (31)
@@ -28,6 +30,18 @@
 #define SHM_STATUS_CLOSED (24)
 #define SHM_STATUS_ERROR (13)
 
+// Latency of one processing stage, in microseconds.
+// See frame_pipeline for the stages. Updated about once per second.
+struct shmStageLatency {
+    char name[shmLatencyNameLength];
+    uint64_t frames;
+    float meanMicros;
+    float p50Micros;
+    float p90Micros;
+    float p99Micros;
+    float maxMicros;
+};
+
 // Shared Memory Segment Data Structure:
 struct shmSharedDataStruct {
     char statusByte; // Packed as four bytes, see above
@@ -45,6 +59,25 @@ struct shmSharedDataStruct {
     uint16_t frameBuffer[shmFrameBufferSize][shmWidth*shmHeight]; // Buffer of frames. Read into the buffer by offsetting how many bytes-of-frame are needed.
     //uint16_t *frameBuffer[shmFrameBufferSize];
     char lastFilename[shmFilenameBufferSize]; // Last used filename for saving data out. Is not cleared or reset after saving.
+
+    int latencyStageCount; // number of valid entries in stageLatency
+    struct shmStageLatency stageLatency[shmLatencyStageCount];
+
+    // Network camera data integrity, updated about once a second. Zero for other cameras.
+    uint64_t streamCompleteFrames;
+    uint64_t streamIncompleteFrames; // frames which had missing packets, zero-filled
+    uint64_t streamLostPackets;
+    uint64_t streamLatePackets; // arrived too late to be used
+    int streamDamagedFirstRow; // rows affected in the most recent incomplete frame, -1 if none
+    int streamDamagedLastRow;
+
+    // From the camera's frame timestamps, so independent of our processing rate. Zero when unknown.
+    double streamSenderFps;
+    double streamSenderJitterMicros;
+    double streamSenderDriftPpm; // sensor clock against ours, positive when the sensor runs fast
+    uint64_t streamSenderSkippedFrames; // stamped by the sender but never received
+
+    uint64_t saveDroppedFrames; // frames left out of the current recording because saving fell behind
 };
 
 // Union for manipulating the buffers as either pixels or bytes:
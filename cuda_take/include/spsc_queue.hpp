@@ -0,0 +1,124 @@
+#ifndef SPSC_QUEUE_HPP_
+#define SPSC_QUEUE_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+/*! \file
+ * \brief A bounded, lock-free, single-producer single-consumer ring.
+ *
+ * The ring is used to hand frames from an acquisition loop to the saving thread. Exactly one thread may
+ * call push() and exactly one thread may call try_pop() or wait_pop(). Neither side takes a lock on the
+ * fast path; the consumer may optionally block for a bounded time when the ring is empty, in which case
+ * the producer signals it through a condition variable. The storage is allocated once at construction.
+ */
+
+template <typename T>
+class spsc_queue
+{
+public:
+    /*! \brief Construct a ring holding at least min_capacity items (rounded up to a power of two). */
+    explicit spsc_queue(size_t min_capacity)
+    {
+        cap = 1;
+        while(cap < min_capacity)
+            cap <<= 1;
+        mask = cap - 1;
+        items = new T[cap];
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        consumerWaiting.store(false, std::memory_order_relaxed);
+    }
+
+    ~spsc_queue()
+    {
+        delete[] items;
+    }
+
+    /*! \brief Producer side. Returns false without blocking when the ring is full. */
+    bool push(const T &item)
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) >= cap)
+            return false;
+        items[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+
+        // Pairs with the fence in wait_pop() so that a consumer which is about to
+        // sleep either sees the new tail or is seen as waiting here.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(consumerWaiting.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lk(waitMutex);
+            waitCond.notify_one();
+        }
+        return true;
+    }
+
+    /*! \brief Consumer side. Returns false without blocking when the ring is empty. */
+    bool try_pop(T &item)
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire))
+            return false;
+        item = items[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /*! \brief Consumer side. Blocks for up to timeout waiting for an item. */
+    template <typename Rep, typename Period>
+    bool wait_pop(T &item, const std::chrono::duration<Rep, Period> &timeout)
+    {
+        if(try_pop(item))
+            return true;
+
+        std::unique_lock<std::mutex> lk(waitMutex);
+        consumerWaiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        waitCond.wait_for(lk, timeout, [this]{ return !empty(); });
+        consumerWaiting.store(false, std::memory_order_relaxed);
+        lk.unlock();
+
+        return try_pop(item);
+    }
+
+    size_t size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_t capacity() const
+    {
+        return cap;
+    }
+
+private:
+    spsc_queue(const spsc_queue &);
+    spsc_queue &operator=(const spsc_queue &);
+
+    T *items;
+    size_t cap;
+    size_t mask;
+
+    // head is written by the consumer and tail by the producer; keep them on
+    // separate cache lines so the two threads do not false-share.
+    std::atomic<size_t> head;
+    char pad0[64];
+    std::atomic<size_t> tail;
+    char pad1[64];
+    std::atomic<bool> consumerWaiting;
+
+    std::mutex waitMutex;
+    std::condition_variable waitCond;
+};
+
+#endif /* SPSC_QUEUE_HPP_ */
@@ -45,6 +45,11 @@
 #include "fileformats.h"
 #include "rtpnextgen.hpp"
 #include "rtpcamera.hpp"
+#include "spsc_queue.hpp"
+#include "direct_writer.hpp"
+#include "frame_accumulator.hpp"
+#include "frame_pipeline.hpp"
+#include "osutils.h"
 
 //** Harware Macros ** These Macros set the hardware type that take_object will use to collect data
 #define EDT
@@ -65,6 +70,16 @@
 
 using std::string;
 
+/*! \brief One frame waiting to be written by the saving thread.
+ *
+ * data either points at a buffer from the saving pool, or, when recording with zero copy,
+ * directly at raw_data_ptr of pinnedFrame in the frame ring buffer.
+ */
+struct saveQueueItem {
+    uint16_t * data;
+    frame_c * pinnedFrame;
+};
+
 static const bool CHECK_FOR_MISSED_FRAMES_6604A = false; // toggles the presence or absence of the "WARNING: MISSED FRAME X" line
 
 #define meanDeltaSize (20)
@@ -112,6 +127,10 @@ class take_object {
 	unsigned int size;
     int lastfc;
 
+    //frame ring buffer memory
+    frame_arena ring_arena;
+    unsigned int ringDepth = CPU_FRAME_BUFFER_SIZE;
+
     //frame dimensions
     frame_c* curFrame;
     unsigned int dataHeight;
@@ -120,6 +139,26 @@ class take_object {
 
     //Filter-specific variables
 	int std_dev_filter_N;
+    mean_filter * mf = NULL;
+
+    //Per-frame processing shared by all camera sources
+    frame_pipeline pipeline;
+    void setupPipeline();
+    void processFrame(frame_c * frame, const uint16_t * source,
+                      std::chrono::steady_clock::time_point begintp);
+    const uint16_t * ingestSource = NULL; // camera buffer of the frame being processed
+    unsigned int acquireTimer = 0; // waiting for the camera to deliver the frame
+    unsigned int frameTimer = 0; // the whole loop, start to start
+    // From the kernel receive time of the frame's last packet, for network sources:
+    unsigned int wireSpreadTimer = 0; // first to last packet of the frame
+    unsigned int wireFrameTimer = 0; // until the frame_c holds the corrected frame
+    unsigned int wireShmTimer = 0; // until it is in shared memory
+    unsigned int wireSaveTimer = 0; // until it is queued for saving
+    void recordWireLatency(unsigned int timer, frame_c * frame);
+    std::chrono::steady_clock::time_point lastLatencyPublish;
+    std::chrono::steady_clock::time_point lastLatencyDump;
+    void publishLatency(std::chrono::steady_clock::time_point now);
+    void finishFrame(std::chrono::steady_clock::time_point begintp);
 
     std_dev_filter* sdvf;
     int meanStartRow, meanHeight, meanStartCol, meanWidth; // dimensions used by the mean filter
@@ -131,6 +170,12 @@ class take_object {
     bool do_raw_save;
 	bool saveFrameAvailable;
 	uint16_t * raw_save_ptr;
+    uint16_t * saving_pool = NULL; // SAVE_QUEUE_DEPTH frames, allocated once the geometry is known
+    spsc_queue<uint16_t *> * saving_free = NULL; // empty pool frames, returned by the saving thread
+    std::atomic <uint_fast32_t> save_stalls; // times acquisition waited on a ring slot still pinned for saving
+    bool queueFrameForSaving(frame_c * frame); // false if the frame was dropped
+    void releaseSavedFrame(const saveQueueItem &item);
+    void waitForSaveRelease(frame_c * frame);
 
 public:
     take_object(int channel_num = 0, int number_of_buffers = 64,
@@ -146,11 +191,13 @@ public:
     camControlType* getCamControl();
     dark_subtraction_filter* dsf;
     camera_t cam_type;
-    frame_c * frame_ring_buffer;
+    frame_c * frame_ring_buffer = NULL; // ringDepth slots, allocated in start() once the geometry is known
     unsigned long count = 0; // running frame counter
     int xioCount = 0; // counter for each set of xio files.
     uint16_t* prior_temp_frame = NULL;
     int getMicroSecondsPerFrame();
+    // Packet and sender clock statistics of network cameras, all zero for other sources.
+    camStreamStatsType getStreamStats();
 
     //Frame filters that affect everything at the raw data level
     void setInversion(bool checked, unsigned int factor);
@@ -182,7 +229,8 @@ public:
     void startSavingRaws(std::string raw_file_name, unsigned int frames_to_save, unsigned int num_avgs_save);
 	void stopSavingRaws();
     //void panicSave(std::string);
-    std::list<uint16_t *> saving_list;
+    spsc_queue<saveQueueItem> * saving_queue = NULL; // filled frames waiting for the saving thread
+    std::atomic <uint_fast32_t> save_dropped; // frames not saved because the queue was full
 	std::atomic <uint_fast32_t> save_framenum;
 	std::atomic <uint_fast32_t> save_count;
 	unsigned int save_num_avgs;
@@ -191,10 +239,16 @@ public:
     unsigned int getDataHeight();
     unsigned int getFrameHeight();
     unsigned int getFrameWidth();
+    unsigned int getRingDepth();
     bool std_dev_ready();
     std::vector<float> * getHistogramBins();
     FFT_t getFFTtype();
 
+    // Processing pipeline, see setupPipeline() for the stage names
+    frame_pipeline * getPipeline();
+    bool setPipelineStageEnabled(std::string name, bool enabled);
+    std::string getLatencyReport();
+
 private:
     // PDV Camera Link:
     void pdv_loop();
@@ -233,6 +287,7 @@ private:
     void markFrameForChecking(uint16_t * frame);
     bool checkFrame(uint16_t *Frame);
     void clearAllRingBuffer();
+    void tuneThread(const char *cpuList, const char *threadName);
 
     std::streambuf *coutbuf;
     void errorMessage(const char* message);
@@ -43,12 +43,33 @@ struct takeOptionsType
     bool rtpCam = false;
     bool rtprgb = true;
     bool rtpNextGen = false;
+    unsigned int rtpBatchSize = 32; // packets per recvmmsg call for RTP NextGen, 1 for one recvfrom per packet
+    unsigned int rtpRecvTimeoutMs = 100; // RTP NextGen socket receive timeout, 0 to wait forever
+    bool rtpDirectPlacement = false; // RTP NextGen receives payloads straight into place in the frame
+    unsigned int rtpSpinMicros = 0; // longest time RTP NextGen spins for a new frame before sleeping, 0 to always sleep
+    unsigned int rtpShards = 1; // RTP NextGen receive threads, each with its own socket
+    bool rtpShardPorts = false; // shard n listens on rtpPort+n, instead of all shards sharing rtpPort with SO_REUSEPORT
+    bool rtpPacketRing = false; // RTP NextGen reads packets from a memory-mapped AF_PACKET ring instead of the UDP socket
+    float rtpBufferSeconds = 2.0; // depth of the RTP NextGen packet buffer, in seconds of data
+    const char* rtpReplayFile = NULL; // RTP NextGen reads packets from this pcap or pcapng file instead of the network
+    bool rtpReplayFast = false; // replay as fast as possible rather than at the captured timing
+    bool rtpReplayLoop = false; // start the replay over at the end of the file
 
     bool er2mode = false;
     bool headless = false;
     bool noGPU = false;
 
     bool useSHM = false;
+    bool zeroCopySave = false; // record directly out of frame_ring_buffer
+    bool directIO = false; // write recordings with direct_writer instead of stdio
+    unsigned int ringBufferFrames = 0; // frame_ring_buffer depth, 0 for CPU_FRAME_BUFFER_SIZE
+    unsigned int latencyDumpSeconds = 0; // print the pipeline latency report this often, 0 to disable
+
+    // CPU lists such as "2" or "2-3", NULL to leave the threads wherever the scheduler puts them.
+    const char* cpuAcquire = NULL; // threads that receive from the camera: PDVCAM, READING, RTP(NG) Stream
+    const char* cpuConsume = NULL; // threads that copy frames into frame_ring_buffer: XIOCAM, RTP(NG) Consume
+    int rtPriority = 0; // SCHED_FIFO priority for both kinds, 0 to leave them SCHED_OTHER
+    bool numaLocal = false; // fault in frame_ring_buffer from the thread that fills it
 
     uint16_t height;
     uint16_t width;
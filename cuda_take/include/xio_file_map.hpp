@@ -0,0 +1,62 @@
+#ifndef XIO_FILE_MAP_HPP_
+#define XIO_FILE_MAP_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "cudalog.h"
+
+/*! \file
+ * \brief Memory-mapped access to the frames of a recorded .xio, .decomp or .raw file.
+ *
+ * The whole file is mapped read-only and each frame is handed out as a pointer into the mapping, so replaying a
+ * file costs no allocation and no copy until the frame is used. The kernel is told the file is read sequentially,
+ * and willNeed() asks it to start reading the frames that come next. When the file is closed its pages are dropped
+ * from the page cache, so replaying a long archive does not fill memory with data that will not be used again.
+ *
+ * Layouts:
+ *  .xio     header of xioHeaderBytes, data size in header bytes 4 to 7 (little-endian), xioFrames frames
+ *  .decomp  header of xioHeaderBytes, xioFrames frames filling the rest of the file
+ *  .raw     no header, as many whole frames of the given geometry as fit
+ */
+
+class xio_file_map
+{
+public:
+    xio_file_map();
+    ~xio_file_map();
+
+    /*! \brief Map fname and work out where its frames are. frameBytes is the size of one frame of the
+     * camera geometry, used to count the frames of .raw files. False if the file is unreadable or holds no frames. */
+    bool open(const std::string &fname, size_t frameBytes, size_t xioHeaderBytes, unsigned int xioFrames);
+    void close();
+    bool isOpen() { return map != NULL; }
+
+    const std::string &fileName() { return name; }
+    unsigned int frameCount() { return frames; }
+    /*! \brief Bytes per frame in the file, which may be fewer than a whole camera frame. */
+    size_t frameBytes() { return bytesPerFrame; }
+    /*! \brief Frame n, valid until the file is closed. */
+    const uint16_t *frame(unsigned int n);
+    /*! \brief Ask the kernel to read frames first to first+count-1 ahead of use. */
+    void willNeed(unsigned int first, unsigned int count);
+    /*! \brief Start reading the beginning of the file from disk, before any frame is used. */
+    void prefetch(size_t bytes);
+    /*! \brief Fault frame n in now, so that whoever uses it later does not wait for the disk. */
+    void load(unsigned int n);
+
+private:
+    xio_file_map(const xio_file_map &);
+    xio_file_map &operator=(const xio_file_map &);
+
+    int fd;
+    uint8_t *map;
+    size_t mapBytes;
+    size_t headerBytes;
+    size_t bytesPerFrame;
+    unsigned int frames;
+    std::string name;
+};
+
+#endif /* XIO_FILE_MAP_HPP_ */
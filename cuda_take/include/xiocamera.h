@@ -13,7 +13,9 @@
 #include <algorithm>
 #include <chrono>
 #include <cstdio>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
 
 #ifdef FAIL_PLZ
 
@@ -32,17 +34,33 @@
 
 #include "cameramodel.h"
 #include "constants.h"
+#include "xio_file_map.hpp"
 
 #include "cudalog.h"
 
 #define TIMEOUT_DURATION 100
 #define guaranteedBufferFramesCount (3)
+// Frames of a mapped file the kernel is asked to read ahead of the one being used:
+#define XIO_WILLNEED_FRAMES (8)
+// Most frames readLoop() queues ahead of getFrame(). The reader waits for room beyond this,
+// so it runs at the rate frames are used and memory use does not depend on the file sizes.
+#define XIO_READAHEAD_FRAMES (64)
+// Bytes at the start of the next file that are read from disk while the current one plays:
+#define XIO_PREFETCH_BYTES (32*1024*1024)
 
 using namespace std::chrono;
 
 using std::cout;
 using std::endl;
 
+// One queued frame: a view into a mapped file, which the shared pointer keeps open.
+// file is NULL for the placeholder frames the camera starts with.
+struct xioFrameRef {
+    std::shared_ptr<xio_file_map> file;
+    unsigned int index;
+    const uint16_t *data;
+};
+
 class XIOCamera : public CameraModel
 {
 
@@ -65,13 +83,12 @@ public:
 
 private:
     std::string getFname();
-    void readFile();
+    std::shared_ptr<xio_file_map> openNextFile();
+    bool queueFile(std::shared_ptr<xio_file_map> file, unsigned int generation);
 
-    bool is_reading; // Flag that is true while reading from a directory
-    std::ifstream dev_p;
+    std::atomic_bool is_reading; // Flag that is true while reading from a directory
     std::string ifname;
     std::string data_dir;
-    std::streampos bufsize;
     int nFrames; // number of frames inside each file
     int nFramesXio;
     size_t framesize;
@@ -83,15 +100,18 @@ private:
 
     size_t image_no;
     std::vector<std::string> xio_files;
-    std::deque< std::vector<uint16_t> > frame_buf;
+    std::deque<xioFrameRef> frame_buf; // at most XIO_READAHEAD_FRAMES from files
     std::mutex frame_buf_lock;
-    std::vector<unsigned char> header;
+    std::condition_variable frame_buf_space; // signalled when getFrame() takes a frame
+    std::condition_variable frame_buf_ready; // signalled when readLoop() queues one
+    unsigned int dirGeneration = 0; // changed by setDir(), so that the reader drops frames of the old directory
+    std::vector<uint16_t> startupFrames; // backs the placeholder frames
+    std::shared_ptr<xio_file_map> doneFile; // keeps doneFramePtr valid when it points into a file
     std::vector<uint16_t> dummy;
     uint16_t *dummyPtr = NULL;
     uint16_t *guaranteedBufferFrames[guaranteedBufferFramesCount] = {NULL};
     int gbPos = 0;
     uint16_t *doneFramePtr = NULL;
-    std::vector<uint16_t> temp_frame;
 
     camControlType *camcontrol = NULL;
 
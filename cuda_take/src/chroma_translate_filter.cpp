@@ -1,5 +1,6 @@
 #include "chroma_translate_filter.hpp"
 #include <iostream>
+#include <cstring>
 #include "camera_types.h"
 
 void setup_filter(camera_t camera_type)
@@ -24,26 +25,43 @@ void setup_filter(unsigned int h, unsigned int w)
 
 uint16_t* apply_chroma_translate_filter(uint16_t *picture_in)
 {
-    unsigned int row, col;
-    //unsigned int div, mod;
-    for(row = 0; row < frHeight; row++)
-	{
-        for(col = 0; col< frWidth; col++)
-		{
-            //div = col/num_taps;
-            //mod = col%num_taps;
-            //pic_buffer[div + TAP_WIDTH * mod + row * frWidth] = (MAX_VAL - picture_in[col + row * frWidth]);
-            pic_buffer[col + row * frWidth] = (picture_in[col + row * frWidth] ^ (1<<15)); // normal 2s compliment
-
-            //pic_buffer[col + row * frWidth] = (picture_in[col + row * frWidth] ^ (1<<15)) - (1<<14); // for EMIT data
-            //pic_buffer[col + row * frWidth] = picture_in[col + row * frWidth];
-            //pic_buffer[col + row * frWidth] = col + row * frWidth;
-            //picture_in[col + row * frWidth] = col + row * frWidth;
-
-		}
-	}
-    // memcpy(picture_in,pic_buffer,MAX_SIZE*sizeof(uint16_t));
-    memcpy(picture_in,pic_buffer,frHeight*frWidth*sizeof(uint16_t));
+    // normal 2s compliment, in place
+    apply_raw_correction(picture_in, picture_in, (size_t)frHeight*frWidth, true, false, 0);
 	return picture_in;
 }
 
+void apply_raw_correction(uint16_t *out, const uint16_t *in, size_t pixels,
+                          bool remap, bool invert, unsigned int invFactor,
+                          int statusPixel, uint16_t statusValue)
+{
+    /*! \brief Copy in to out, applying the 2s compliment flip and the inversion on the way.
+     *
+     * out may be the same buffer as in. Each case is a separate loop without branches inside,
+     * so that the compiler can vectorize it. A negative statusPixel leaves the status pixel alone.
+     */
+    const uint16_t flip = remap ? (1<<15) : 0;
+    const uint16_t factor = (uint16_t)invFactor;
+
+    if(invert)
+    {
+        // record the data from high to low
+#pragma omp simd
+        for(size_t i = 0; i < pixels; i++)
+        {
+            out[i] = (uint16_t)(factor - (in[i] ^ flip));
+        }
+    } else if(remap) {
+#pragma omp simd
+        for(size_t i = 0; i < pixels; i++)
+        {
+            out[i] = in[i] ^ flip;
+        }
+    } else if(out != in) {
+        memcpy(out, in, pixels*sizeof(uint16_t));
+    }
+
+    if((statusPixel >= 0) && ((size_t)statusPixel < pixels))
+    {
+        out[statusPixel] = statusValue;
+    }
+}
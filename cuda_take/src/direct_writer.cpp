@@ -0,0 +1,348 @@
+#include "direct_writer.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+direct_writer::direct_writer()
+{
+    fd = -1;
+    directIO = false;
+    failed = false;
+    currentBatch = 0;
+    submitOffset = 0;
+    logicalBytes = 0;
+    allocatedBytes = 0;
+    pwriteStop = false;
+    for(unsigned int b=0; b < DIRECT_WRITER_BATCH_COUNT; b++)
+    {
+        batches[b].buf = NULL;
+        batches[b].used = 0;
+        batches[b].offset = 0;
+        batches[b].inFlight = false;
+    }
+#ifdef USE_IO_URING
+    ringValid = false;
+#endif
+}
+
+direct_writer::~direct_writer()
+{
+    if(fd >= 0)
+        close();
+    release();
+}
+
+bool direct_writer::open(const std::string &fname, size_t expectedBytes)
+{
+    if(fd >= 0)
+    {
+        LOG << "Writer is already open, not opening " << fname;
+        return false;
+    }
+
+    failed = false;
+    currentBatch = 0;
+    submitOffset = 0;
+    logicalBytes = 0;
+    allocatedBytes = 0;
+
+    fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    directIO = (fd >= 0);
+    if((fd < 0) && (errno == EINVAL))
+    {
+        // Some filesystems (tmpfs, some network mounts) do not support O_DIRECT.
+        LOG << "O_DIRECT not supported for " << fname << ", using buffered writes.";
+        fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if(fd < 0)
+    {
+        LOG << "Could not open " << fname << ": " << strerror(errno);
+        return false;
+    }
+
+    for(unsigned int b=0; b < DIRECT_WRITER_BATCH_COUNT; b++)
+    {
+        if(posix_memalign((void **)&batches[b].buf, DIRECT_WRITER_ALIGNMENT, DIRECT_WRITER_BATCH_BYTES) != 0)
+        {
+            LOG << "Could not allocate aligned write buffers.";
+            batches[b].buf = NULL;
+            ::close(fd);
+            fd = -1;
+            release();
+            return false;
+        }
+        batches[b].used = 0;
+        batches[b].inFlight = false;
+    }
+
+    bool needPwriter = true;
+#ifdef USE_IO_URING
+    ringValid = (io_uring_queue_init(DIRECT_WRITER_BATCH_COUNT, &ring, 0) == 0);
+    if(!ringValid)
+    {
+        LOG << "io_uring is not available, using pwrite.";
+    }
+    needPwriter = !ringValid;
+#endif
+    if(needPwriter)
+    {
+        pwriteStop = false;
+        pwriter = std::thread(&direct_writer::pwriteLoop, this);
+    }
+
+    if(expectedBytes != 0)
+    {
+        preallocate((off_t)expectedBytes);
+    } else {
+        preallocate(DIRECT_WRITER_PREALLOC_STEP);
+    }
+
+    return true;
+}
+
+bool direct_writer::write(const void *data, size_t bytes)
+{
+    if((fd < 0) || failed)
+        return false;
+
+    const unsigned char *src = (const unsigned char *)data;
+    while(bytes > 0)
+    {
+        batch &cur = batches[currentBatch];
+        size_t n = DIRECT_WRITER_BATCH_BYTES - cur.used;
+        if(n > bytes)
+            n = bytes;
+        memcpy(cur.buf + cur.used, src, n);
+        cur.used += n;
+        src += n;
+        bytes -= n;
+        logicalBytes += n;
+
+        if(cur.used == DIRECT_WRITER_BATCH_BYTES)
+        {
+            if(!submitBatch(currentBatch, DIRECT_WRITER_BATCH_BYTES))
+                return false;
+            currentBatch = (currentBatch + 1) % DIRECT_WRITER_BATCH_COUNT;
+            if(!waitForBatch(currentBatch))
+                return false;
+            batches[currentBatch].used = 0;
+        }
+    }
+    return true;
+}
+
+bool direct_writer::close()
+{
+    if(fd < 0)
+        return false;
+
+    batch &cur = batches[currentBatch];
+    if((cur.used != 0) && !failed)
+    {
+        // O_DIRECT needs whole blocks, so pad the last one out and trim the file afterwards.
+        size_t padded = (cur.used + DIRECT_WRITER_ALIGNMENT - 1) & ~(DIRECT_WRITER_ALIGNMENT - 1);
+        memset(cur.buf + cur.used, 0, padded - cur.used);
+        submitBatch(currentBatch, padded);
+    }
+    for(unsigned int b=0; b < DIRECT_WRITER_BATCH_COUNT; b++)
+    {
+        waitForBatch(b);
+    }
+
+    if(ftruncate(fd, logicalBytes) != 0)
+    {
+        LOG << "Could not set final file length: " << strerror(errno);
+        failed = true;
+    }
+    ::close(fd);
+    fd = -1;
+    release();
+
+    return !failed;
+}
+
+bool direct_writer::submitBatch(unsigned int b, size_t length)
+{
+    preallocate(submitOffset + (off_t)length);
+
+#ifdef USE_IO_URING
+    if(ringValid)
+    {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        while(sqe == NULL)
+        {
+            if(!reapOne())
+                return false;
+            sqe = io_uring_get_sqe(&ring);
+        }
+        io_uring_prep_write(sqe, fd, batches[b].buf, length, submitOffset);
+        io_uring_sqe_set_data(sqe, &batches[b]);
+        batches[b].used = length;
+        batches[b].inFlight = true;
+        if(io_uring_submit(&ring) < 0)
+        {
+            LOG << "io_uring submit failed.";
+            batches[b].inFlight = false;
+            failed = true;
+            return false;
+        }
+        submitOffset += length;
+        return true;
+    }
+#endif
+
+    // Hand the batch to the pwrite thread, which writes batches in the order they are queued.
+    batches[b].used = length;
+    batches[b].offset = submitOffset;
+    {
+        std::lock_guard<std::mutex> lock(pwriteLock);
+        batches[b].inFlight = true;
+        pwriteQueue.push_back(b);
+    }
+    pwriteQueued.notify_one();
+    submitOffset += length;
+    return !failed;
+}
+
+bool direct_writer::waitForBatch(unsigned int b)
+{
+#ifdef USE_IO_URING
+    if(ringValid)
+    {
+        while(batches[b].inFlight)
+        {
+            if(!reapOne())
+                return false;
+        }
+        return !failed;
+    }
+#endif
+    std::unique_lock<std::mutex> lock(pwriteLock);
+    while(batches[b].inFlight)
+    {
+        pwriteDone.wait(lock);
+    }
+    return !failed;
+}
+
+bool direct_writer::pwriteBatch(unsigned int b)
+{
+    size_t length = batches[b].used;
+    off_t offset = batches[b].offset;
+    size_t done = 0;
+    while(done < length)
+    {
+        ssize_t rtn = pwrite(fd, batches[b].buf + done, length - done, offset + done);
+        if(rtn < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            LOG << "Write failed at offset " << (offset + done) << ": " << strerror(errno);
+            failed = true;
+            return false;
+        }
+        done += rtn;
+    }
+    return true;
+}
+
+void direct_writer::pwriteLoop()
+{
+    std::unique_lock<std::mutex> lock(pwriteLock);
+    while(true)
+    {
+        while(pwriteQueue.empty() && !pwriteStop)
+        {
+            pwriteQueued.wait(lock);
+        }
+        if(pwriteQueue.empty())
+            break;
+
+        unsigned int b = pwriteQueue.front();
+        lock.unlock();
+        // After a failure the rest of the file is unusable, just retire the batches.
+        if(!failed)
+            pwriteBatch(b);
+        lock.lock();
+
+        pwriteQueue.pop_front();
+        batches[b].inFlight = false;
+        pwriteDone.notify_all();
+    }
+}
+
+#ifdef USE_IO_URING
+bool direct_writer::reapOne()
+{
+    struct io_uring_cqe *cqe = NULL;
+    if(io_uring_wait_cqe(&ring, &cqe) < 0)
+    {
+        LOG << "io_uring wait failed.";
+        failed = true;
+        for(unsigned int b=0; b < DIRECT_WRITER_BATCH_COUNT; b++)
+            batches[b].inFlight = false;
+        return false;
+    }
+    batch *done = (batch *)io_uring_cqe_get_data(cqe);
+    if((cqe->res < 0) || ((size_t)cqe->res != done->used))
+    {
+        LOG << "Write failed, result " << cqe->res << " for " << done->used << " bytes.";
+        failed = true;
+    }
+    done->inFlight = false;
+    io_uring_cqe_seen(&ring, cqe);
+    return true;
+}
+#endif
+
+bool direct_writer::preallocate(off_t upTo)
+{
+    // Reserving the blocks ahead of time keeps the filesystem from
+    // fragmenting the file and from allocating inside each write.
+    if(upTo <= allocatedBytes)
+        return true;
+
+    off_t target = allocatedBytes + DIRECT_WRITER_PREALLOC_STEP;
+    if(target < upTo)
+        target = upTo;
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, allocatedBytes, target - allocatedBytes) != 0)
+    {
+        LL(2) << "fallocate not available: " << strerror(errno);
+        // Do not try again for this file.
+        allocatedBytes = (off_t)1 << 62;
+        return false;
+    }
+    allocatedBytes = target;
+    return true;
+}
+
+void direct_writer::release()
+{
+    if(pwriter.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(pwriteLock);
+            pwriteStop = true;
+        }
+        pwriteQueued.notify_one();
+        pwriter.join();
+    }
+#ifdef USE_IO_URING
+    if(ringValid)
+    {
+        io_uring_queue_exit(&ring);
+        ringValid = false;
+    }
+#endif
+    for(unsigned int b=0; b < DIRECT_WRITER_BATCH_COUNT; b++)
+    {
+        free(batches[b].buf);
+        batches[b].buf = NULL;
+        batches[b].used = 0;
+        batches[b].offset = 0;
+        batches[b].inFlight = false;
+    }
+}
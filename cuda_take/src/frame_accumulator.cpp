@@ -0,0 +1,77 @@
+#include "frame_accumulator.hpp"
+
+#include <cstddef>
+
+frame_accumulator::frame_accumulator(unsigned int width, unsigned int height, unsigned int bands)
+{
+    this->width = width;
+    this->height = height;
+    this->bands = (bands == 0) ? 1 : bands;
+    accum = new uint32_t[(size_t)width*height];
+    frames = 0;
+}
+
+frame_accumulator::~frame_accumulator()
+{
+    delete[] accum;
+}
+
+void frame_accumulator::add(const uint16_t * frame)
+{
+    const size_t w = width;
+    uint32_t * acc = accum;
+
+    if(frames == 0)
+    {
+        // The first frame replaces the sum, which saves clearing it.
+#pragma omp parallel for num_threads(bands) if(bands > 1)
+        for(int r = 0; r < (int)height; r++)
+        {
+            const uint16_t * in = frame + r*w;
+            uint32_t * row = acc + r*w;
+#pragma omp simd
+            for(size_t c = 0; c < w; c++)
+            {
+                row[c] = in[c];
+            }
+        }
+    } else {
+#pragma omp parallel for num_threads(bands) if(bands > 1)
+        for(int r = 0; r < (int)height; r++)
+        {
+            const uint16_t * in = frame + r*w;
+            uint32_t * row = acc + r*w;
+#pragma omp simd
+            for(size_t c = 0; c < w; c++)
+            {
+                row[c] += in[c];
+            }
+        }
+    }
+    frames++;
+}
+
+void frame_accumulator::mean(float * out)
+{
+    const size_t w = width;
+    const uint32_t * acc = accum;
+    const float n = (frames == 0) ? 1.0f : (float)frames;
+
+#pragma omp parallel for num_threads(bands) if(bands > 1)
+    for(int r = 0; r < (int)height; r++)
+    {
+        const uint32_t * row = acc + r*w;
+        float * dst = out + r*w;
+#pragma omp simd
+        for(size_t c = 0; c < w; c++)
+        {
+            dst[c] = (float)row[c] / n;
+        }
+    }
+    frames = 0;
+}
+
+void frame_accumulator::reset()
+{
+    frames = 0;
+}
@@ -0,0 +1,172 @@
+#include "frame_pipeline.hpp"
+
+#include <chrono>
+#include <cstdio>
+
+frame_pipeline::frame_pipeline()
+{
+    timing = true;
+}
+
+unsigned int frame_pipeline::addStage(const std::string &name, stageFunction fn, bool enabled)
+{
+    return addStage(name, fn, stageFunction(), enabled);
+}
+
+unsigned int frame_pipeline::addStage(const std::string &name, stageFunction fn, stageFunction bypass, bool enabled)
+{
+    stages.emplace_back();
+    stage &s = stages.back();
+    s.name = name;
+    s.fn = fn;
+    s.bypass = bypass;
+    s.enabled = enabled;
+    return stages.size() - 1;
+}
+
+unsigned int frame_pipeline::addTimer(const std::string &name)
+{
+    return addStage(name, stageFunction(), true);
+}
+
+void frame_pipeline::record(unsigned int stage, uint64_t nanos)
+{
+    if(stage < stages.size())
+        stages[stage].latency.record(nanos);
+}
+
+void frame_pipeline::run(frame_c * frame)
+{
+    const bool timed = timing.load(std::memory_order_relaxed);
+    std::chrono::steady_clock::time_point begin;
+    std::chrono::steady_clock::time_point end;
+
+    for(size_t n=0; n < stages.size(); n++)
+    {
+        stage &s = stages[n];
+        // The enabled flag is read once, so a stage switched while a frame
+        // is in flight runs either fn or bypass, never neither.
+        const stageFunction &fn = s.enabled.load(std::memory_order_relaxed) ? s.fn : s.bypass;
+        if(!fn)
+            continue;
+
+        if(!timed)
+        {
+            fn(frame);
+            continue;
+        }
+
+        begin = std::chrono::steady_clock::now();
+        fn(frame);
+        end = std::chrono::steady_clock::now();
+
+        s.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count());
+    }
+}
+
+unsigned int frame_pipeline::stageCount()
+{
+    return stages.size();
+}
+
+std::string frame_pipeline::stageName(unsigned int stage)
+{
+    if(stage >= stages.size())
+        return std::string();
+    return stages[stage].name;
+}
+
+int frame_pipeline::findStage(const std::string &name)
+{
+    for(size_t n=0; n < stages.size(); n++)
+    {
+        if(stages[n].name == name)
+            return n;
+    }
+    return -1;
+}
+
+bool frame_pipeline::setStageEnabled(unsigned int stage, bool enabled)
+{
+    if(stage >= stages.size())
+        return false;
+    stages[stage].enabled = enabled;
+    return true;
+}
+
+bool frame_pipeline::setStageEnabled(const std::string &name, bool enabled)
+{
+    int stage = findStage(name);
+    if(stage < 0)
+        return false;
+    return setStageEnabled((unsigned int)stage, enabled);
+}
+
+bool frame_pipeline::stageEnabled(unsigned int stage)
+{
+    if(stage >= stages.size())
+        return false;
+    return stages[stage].enabled;
+}
+
+void frame_pipeline::setTiming(bool enabled)
+{
+    timing = enabled;
+}
+
+bool frame_pipeline::timingEnabled()
+{
+    return timing.load(std::memory_order_relaxed);
+}
+
+pipelineStageStats frame_pipeline::getStageStats(unsigned int stage)
+{
+    pipelineStageStats stats;
+    stats.frames = 0;
+    stats.totalNanos = 0;
+    stats.maxNanos = 0;
+    if(stage < stages.size())
+    {
+        stats.frames = stages[stage].latency.count();
+        stats.totalNanos = stages[stage].latency.sum();
+        stats.maxNanos = stages[stage].latency.max();
+    }
+    return stats;
+}
+
+latency_histogram * frame_pipeline::getStageHistogram(unsigned int stage)
+{
+    if(stage >= stages.size())
+        return NULL;
+    return &stages[stage].latency;
+}
+
+std::string frame_pipeline::latencyReport()
+{
+    std::string report;
+    char line[160];
+    snprintf(line, sizeof(line), "%-12s %10s %9s %9s %9s %9s %9s (us)\n",
+             "stage", "frames", "mean", "p50", "p90", "p99", "max");
+    report += line;
+    for(size_t n=0; n < stages.size(); n++)
+    {
+        latency_histogram &h = stages[n].latency;
+        uint64_t frames = h.count();
+        snprintf(line, sizeof(line), "%-12s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f%s\n",
+                 stages[n].name.c_str(), (unsigned long long)frames,
+                 frames ? h.sum() / 1000.0 / frames : 0.0,
+                 h.percentile(0.50) / 1000.0, h.percentile(0.90) / 1000.0,
+                 h.percentile(0.99) / 1000.0, h.max() / 1000.0,
+                 stages[n].enabled ? "" : " (disabled)");
+        report += line;
+    }
+    return report;
+}
+
+void frame_pipeline::resetStats()
+{
+    for(size_t n=0; n < stages.size(); n++)
+    {
+        stages[n].latency.reset();
+    }
+}
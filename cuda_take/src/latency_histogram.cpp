@@ -0,0 +1,98 @@
+#include "latency_histogram.hpp"
+
+latency_histogram::latency_histogram()
+{
+    reset();
+}
+
+unsigned int latency_histogram::bucketFor(uint64_t nanos)
+{
+    // Values 0-3 get a bucket each. Above that, the index is four times the
+    // position of the highest set bit plus the two bits that follow it.
+    if(nanos < 4)
+        return (unsigned int)nanos;
+    unsigned int msb = 63 - __builtin_clzll(nanos);
+    unsigned int sub = (nanos >> (msb - 2)) & 3;
+    unsigned int bucket = 4*(msb - 1) + sub;
+    return (bucket < bucketCount) ? bucket : bucketCount - 1;
+}
+
+uint64_t latency_histogram::bucketUpperBound(unsigned int bucket)
+{
+    if(bucket < 4)
+        return bucket;
+    if(bucket >= bucketCount - 1)
+        return UINT64_MAX;
+    unsigned int msb = bucket/4 + 1;
+    unsigned int sub = bucket%4;
+    uint64_t lower = (uint64_t)(4 + sub) << (msb - 2);
+    return lower + ((uint64_t)1 << (msb - 2)) - 1;
+}
+
+void latency_histogram::record(uint64_t nanos)
+{
+    // Single writer, so plain load and store avoid locked read-modify-write instructions.
+    std::atomic<uint64_t> &b = buckets[bucketFor(nanos)];
+    b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    samples.store(samples.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    total.store(total.load(std::memory_order_relaxed) + nanos, std::memory_order_relaxed);
+    if(nanos > maxNanos.load(std::memory_order_relaxed))
+        maxNanos.store(nanos, std::memory_order_relaxed);
+}
+
+void latency_histogram::reset()
+{
+    for(unsigned int b=0; b < bucketCount; b++)
+        buckets[b].store(0, std::memory_order_relaxed);
+    samples.store(0, std::memory_order_relaxed);
+    total.store(0, std::memory_order_relaxed);
+    maxNanos.store(0, std::memory_order_relaxed);
+}
+
+uint64_t latency_histogram::count()
+{
+    return samples.load(std::memory_order_relaxed);
+}
+
+uint64_t latency_histogram::sum()
+{
+    return total.load(std::memory_order_relaxed);
+}
+
+uint64_t latency_histogram::max()
+{
+    return maxNanos.load(std::memory_order_relaxed);
+}
+
+uint64_t latency_histogram::percentile(double fraction)
+{
+    uint64_t counts[bucketCount];
+    uint64_t n = 0;
+    for(unsigned int b=0; b < bucketCount; b++)
+    {
+        counts[b] = buckets[b].load(std::memory_order_relaxed);
+        n += counts[b];
+    }
+    if(n == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)(fraction * n + 0.5);
+    if(target < 1)
+        target = 1;
+    if(target > n)
+        target = n;
+
+    uint64_t seen = 0;
+    for(unsigned int b=0; b < bucketCount; b++)
+    {
+        seen += counts[b];
+        if(seen >= target)
+        {
+            // Never report more than the largest value actually seen.
+            uint64_t bound = bucketUpperBound(b);
+            uint64_t m = max();
+            return (m != 0 && m < bound) ? m : bound;
+        }
+    }
+    return max();
+}
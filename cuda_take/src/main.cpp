@@ -31,7 +31,7 @@ void simple_sensor_grab()
 		usleep(1000000);
 		//if(c==3)
 			//to.startSavingRaws("ruhroh.raw",1000);
-		//printf("save framenum %u, listsize %u", to.save_framenum, to.saving_list.size());
+		//printf("save framenum %u, listsize %u", to.save_framenum, to.saving_queue->size());
 		c++;
 	}
 	//delete to;
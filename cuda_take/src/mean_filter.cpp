@@ -2,6 +2,96 @@
 #include "fft.hpp"
 #include <atomic>
 #include <stdio.h>
+#include <string.h>
+#include <omp.h>
+
+namespace {
+
+/*! \brief Arguments for profileSweep(), in frame coordinates. */
+struct profileRegion {
+    int beginRow;
+    int endRow;
+    int beginCol;
+    int endCol;
+    int frWidth;
+    int lh_start;
+    int lh_end;
+    int rh_start;
+    int rh_end;
+    bool tap;
+};
+
+/*! \brief Sum the vertical, horizontal, LH, RH and tap profiles in one pass over the frame.
+ *
+ * Rows are split into MEAN_FILTER_BANDS bands. Each row is read once, while it is in cache, for all of the profiles.
+ * Row sums go straight into the vertical profiles, since each row belongs to exactly one band. Column sums go into
+ * a horizontal profile per band, and the bands are added together at the end, so no two threads write the same value.
+ * Instantiated for uint16_t (raw image data) and float (dark subtracted data).
+ */
+template <typename T>
+void profileSweep(const T *data, const profileRegion &reg,
+                  float *vertical, float *vertical_lh, float *vertical_rh,
+                  float *horizontal, float *partial, int partialStride, float *tap_profile)
+{
+    // The LH and RH profiles cover every row down to endRow; the ROI profiles start at beginRow.
+    const int beginCol = reg.beginCol;
+    const int endCol = reg.endCol;
+    const int frWidth = reg.frWidth;
+
+    #pragma omp parallel num_threads(MEAN_FILTER_BANDS)
+    {
+        float *hp = partial + omp_get_thread_num() * partialStride;
+
+        #pragma omp for schedule(static)
+        for(int r = 0; r < reg.endRow; r++)
+        {
+            const T *row = data + (size_t)r * frWidth;
+
+            float lhSum = 0;
+            #pragma omp simd reduction(+:lhSum)
+            for(int c = reg.lh_start; c < reg.lh_end; c++)
+                lhSum += row[c];
+            vertical_lh[r] = lhSum;
+
+            float rhSum = 0;
+            #pragma omp simd reduction(+:rhSum)
+            for(int c = reg.rh_start; c < reg.rh_end; c++)
+                rhSum += row[c];
+            vertical_rh[r] = rhSum;
+
+            if(r < reg.beginRow)
+                continue;
+
+            float rowSum = 0;
+            #pragma omp simd reduction(+:rowSum)
+            for(int c = beginCol; c < endCol; c++)
+            {
+                const float v = row[c];
+                rowSum += v;
+                hp[c] += v;
+            }
+            vertical[r] = rowSum;
+
+            if(reg.tap)
+            {
+                // Later columns overwrite earlier ones with the same tap offset, as they always have.
+                for(int c = beginCol; c < endCol; c++)
+                    tap_profile[r * TAP_WIDTH + c % TAP_WIDTH] = row[c];
+            }
+        }
+
+        #pragma omp for schedule(static)
+        for(int c = beginCol; c < endCol; c++)
+        {
+            float sum = 0;
+            for(unsigned int b = 0; b < MEAN_FILTER_BANDS; b++)
+                sum += partial[b * partialStride + c];
+            horizontal[c] = sum;
+        }
+    }
+}
+
+}
 
 mean_filter::mean_filter(frame_c * frame,unsigned long frame_count,int startCol,\
                          int endCol,int startRow,int endRow,int actualWidth, \
@@ -10,34 +100,22 @@ mean_filter::mean_filter(frame_c * frame,unsigned long frame_count,int startCol,
                          int cent_start, int cent_end,\
                          int rh_start, int rh_end)
 {
-    beginCol = startCol;
-    width = endCol;
-    beginRow = startRow;
-    height = endRow;
-    frWidth = actualWidth;
-
-    this->frame = frame;
-    this->frame_count = frame_count;
-    this->useDSF = useDSF;
-    this->FFTtype = FFTtype;
-
-    // copy the latest overlay parameters from the frame:
-    // new with every frame... bad idea
-    this->lh_start = lh_start;
-    this->lh_end = lh_end;
-    this->cent_start = cent_start;
-    this->cent_end = cent_end;
-    this->rh_start = rh_start;
-    this->rh_end = rh_end;
-    doThreadWork.store(false);
-    runningMF.store(true);
+    requestedSeq = 0;
+    completedSeq = 0;
+    runningMF = true;
+    update(frame, frame_count, startCol, endCol, startRow, endRow, actualWidth,
+           useDSF, FFTtype, lh_start, lh_end, cent_start, cent_end, rh_start, rh_end);
     mean_thread = boost::thread(&mean_filter::threadEntry, this);
 }
 
 mean_filter::~mean_filter()
 {
-    runningMF.store(false);
-    usleep(200);
+    {
+        std::lock_guard<std::mutex> lock(locking_mutex);
+        runningMF = false;
+    }
+    workReady.notify_all();
+    mean_thread.join();
 }
 
 void mean_filter::update(frame_c * frame,unsigned long frame_count,int startCol,\
@@ -47,25 +125,24 @@ void mean_filter::update(frame_c * frame,unsigned long frame_count,int startCol,
                          int cent_start, int cent_end,\
                          int rh_start, int rh_end)
 {
-    beginCol = startCol;
-    width = endCol;
-    beginRow = startRow;
-    height = endRow;
-    frWidth = actualWidth;
-
-    this->frame = frame;
-    this->frame_count = frame_count;
-    this->useDSF = useDSF;
-    this->FFTtype = FFTtype;
+    std::lock_guard<std::mutex> lock(locking_mutex);
+    pending.frame = frame;
+    pending.frame_count = frame_count;
+    pending.beginCol = startCol;
+    pending.width = endCol;
+    pending.beginRow = startRow;
+    pending.height = endRow;
+    pending.frWidth = actualWidth;
+    pending.useDSF = useDSF;
+    pending.FFTtype = FFTtype;
 
     // copy the latest overlay parameters from the frame:
-    // new with every frame... bad idea
-    this->lh_start = lh_start;
-    this->lh_end = lh_end;
-    this->cent_start = cent_start;
-    this->cent_end = cent_end;
-    this->rh_start = rh_start;
-    this->rh_end = rh_end;
+    pending.lh_start = lh_start;
+    pending.lh_end = lh_end;
+    pending.cent_start = cent_start;
+    pending.cent_end = cent_end;
+    pending.rh_start = rh_start;
+    pending.rh_end = rh_end;
 }
 
 void mean_filter::updateParameters(unsigned long frame_count,int startCol,\
@@ -75,43 +152,58 @@ void mean_filter::updateParameters(unsigned long frame_count,int startCol,\
                          int cent_start, int cent_end,\
                          int rh_start, int rh_end)
 {
-    beginCol = startCol;
-    width = endCol;
-    beginRow = startRow;
-    height = endRow;
-    frWidth = actualWidth;
-
-    this->frame_count = frame_count;
-    this->useDSF = useDSF;
-    this->FFTtype = FFTtype;
-
-    // copy the latest overlay parameters from the frame:
-    // new with every frame... bad idea
-    this->lh_start = lh_start;
-    this->lh_end = lh_end;
-    this->cent_start = cent_start;
-    this->cent_end = cent_end;
-    this->rh_start = rh_start;
-    this->rh_end = rh_end;
+    frame_c * frame;
+    {
+        std::lock_guard<std::mutex> lock(locking_mutex);
+        frame = pending.frame;
+    }
+    update(frame, frame_count, startCol, endCol, startRow, endRow, actualWidth,
+           useDSF, FFTtype, lh_start, lh_end, cent_start, cent_end, rh_start, rh_end);
 }
 
 void mean_filter::start_mean()
 {
-    doThreadWork.store(true);
+    {
+        std::lock_guard<std::mutex> lock(locking_mutex);
+        requestedSeq++;
+    }
+    workReady.notify_one();
 }
 
 void mean_filter::threadEntry()
 {
-    while(runningMF)
+    std::unique_lock<std::mutex> lock(locking_mutex);
+    while(true)
     {
-        std::unique_lock<std::mutex> lock(locking_mutex);
-        while(!doThreadWork.load())
-        {
-            // wait here
-            usleep(100);
-        }
-        calculate_means();
+        workReady.wait(lock, [this]{ return !runningMF || (requestedSeq != completedSeq); });
+        if(!runningMF)
+            break;
+
+        // Take a private copy of the newest request, then calculate without the lock held.
+        uint64_t seq = requestedSeq;
+        frame = pending.frame;
+        frame_count = pending.frame_count;
+        beginCol = pending.beginCol;
+        width = pending.width;
+        beginRow = pending.beginRow;
+        height = pending.height;
+        frWidth = pending.frWidth;
+        useDSF = pending.useDSF;
+        FFTtype = pending.FFTtype;
+        lh_start = pending.lh_start;
+        lh_end = pending.lh_end;
+        cent_start = pending.cent_start;
+        cent_end = pending.cent_end;
+        rh_start = pending.rh_start;
+        rh_end = pending.rh_end;
+
         lock.unlock();
+        if(frame != NULL)
+            calculate_means();
+        lock.lock();
+
+        completedSeq = seq;
+        workDone.notify_all();
     }
 }
 void mean_filter::calculate_means()
@@ -130,12 +222,6 @@ void mean_filter::calculate_means()
         vertDiff = 1;
         height++;
     }
-    memset(tap_profile, 0, MAX_HEIGHT*TAP_WIDTH*sizeof(*tap_profile));
-    memset(frame->vertical_mean_profile, 0, MAX_HEIGHT*sizeof(*(frame->vertical_mean_profile)));
-    memset(frame->horizontal_mean_profile, 0, MAX_WIDTH*sizeof(*(frame->horizontal_mean_profile)));
-    memset(frame->vertical_mean_profile_lh, 0, MAX_HEIGHT*sizeof(*(frame->vertical_mean_profile_lh)));
-    memset(frame->vertical_mean_profile_rh, 0, MAX_HEIGHT*sizeof(*(frame->vertical_mean_profile_rh)));
-
     // Remove this later, debug code:
     /*
     if(!(frame_count % 100))
@@ -174,62 +260,51 @@ void mean_filter::calculate_means()
 
     }
 
-    for(int r = beginRow; r < height; r++)
-    {
-        for(int c = beginCol; c < width; c++)
-        {
-            if(!useDSF)
-            {
-                frame->vertical_mean_profile[r] += frame->image_data_ptr[r*frWidth + c];
-                frame->horizontal_mean_profile[c] += frame->image_data_ptr[r*frWidth + c];
-                if(FFTtype == TAP_PROFIL)
-                    tap_profile[r * TAP_WIDTH + c % TAP_WIDTH] = frame->image_data_ptr[r * frWidth + c];
-            }
-            else if(useDSF)
-            {
-                frame->vertical_mean_profile[r] += frame->dark_subtracted_data[r*frWidth + c];
-                frame->horizontal_mean_profile[c] += frame->dark_subtracted_data[r*frWidth + c];
-                if(FFTtype == TAP_PROFIL)
-                    tap_profile[r * TAP_WIDTH + c % TAP_WIDTH] = frame->dark_subtracted_data[r*frWidth + c];
-            }
-        }
-    }
+    // The crosshair FFT reads FFT_INPUT_LENGTH entries, past the rows of a short frame.
+    const size_t vertEntries = (frame->height + 1 > FFT_INPUT_LENGTH) ? frame->height + 1 : FFT_INPUT_LENGTH;
+    memset(frame->vertical_mean_profile, 0, vertEntries*sizeof(*(frame->vertical_mean_profile)));
+    memset(frame->horizontal_mean_profile, 0, (frame->width+1)*sizeof(*(frame->horizontal_mean_profile)));
+    memset(frame->vertical_mean_profile_lh, 0, (frame->height+1)*sizeof(*(frame->vertical_mean_profile_lh)));
+    memset(frame->vertical_mean_profile_rh, 0, (frame->height+1)*sizeof(*(frame->vertical_mean_profile_rh)));
+    if(FFTtype == TAP_PROFIL)
+        memset(tap_profile, 0, MAX_HEIGHT*TAP_WIDTH*sizeof(*tap_profile));
+
+    const int partialStride = frWidth + 1;
+    horizontal_partial.assign((size_t)MEAN_FILTER_BANDS * partialStride, 0.0f);
 
+    profileRegion reg;
+    reg.beginRow = beginRow;
+    reg.endRow = height;
+    reg.beginCol = beginCol;
+    reg.endCol = width;
+    reg.frWidth = frWidth;
+    reg.lh_start = lh_start;
+    reg.lh_end = lh_end;
+    reg.rh_start = rh_start;
+    reg.rh_end = rh_end;
+    reg.tap = (FFTtype == TAP_PROFIL);
 
-    // LH and RH profiles:
-    if(!useDSF)
+    if(useDSF)
     {
-        for(int r = 0; r < height; r++)
-        {
-            // for each row, grab the data at UI-selected col=start and col=end
-            for(int c = lh_start; c < lh_end; c++)
-            {
-                frame->vertical_mean_profile_lh[r] += frame->image_data_ptr[r*frWidth + c];
-            }
-            for(int c = rh_start; c < rh_end; c++)
-            {
-                frame->vertical_mean_profile_rh[r] += frame->image_data_ptr[r*frWidth + c];
-            }
-        }
+        profileSweep<float>(frame->dark_subtracted_data, reg,
+                            frame->vertical_mean_profile, frame->vertical_mean_profile_lh, frame->vertical_mean_profile_rh,
+                            frame->horizontal_mean_profile, horizontal_partial.data(), partialStride, tap_profile);
     } else {
-        for(int r = 0; r < height; r++)
-        {
-            for(int c = lh_start; c < lh_end; c++)
-            {
-                frame->vertical_mean_profile_lh[r] += frame->dark_subtracted_data[r*frWidth + c];
-            }
-            for(int c = rh_start; c < rh_end; c++)
-            {
-                frame->vertical_mean_profile_rh[r] += frame->dark_subtracted_data[r*frWidth + c];
-            }
-        }
+        profileSweep<uint16_t>(frame->image_data_ptr, reg,
+                               frame->vertical_mean_profile, frame->vertical_mean_profile_lh, frame->vertical_mean_profile_rh,
+                               frame->horizontal_mean_profile, horizontal_partial.data(), partialStride, tap_profile);
     }
 
+    const float lhDiv = lh_end - lh_start + 1;
+    const float rhDiv = rh_end - rh_start + 1;
+    for(int r = 0; r < height; r++)
+    {
+        frame->vertical_mean_profile_lh[r] /= lhDiv;
+        frame->vertical_mean_profile_rh[r] /= rhDiv;
+    }
     for(int r = beginRow; r < height; r++)
     {
         frame->vertical_mean_profile[r] /= horizDiff;
-        frame->vertical_mean_profile_lh[r] /= (lh_end-lh_start+1);
-        frame->vertical_mean_profile_rh[r] /= (rh_end-rh_start+1);
     }
 
     // begin determining frame mean for FFT
@@ -255,9 +330,10 @@ void mean_filter::calculate_means()
 
     frame->async_filtering_done = 1;
     //delete this; //I can honestly say this is the ugliest line of C++ I've ever written.
-    doThreadWork.store(false);
 }
 void mean_filter::wait_mean()
 {
-	mean_thread.join();
+    // Wait for every calculation requested so far to finish.
+    std::unique_lock<std::mutex> lock(locking_mutex);
+    workDone.wait(lock, [this]{ return !runningMF || (completedSeq == requestedSeq); });
 }
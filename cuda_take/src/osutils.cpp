@@ -1,5 +1,12 @@
 #include "osutils.h"
 
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 void os::listdir(std::vector<std::string> &out, const std::string &directory)
 {
     DIR *dir;
@@ -44,3 +51,105 @@ std::string os::trim(const std::string &value)
 {
     return std::regex_replace(value, std::regex("^ +| +$|( ) +"), "$1");
 }
+
+bool os::parseCpuList(const std::string &list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    size_t pos = 0;
+    while(pos < list.size())
+    {
+        size_t comma = list.find(',', pos);
+        if(comma == std::string::npos)
+            comma = list.size();
+        const std::string item = list.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        char *end = NULL;
+        long first = strtol(item.c_str(), &end, 10);
+        long last = first;
+        if(end == item.c_str())
+            return false;
+        if(*end == '-')
+        {
+            const char *second = end + 1;
+            last = strtol(second, &end, 10);
+            if(end == second)
+                return false;
+        }
+        if((*end != '\0') || (first < 0) || (last < first) || (last >= CPU_SETSIZE))
+            return false;
+        for(long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+bool os::tuneThread(const char *cpuList, int fifoPriority, std::string &error)
+{
+    bool ok = true;
+    if(cpuList != NULL)
+    {
+        cpu_set_t set;
+        if(!parseCpuList(cpuList, &set))
+        {
+            error = std::string("cannot read CPU list \"") + cpuList + "\"";
+            return false;
+        }
+        int rtn = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if(rtn != 0)
+        {
+            error = std::string("cannot pin to CPUs ") + cpuList + ": " + strerror(rtn);
+            ok = false;
+        }
+    }
+    if(fifoPriority > 0)
+    {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = fifoPriority;
+        int rtn = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if(rtn != 0)
+        {
+            // EPERM unless running as root, with CAP_SYS_NICE, or with an RLIMIT_RTPRIO allowance.
+            error = std::string("cannot set SCHED_FIFO priority ") + std::to_string(fifoPriority) + ": " + strerror(rtn);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool os::pinProcess(const char *cpuList, std::string &error)
+{
+    cpu_set_t set;
+    if((cpuList == NULL) || !parseCpuList(cpuList, &set))
+    {
+        error = std::string("cannot read CPU list \"") + (cpuList ? cpuList : "") + "\"";
+        return false;
+    }
+    std::vector<std::string> tasks;
+    DIR *dir = opendir("/proc/self/task");
+    if(dir == NULL)
+    {
+        error = std::string("cannot list threads: ") + strerror(errno);
+        return false;
+    }
+    struct dirent *ent;
+    while((ent = readdir(dir)) != nullptr)
+    {
+        if(ent->d_name[0] != '.')
+            tasks.push_back(ent->d_name);
+    }
+    closedir(dir);
+
+    bool ok = true;
+    for(size_t t=0; t < tasks.size(); t++)
+    {
+        pid_t tid = atoi(tasks[t].c_str());
+        if(sched_setaffinity(tid, sizeof(set), &set) != 0)
+        {
+            error = std::string("cannot pin thread ") + tasks[t] + " to CPUs " + cpuList + ": " + strerror(errno);
+            ok = false;
+        }
+    }
+    return ok;
+}
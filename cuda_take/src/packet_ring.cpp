@@ -0,0 +1,283 @@
+#include "packet_ring.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+packet_ring::packet_ring()
+{
+    fd = -1;
+    map = NULL;
+    mapBytes = 0;
+    currentBlock = 0;
+    block = NULL;
+    nextPacket = NULL;
+    packetsLeft = 0;
+    port = 0;
+    address = INADDR_ANY;
+    ignored = 0;
+}
+
+packet_ring::~packet_ring()
+{
+    close();
+}
+
+bool packet_ring::open(const char *ifname, uint16_t udpPort, in_addr_t destAddr)
+{
+    if(fd >= 0)
+    {
+        LOG << "Packet ring is already open.";
+        return false;
+    }
+    port = htons(udpPort);
+    address = destAddr;
+
+    // SOCK_DGRAM: the link layer header is removed, so every packet starts at its IP header.
+    fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+    if(fd < 0)
+    {
+        LOG << "Could not open packet socket (CAP_NET_RAW is needed): " << strerror(errno);
+        return false;
+    }
+
+    int version = TPACKET_V3;
+    if(setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0)
+    {
+        LOG << "TPACKET_V3 is not available: " << strerror(errno);
+        close();
+        return false;
+    }
+
+    // Only our packets should take up room in the ring.
+    if(!attachFilter())
+    {
+        close();
+        return false;
+    }
+
+#ifdef PACKET_IGNORE_OUTGOING
+    // On the loopback interface each packet would otherwise be seen twice.
+    int one = 1;
+    if(setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) != 0)
+    {
+        LL(2) << "PACKET_IGNORE_OUTGOING not available: " << strerror(errno);
+    }
+#endif
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = PACKET_RING_BLOCK_BYTES;
+    req.tp_block_nr = PACKET_RING_BLOCKS;
+    req.tp_frame_size = PACKET_RING_FRAME_BYTES;
+    req.tp_frame_nr = (PACKET_RING_BLOCK_BYTES / PACKET_RING_FRAME_BYTES) * PACKET_RING_BLOCKS;
+    req.tp_retire_blk_tov = PACKET_RING_RETIRE_MS;
+    if(setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0)
+    {
+        LOG << "Could not set up packet receive ring: " << strerror(errno);
+        close();
+        return false;
+    }
+
+    mapBytes = (size_t)req.tp_block_size * req.tp_block_nr;
+    void *m = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if(m == MAP_FAILED)
+    {
+        LOG << "Could not map packet receive ring: " << strerror(errno);
+        mapBytes = 0;
+        close();
+        return false;
+    }
+    map = (uint8_t *)m;
+
+    struct sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_IP);
+    ll.sll_ifindex = 0; // all interfaces
+    if(ifname != NULL)
+    {
+        ll.sll_ifindex = if_nametoindex(ifname);
+        if(ll.sll_ifindex == 0)
+        {
+            LOG << "Unknown network interface " << ifname << " for packet ring.";
+            close();
+            return false;
+        }
+    }
+    if(bind(fd, (struct sockaddr *)&ll, sizeof(ll)) != 0)
+    {
+        LOG << "Could not bind packet ring: " << strerror(errno);
+        close();
+        return false;
+    }
+
+    currentBlock = 0;
+    block = NULL;
+    packetsLeft = 0;
+    LOG << "Packet ring open on " << (ifname ? ifname : "all interfaces") << ", UDP port " << udpPort
+        << ", " << PACKET_RING_BLOCKS << " blocks of " << PACKET_RING_BLOCK_BYTES / 1024 << " KiB.";
+    return true;
+}
+
+bool packet_ring::attachFilter()
+{
+    // Accept unfragmented IPv4 UDP datagrams to our port, drop everything else.
+    // Offsets are from the start of the IP header.
+    struct sock_filter code[] = {
+        { BPF_LD  | BPF_B   | BPF_ABS, 0, 0, 9 },            // IP protocol
+        { BPF_JMP | BPF_JEQ | BPF_K,   0, 6, IPPROTO_UDP },
+        { BPF_LD  | BPF_H   | BPF_ABS, 0, 0, 6 },            // flags and fragment offset
+        { BPF_JMP | BPF_JSET | BPF_K,  4, 0, 0x3fff },       // more fragments, or not the first
+        { BPF_LDX | BPF_B   | BPF_MSH, 0, 0, 0 },            // X = IP header length
+        { BPF_LD  | BPF_H   | BPF_IND, 0, 0, 2 },            // UDP destination port
+        { BPF_JMP | BPF_JEQ | BPF_K,   0, 1, ntohs(port) },
+        { BPF_RET | BPF_K,             0, 0, 0x40000 },
+        { BPF_RET | BPF_K,             0, 0, 0 },
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0)
+    {
+        LOG << "Could not attach packet ring filter: " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+void packet_ring::close()
+{
+    if(map != NULL)
+    {
+        munmap(map, mapBytes);
+        map = NULL;
+        mapBytes = 0;
+    }
+    if(fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    block = NULL;
+    packetsLeft = 0;
+}
+
+bool packet_ring::nextBlock(int timeoutMs)
+{
+    if(fd < 0)
+        return false;
+    if(block != NULL)
+        releaseBlock();
+
+    struct tpacket_block_desc *bd = (struct tpacket_block_desc *)(map + (size_t)currentBlock * PACKET_RING_BLOCK_BYTES);
+    if(!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+    {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+        int rtn = poll(&pfd, 1, timeoutMs);
+        if((rtn < 0) && (errno != EINTR))
+        {
+            LOG << "Packet ring poll failed: " << strerror(errno);
+        }
+        if(!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+            return false;
+    }
+
+    block = bd;
+    packetsLeft = bd->hdr.bh1.num_pkts;
+    nextPacket = (uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+    return true;
+}
+
+bool packet_ring::nextDatagram(uint8_t **data, size_t *len, uint64_t *timestampNs)
+{
+    while((block != NULL) && (packetsLeft > 0))
+    {
+        struct tpacket3_hdr *h = (struct tpacket3_hdr *)nextPacket;
+        nextPacket += h->tp_next_offset;
+        packetsLeft--;
+
+        const struct sockaddr_ll *ll = (const struct sockaddr_ll *)((uint8_t *)h + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        if(ll->sll_pkttype == PACKET_OUTGOING)
+        {
+            ignored++;
+            continue;
+        }
+
+        // The filter has already checked most of this, but the ring
+        // may hold packets that arrived before it was attached.
+        if(!udpPayload((uint8_t *)h + h->tp_net, h->tp_snaplen, port, address, data, len))
+        {
+            ignored++;
+            continue;
+        }
+        if(timestampNs != NULL)
+            *timestampNs = (uint64_t)h->tp_sec*1000000000ULL + h->tp_nsec;
+        return true;
+    }
+    return false;
+}
+
+bool packet_ring::udpPayload(uint8_t *ip, size_t caplen, uint16_t udpPort, in_addr_t destAddr, uint8_t **data, size_t *len)
+{
+    if(caplen < sizeof(struct iphdr))
+        return false;
+    const struct iphdr *iph = (const struct iphdr *)ip;
+    size_t ipHeaderBytes = (size_t)iph->ihl * 4;
+    if((iph->version != 4) || (ipHeaderBytes < sizeof(struct iphdr)) || (iph->protocol != IPPROTO_UDP)
+            || (ntohs(iph->frag_off) & 0x3fff) || (caplen < ipHeaderBytes + sizeof(struct udphdr)))
+        return false;
+    if((destAddr != INADDR_ANY) && (iph->daddr != destAddr))
+        return false;
+    const struct udphdr *udp = (const struct udphdr *)(ip + ipHeaderBytes);
+    if(udp->dest != udpPort)
+        return false;
+    size_t udpBytes = ntohs(udp->len);
+    if(udpBytes < sizeof(struct udphdr))
+        return false;
+    size_t payload = udpBytes - sizeof(struct udphdr);
+    if(payload > caplen - ipHeaderBytes - sizeof(struct udphdr))
+        payload = caplen - ipHeaderBytes - sizeof(struct udphdr);
+
+    *data = ip + ipHeaderBytes + sizeof(struct udphdr);
+    *len = payload;
+    return true;
+}
+
+void packet_ring::releaseBlock()
+{
+    if(block == NULL)
+        return;
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    block = NULL;
+    packetsLeft = 0;
+    currentBlock = (currentBlock + 1) % PACKET_RING_BLOCKS;
+}
+
+void packet_ring::logStatistics()
+{
+    if(fd < 0)
+        return;
+    struct tpacket_stats_v3 st;
+    socklen_t stLen = sizeof(st);
+    memset(&st, 0, sizeof(st));
+    // Reading the statistics also resets them.
+    if(getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &stLen) != 0)
+    {
+        LOG << "Could not read packet ring statistics: " << strerror(errno);
+        return;
+    }
+    LOG << "Packet ring: " << st.tp_packets << " packets, " << st.tp_drops << " dropped for lack of ring space, "
+        << st.tp_freeze_q_cnt << " times full, " << ignored << " ignored.";
+}
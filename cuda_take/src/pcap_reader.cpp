@@ -0,0 +1,336 @@
+#include "pcap_reader.hpp"
+#include "packet_ring.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+pcap_reader::pcap_reader()
+{
+    fd = -1;
+    map = NULL;
+    mapBytes = 0;
+    pos = 0;
+    firstRecord = 0;
+    pcapng = false;
+    swapped = false;
+    nanosecondTimestamps = false;
+    pcapLinkType = LINK_ETHERNET;
+    interfaceCount = 0;
+    port = 0;
+    lastTimestampNs = 0;
+    datagrams = 0;
+    ignored = 0;
+}
+
+pcap_reader::~pcap_reader()
+{
+    close();
+}
+
+bool pcap_reader::open(const std::string &fname, uint16_t udpPort)
+{
+    if(map != NULL)
+    {
+        LOG << "Capture file is already open, not opening " << fname;
+        return false;
+    }
+    port = htons(udpPort);
+    datagrams = 0;
+    ignored = 0;
+
+    fd = ::open(fname.c_str(), O_RDONLY);
+    if(fd < 0)
+    {
+        LOG << "Could not open capture file " << fname << ": " << strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if((fstat(fd, &st) != 0) || (st.st_size < 24))
+    {
+        LOG << "Capture file " << fname << " is empty or unreadable.";
+        close();
+        return false;
+    }
+    mapBytes = st.st_size;
+    void *m = mmap(NULL, mapBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(m == MAP_FAILED)
+    {
+        LOG << "Could not map capture file " << fname << ": " << strerror(errno);
+        mapBytes = 0;
+        close();
+        return false;
+    }
+    map = (uint8_t *)m;
+    madvise(map, mapBytes, MADV_SEQUENTIAL);
+
+    uint32_t magic;
+    memcpy(&magic, map, sizeof(magic));
+    if(magic == 0x0A0D0D0A)
+    {
+        // pcapng. The byte order comes from the section header, which nextPcapngRecord reads.
+        pcapng = true;
+        firstRecord = 0;
+    } else if((magic == 0xa1b2c3d4) || (magic == 0xa1b23c4d) || (magic == 0xd4c3b2a1) || (magic == 0x4d3cb2a1)) {
+        pcapng = false;
+        swapped = (magic == 0xd4c3b2a1) || (magic == 0x4d3cb2a1);
+        nanosecondTimestamps = (magic == 0xa1b23c4d) || (magic == 0x4d3cb2a1);
+        pcapLinkType = get32(map + 20) & 0xFFFF;
+        firstRecord = 24;
+    } else {
+        LOG << "File " << fname << " is not a pcap or pcapng capture.";
+        close();
+        return false;
+    }
+
+    rewind();
+    LOG << "Opened " << (pcapng ? "pcapng" : "pcap") << " capture " << fname << ", " << mapBytes << " bytes, reading UDP port " << udpPort;
+    return true;
+}
+
+void pcap_reader::close()
+{
+    if(map != NULL)
+    {
+        munmap(map, mapBytes);
+        map = NULL;
+        mapBytes = 0;
+    }
+    if(fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void pcap_reader::rewind()
+{
+    pos = firstRecord;
+    interfaceCount = 0;
+    lastTimestampNs = 0;
+}
+
+bool pcap_reader::nextDatagram(uint8_t **data, size_t *len, uint64_t *timestampNs)
+{
+    if(map == NULL)
+        return false;
+    uint8_t *pkt = NULL;
+    size_t caplen = 0;
+    uint32_t linkType = 0;
+    while(pcapng ? nextPcapngRecord(&pkt, &caplen, &linkType, timestampNs)
+                 : nextPcapRecord(&pkt, &caplen, &linkType, timestampNs))
+    {
+        uint8_t *ip = NULL;
+        size_t ipBytes = 0;
+        if(ipPacket(pkt, caplen, linkType, &ip, &ipBytes) &&
+                packet_ring::udpPayload(ip, ipBytes, port, INADDR_ANY, data, len))
+        {
+            datagrams++;
+            return true;
+        }
+        ignored++;
+    }
+    return false;
+}
+
+bool pcap_reader::nextPcapRecord(uint8_t **pkt, size_t *caplen, uint32_t *linkType, uint64_t *timestampNs)
+{
+    if(pos + 16 > mapBytes)
+        return false;
+    const uint8_t *rec = map + pos;
+    uint64_t seconds = get32(rec);
+    uint64_t fraction = get32(rec + 4);
+    size_t incl = get32(rec + 8);
+    if(pos + 16 + incl > mapBytes)
+    {
+        LOG << "Capture file is truncated at byte " << pos;
+        pos = mapBytes;
+        return false;
+    }
+    *pkt = map + pos + 16;
+    *caplen = incl;
+    *linkType = pcapLinkType;
+    *timestampNs = seconds * 1000000000ULL + (nanosecondTimestamps ? fraction : fraction * 1000);
+    pos += 16 + incl;
+    return true;
+}
+
+bool pcap_reader::nextPcapngRecord(uint8_t **pkt, size_t *caplen, uint32_t *linkType, uint64_t *timestampNs)
+{
+    while(pos + 12 <= mapBytes)
+    {
+        const uint8_t *blk = map + pos;
+        uint32_t type;
+        memcpy(&type, blk, sizeof(type));
+        if(type == 0x0A0D0D0A)
+        {
+            // Section header. The byte order magic says how everything up to the next section is stored.
+            uint32_t bom;
+            memcpy(&bom, blk + 8, sizeof(bom));
+            if(bom == 0x1A2B3C4D)
+                swapped = false;
+            else if(bom == 0x4D3C2B1A)
+                swapped = true;
+            else
+            {
+                LOG << "Bad pcapng section header at byte " << pos;
+                pos = mapBytes;
+                return false;
+            }
+            interfaceCount = 0;
+        }
+        size_t total = get32(blk + 4);
+        if((total < 12) || (total % 4 != 0) || (pos + total > mapBytes))
+        {
+            LOG << "Capture file is truncated or damaged at byte " << pos;
+            pos = mapBytes;
+            return false;
+        }
+        const uint8_t *body = blk + 8;
+        size_t bodyBytes = total - 12;
+        pos += total;
+        type = get32(blk);
+
+        if(type == 1)
+        {
+            readInterfaceBlock(body, bodyBytes);
+        } else if((type == 6) && (bodyBytes >= 20)) {
+            // Enhanced packet block
+            uint32_t iface = get32(body);
+            uint64_t ticks = ((uint64_t)get32(body + 4) << 32) | get32(body + 8);
+            size_t incl = get32(body + 12);
+            if((iface >= interfaceCount) || (incl > bodyBytes - 20))
+            {
+                ignored++;
+                continue;
+            }
+            uint64_t tps = interfaceTicksPerSecond[iface];
+            *pkt = (uint8_t *)body + 20;
+            *caplen = incl;
+            *linkType = interfaceLinkType[iface];
+            *timestampNs = (ticks / tps) * 1000000000ULL + ((ticks % tps) * 1000000000ULL) / tps;
+            lastTimestampNs = *timestampNs;
+            return true;
+        } else if((type == 3) && (bodyBytes >= 4) && (interfaceCount > 0)) {
+            // Simple packet block, no timestamp. Keep the previous one.
+            size_t incl = get32(body);
+            if(incl > bodyBytes - 4)
+                incl = bodyBytes - 4;
+            *pkt = (uint8_t *)body + 4;
+            *caplen = incl;
+            *linkType = interfaceLinkType[0];
+            *timestampNs = lastTimestampNs;
+            return true;
+        }
+        // Anything else (statistics, name resolution, custom blocks) is skipped.
+    }
+    return false;
+}
+
+void pcap_reader::readInterfaceBlock(const uint8_t *body, size_t bodyBytes)
+{
+    if(interfaceCount >= MAX_INTERFACES)
+    {
+        LOG << "Warning, capture has more than " << MAX_INTERFACES << " interfaces, packets from the rest are skipped.";
+        return;
+    }
+    if(bodyBytes < 8)
+        return;
+    unsigned int n = interfaceCount++;
+    interfaceLinkType[n] = get16(body);
+    interfaceTicksPerSecond[n] = 1000000; // microseconds unless if_tsresol says otherwise
+
+    size_t opt = 8;
+    while(opt + 4 <= bodyBytes)
+    {
+        uint16_t code = get16(body + opt);
+        uint16_t length = get16(body + opt + 2);
+        if((code == 0) || (opt + 4 + length > bodyBytes))
+            break;
+        if((code == 9) && (length >= 1))
+        {
+            uint8_t res = body[opt + 4];
+            uint64_t tps = 1;
+            if(res & 0x80)
+            {
+                tps = 1ULL << ((res & 0x7f) > 63 ? 63 : (res & 0x7f));
+            } else {
+                for(unsigned int d=0; (d < res) && (d < 19); d++)
+                    tps *= 10;
+            }
+            interfaceTicksPerSecond[n] = tps;
+        }
+        opt += 4 + ((length + 3) & ~3);
+    }
+}
+
+bool pcap_reader::ipPacket(uint8_t *pkt, size_t caplen, uint32_t linkType, uint8_t **ip, size_t *ipBytes)
+{
+    // Strip the link layer header and check that an IPv4 packet follows.
+    size_t off = 0;
+    uint16_t etherType = 0x0800;
+    switch(linkType)
+    {
+    case LINK_NULL:
+        // Address family in the byte order of the capturing machine.
+        if(caplen < 4)
+            return false;
+        if(!((pkt[0] == 2 && pkt[3] == 0) || (pkt[3] == 2 && pkt[0] == 0)))
+            return false;
+        off = 4;
+        break;
+    case LINK_ETHERNET:
+        if(caplen < 14)
+            return false;
+        off = 12;
+        etherType = ((uint16_t)pkt[off] << 8) | pkt[off + 1];
+        while(((etherType == 0x8100) || (etherType == 0x88a8)) && (off + 6 <= caplen))
+        {
+            off += 4; // VLAN tag
+            etherType = ((uint16_t)pkt[off] << 8) | pkt[off + 1];
+        }
+        off += 2;
+        break;
+    case LINK_RAW:
+    case LINK_IPV4:
+        off = 0;
+        break;
+    case LINK_LINUX_SLL:
+        if(caplen < 16)
+            return false;
+        etherType = ((uint16_t)pkt[14] << 8) | pkt[15];
+        off = 16;
+        break;
+    case LINK_LINUX_SLL2:
+        if(caplen < 20)
+            return false;
+        etherType = ((uint16_t)pkt[0] << 8) | pkt[1];
+        off = 20;
+        break;
+    default:
+        return false;
+    }
+    if((etherType != 0x0800) || (off >= caplen))
+        return false;
+    *ip = pkt + off;
+    *ipBytes = caplen - off;
+    return true;
+}
+
+uint16_t pcap_reader::get16(const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return swapped ? __builtin_bswap16(v) : v;
+}
+
+uint32_t pcap_reader::get32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return swapped ? __builtin_bswap32(v) : v;
+}
@@ -1,7 +1,6 @@
 #include "rtpcamera.hpp"
 
 static struct timeval tval_before, tval_after, tval_result;
-pthread_mutex_t rtpStreamLock;
 
 //RTPCamera::RTPCamera(int frWidth, int frHeight, int port, const char *interface)
 
@@ -84,6 +83,7 @@ RTPCamera::~RTPCamera()
         }
     }
     RLOG << "Done freeing buffer";
+    delete data;
 
 }
 
@@ -96,7 +96,9 @@ bool RTPCamera::initialize()
     }
 
 
-    data = g_new0(ProgramData, 1);
+    data = new ProgramData();
+    data->width = frWidth;
+    data->height = frHeight;
 
     data->loop = g_main_loop_new (NULL, FALSE);
 
@@ -185,7 +187,6 @@ bool RTPCamera::initialize()
 
     // "data" is our i/o to the land of static functions and c functions.
     data->sourcePipe = sourcePipe;
-    currentFrameNumber = &data->currentFrameNumber;
     doneFrameNumber = &data->doneFrameNumber;
     frameCounter = &data->frameCounter;
 
@@ -252,120 +253,101 @@ static GstFlowReturn on_new_sample_from_sink_rgb(GstElement * elt, ProgramData *
 {
     // This is the entry point from which we obtain the stream's data.
     // This function is called whenever there is a new frame in the source pipe appSink.
-    //LOG << "New RTP Sample";
-    //g_print("new sample from sink\n");
     GstSample *sample;
-    GstBuffer *app_buffer, *buffer;
-    //GstElement *source;
-    GstFlowReturn ret = GST_FLOW_OK;
+    GstBuffer *buffer;
     GstMapInfo map;
-    //    guint8 *rdata;
-    //    int dataLength;
-    //    int i;
-    //g_print ("%s\n", __func__);
 
     // Obtain sample
     sample = gst_app_sink_pull_sample (GST_APP_SINK (elt));
+    if(sample == NULL)
+        return GST_FLOW_EOS;
     buffer = gst_sample_get_buffer (sample);
 
-    // Make a copy:
-    app_buffer = gst_buffer_copy_deep (buffer);
-
-    gst_buffer_map (app_buffer, &map, GST_MAP_WRITE);
-
-    // Copy the data into liveview:
-    siphonDataRGB(&map, data);
-
+    // The sample's own memory is read in place. The unpack into our
+    // frame buffer is the only copy.
+    if(gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+        siphonDataRGB(&map, data);
+        gst_buffer_unmap(buffer, &map);
+    }
     gst_sample_unref(sample);
-    gst_buffer_unmap(app_buffer, &map);
-    gst_buffer_unref(app_buffer);
 
-    (void)data;
-    return ret;
+    return GST_FLOW_OK;
 }
 
 static GstFlowReturn on_new_sample_from_sink_gray(GstElement * elt, ProgramData * data)
 {
     // This is the entry point from which we obtain the stream's data.
     // This function is called whenever there is a new frame in the source pipe appSink.
-    //LOG << "New RTP Sample";
-    //g_print("new sample from sink\n");
     GstSample *sample;
-    GstBuffer *app_buffer, *buffer;
-    //GstElement *source;
-    GstFlowReturn ret = GST_FLOW_OK;
+    GstBuffer *buffer;
     GstMapInfo map;
-    //    guint8 *rdata;
-    //    int dataLength;
-    //    int i;
-    //g_print ("%s\n", __func__);
 
     // Obtain sample
     sample = gst_app_sink_pull_sample (GST_APP_SINK (elt));
+    if(sample == NULL)
+        return GST_FLOW_EOS;
     buffer = gst_sample_get_buffer (sample);
 
-    // Make a copy:
-    app_buffer = gst_buffer_copy_deep (buffer);
-
-    gst_buffer_map (app_buffer, &map, GST_MAP_WRITE);
-
 #ifdef EXTRA_DEBUG
 
     GstClockTime t = GST_BUFFER_TIMESTAMP(buffer);
     if(data->frameCounter%100 == 0) {
         //g_printerr("RTP frame [%ld], Timestamp: %lu\n", data->frameCounter, t);
-        g_printerr("RTP frame[%ld] timestamp (hh:mm:ss): %" GST_TIME_FORMAT "\n", data->frameCounter, GST_TIME_ARGS(t));
+        g_printerr("RTP frame[%ld] timestamp (hh:mm:ss): %" GST_TIME_FORMAT "\n", (long)data->frameCounter.load(), GST_TIME_ARGS(t));
     }
 #endif
 
-    // Copy the data into liveview:
-    siphonDataGray(&map, data);
-
+    // The sample's own memory is read in place. The copy into our
+    // frame buffer is the only copy.
+    if(gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+        siphonDataGray(&map, data);
+        gst_buffer_unmap(buffer, &map);
+    }
     gst_sample_unref (sample);
-    gst_buffer_unmap (app_buffer, &map);
-    gst_buffer_unref(app_buffer);
 
-    (void)data;
-    return ret;
+    return GST_FLOW_OK;
 }
 
-static void siphonDataRGB (GstMapInfo* map, ProgramData *data)
+#if defined(__x86_64__) && defined(__GNUC__)
+// Built for each instruction set, the best one is picked at load time.
+// Gathering every third byte only vectorizes with SSSE3 or better.
+__attribute__((target_clones("avx2","ssse3","default")))
+#endif
+static void unpackRGB24(uint16_t * __restrict out, const uint8_t * __restrict in, size_t pixels)
 {
-    pthread_mutex_lock(&rtpStreamLock);
-
-    size_t dataLengthBytes;
-    guint8 *rdata;
-
-    dataLengthBytes = map->size;
-    rdata = map->data;
-    //g_print ("%s dataLen = %zu\n", __func__, dataLengthBytes);
-
-    // The dataLength indicates the entire length of the frame
-    // in bytes. RGB format is 3 bytes per pixel,
-    // GRAY format is 2 bytes per pixel.
-
-    // The data are inside rdata, and are three bytes per pixel.
-    // The RGB data are 24 bits per pixel.
-
-    int ftab[10] = {4, 5, 6, 7, 8, 9, 0, 1, 2, 3};
-
-    data->doneFrameNumber = ftab[data->currentFrameNumber];
-    uint16_t* singleFrame = data->buffer[data->currentFrameNumber];
-
-    // Here, the first 16 bits of each 24-bit pixel are copied
-    size_t pixelNum = 0;
-    uint16_t pixel;
-    for(size_t pbyte=0; pbyte < dataLengthBytes; pbyte+=3)
+    // The first 16 bits of each 24-bit pixel are the pixel value.
+    // No branches inside, so that the compiler can vectorize it.
+#pragma omp simd
+    for(size_t p=0; p < pixels; p++)
     {
-        pixel = (rdata[pbyte]&0x00ff) | ((rdata[pbyte+1] << 8)&0xff00);
-        // not used: rdata[pbyte+3];
-        pixelNum = pbyte/3;
-        singleFrame[pixelNum] = pixel;
-        //LOG << "byte: " << pbyte;
+        out[p] = (uint16_t)(in[3*p] | (in[3*p+1] << 8));
+    }
+}
+
+static size_t sampleRowStride(GstMapInfo* map, ProgramData *data, size_t rowBytes)
+{
+    // gstreamer pads video rows to a multiple of four bytes, which matters for
+    // RGB rows of odd width. Returns 0 if the sample is too short for a frame.
+    size_t stride = rowBytes;
+    if((map->size % data->height == 0) && (map->size / data->height >= rowBytes))
+        stride = map->size / data->height;
+    if(map->size < stride * (data->height - 1) + rowBytes) {
+        if(!data->sizeWarned) {
+            RLOG << "ERROR, RTP sample of " << map->size << " bytes is too short for a "
+                 << data->width << "x" << data->height << " frame, dropping such samples.";
+            data->sizeWarned = true;
+        }
+        return 0;
     }
+    return stride;
+}
 
+static void publishFrame(ProgramData *data)
+{
+    // Makes the frame just written visible to getFrameWait(), then moves on to the next buffer.
+    data->doneFrameNumber.store(data->currentFrameNumber, std::memory_order_release);
+    data->frameCounter.fetch_add(1, std::memory_order_release);
     data->currentFrameNumber = (data->currentFrameNumber+1) % (guaranteedBufferFramesCount_rtp);
-    data->frameCounter++;
 
     // Frame timing metric
 #ifdef FPS_MEAS_ACQ
@@ -377,51 +359,42 @@ static void siphonDataRGB (GstMapInfo* map, ProgramData *data)
         printf("FPS: %f\n", 1.0/deltaTsec);
     tval_after = tval_before;
 #endif
-    pthread_mutex_unlock(&rtpStreamLock);
-    return;
 }
 
-static void siphonDataGray (GstMapInfo* map, ProgramData *data)
+static void siphonDataRGB (GstMapInfo* map, ProgramData *data)
 {
-    pthread_mutex_lock(&rtpStreamLock);
-
-    size_t dataLengthBytes;
-    guint8 *rdata;
-
-    dataLengthBytes = map->size;
-    rdata = map->data;
-    //g_print ("%s dataLen = %zu\n", __func__, dataLengthBytes);
-
-    // The dataLength indicates the entire length of the frame
-    // in bytes. RGB format is 3 bytes per pixel,
-    // GRAY format is 2 bytes per pixel.
-
-    // The data are inside rdata, and are three bytes per pixel.
-    // The intended RGB format is just 24-bit grayscale
-
-    int ftab[10] = {4, 5, 6, 7, 8, 9, 0, 1, 2, 3};
+    // The data are three bytes per pixel. Only the first two of each pixel are used.
+    const size_t rowBytes = (size_t)data->width * 3;
+    size_t stride = sampleRowStride(map, data, rowBytes);
+    if(stride == 0)
+        return;
 
-    data->doneFrameNumber = ftab[data->currentFrameNumber];
     uint16_t* singleFrame = data->buffer[data->currentFrameNumber];
-    // We copy the entire frame, without any manipulation
-    memcpy((char*)singleFrame, rdata, dataLengthBytes);
-
-
-    data->currentFrameNumber = (data->currentFrameNumber+1) % (guaranteedBufferFramesCount_rtp);
-    data->frameCounter++;
+    if(stride == rowBytes) {
+        unpackRGB24(singleFrame, map->data, (size_t)data->width * data->height);
+    } else {
+        for(unsigned int row=0; row < data->height; row++)
+            unpackRGB24(singleFrame + (size_t)row*data->width, map->data + row*stride, data->width);
+    }
+    publishFrame(data);
+}
 
-    // Frame timing metric
-#ifdef FPS_MEAS_ACQ
-    gettimeofday(&tval_before, NULL);
-    timersub(&tval_before, &tval_after, &tval_result);
+static void siphonDataGray (GstMapInfo* map, ProgramData *data)
+{
+    // 16-bit grayscale, copied as it is.
+    const size_t rowBytes = (size_t)data->width * sizeof(uint16_t);
+    size_t stride = sampleRowStride(map, data, rowBytes);
+    if(stride == 0)
+        return;
 
-    double deltaTsec = tval_result.tv_sec + (double)tval_result.tv_usec/(double)1E6;
-    if(deltaTsec != 0)
-        printf("FPS: %f\n", 1.0/deltaTsec);
-    tval_after = tval_before;
-#endif
-    pthread_mutex_unlock(&rtpStreamLock);
-    return;
+    uint16_t* singleFrame = data->buffer[data->currentFrameNumber];
+    if(stride == rowBytes) {
+        memcpy(singleFrame, map->data, rowBytes * data->height);
+    } else {
+        for(unsigned int row=0; row < data->height; row++)
+            memcpy(singleFrame + (size_t)row*data->width, map->data + row*stride, rowBytes);
+    }
+    publishFrame(data);
 }
 
 static gboolean on_source_message (GstBus * bus, GstMessage * message, ProgramData * data)
@@ -510,8 +483,6 @@ uint16_t* RTPCamera::getFrameWait(unsigned int lastFrameNumber, CameraModel::cam
     // and then returns a pointer to the start of the new frame.
     volatile uint64_t tap = 0;
     volatile int lastFrameNumber_local_debug = lastFrameNumber;
-    int pos = 0;
-    pos = *doneFrameNumber; // doneFrameNumber is a number that is the most recent frame finished.
 
     if(camcontrol->pause)
     {
@@ -529,22 +500,25 @@ uint16_t* RTPCamera::getFrameWait(unsigned int lastFrameNumber, CameraModel::cam
     }
     // TODO: There are states where these numbers do not update
     // and that too should be a timeout.
-    while(lastFrameDelivered==(unsigned int)pos)
+    uint64_t frames = frameCounter->load(std::memory_order_acquire);
+    while(frames == lastFrameCountDelivered)
     {
         *stat = camWaiting;
         usleep(FRAME_WAIT_MIN_DELAY_US);
 //        if(tap++ > MAX_FRAME_WAIT_TAPS)
 //        {
 //            *stat = camTimeout;
-//            RLOG << "RTP Camera timeout waiting for frames. Total frame count: " << *frameCounter << ", lastFrameDelivered: " << lastFrameDelivered << ", pos: " << pos;
+//            RLOG << "RTP Camera timeout waiting for frames. Total frame count: " << *frameCounter << ", lastFrameCountDelivered: " << lastFrameCountDelivered;
 //            RLOG << "Timeout frame pixel zero: " << timeoutFrame[0]; // debug info
 //            return timeoutFrame;
 //        }
-        pos = *doneFrameNumber;
+        frames = frameCounter->load(std::memory_order_acquire);
     }
-    // TODO, check on this idea...
+    // The most recent complete frame. The ring holds several more, so it is not
+    // overwritten before the caller has copied it out.
+    unsigned int pos = doneFrameNumber->load(std::memory_order_acquire);
     *stat = camPlaying;
-    lastFrameDelivered = pos; // keep a copy around
+    lastFrameCountDelivered = frames;
     //LOG << "waitFrame: "// Remove this from the final
     // but keep in while diagnosing the build system:
     return guaranteedBufferFrames[pos];
@@ -1,9 +1,39 @@
 #include "rtpnextgen.hpp"
 
-rtpnextgen::rtpnextgen(takeOptionsType opts) {
+rtpnextgen::rtpnextgen(takeOptionsType opts) : rtpnextgen(opts, -1, NULL) {
+}
+
+rtpnextgen::rtpnextgen(takeOptionsType opts, int shardIndex, rtpnextgen *parent) {
     coutbuf = std::cout.rdbuf(); // grab the std out buffer so that we can enforce its use later
 
     this->options = opts;
+    this->shardIndex = shardIndex;
+    this->parentCam = parent;
+    if(options.rtpShards > RTPNG_MAX_SHARDS) {
+        LOG << "Warning, " << options.rtpShards << " RTP shards requested, using " << RTPNG_MAX_SHARDS;
+        options.rtpShards = RTPNG_MAX_SHARDS;
+    }
+    if(options.rtpPacketRing && (options.rtpShards > 1)) {
+        LOG << "Warning, the RTP packet ring is read by a single thread, ignoring the request for " << options.rtpShards << " shards.";
+        options.rtpShards = 1;
+    }
+    if((options.rtpReplayFile != NULL) && (options.rtpShards > 1)) {
+        LOG << "Warning, a capture file is replayed by a single thread, ignoring the request for " << options.rtpShards << " shards.";
+        options.rtpShards = 1;
+    }
+    if(parent != NULL) {
+        // Shards either share the port, and the kernel spreads the flows across
+        // the sockets, or listen on consecutive ports.
+        if(options.rtpShardPorts) {
+            options.rtpPort += shardIndex;
+        } else {
+            reusePort = true;
+        }
+        // Each shard measures the frame rate it sees, so its buffers
+        // hold its own share of rtpBufferSeconds worth of frames.
+        options.rtpShards = 1;
+        LOG << "Starting RTP NextGen shard " << shardIndex << " on UDP port " << options.rtpPort;
+    }
     LOG << "Starting RTP NextGen camera with width: " << options.rtpWidth << ", height: " << options.rtpHeight
         << ", UDP port: " << options.rtpPort;
 
@@ -33,6 +63,22 @@ rtpnextgen::rtpnextgen(takeOptionsType opts) {
 
     this->interface = options.rtpInterface;
 
+    if(options.rtpShards > 1) {
+        // No socket here, the shards do the receiving.
+        rtp.m_nHostSocket = -1;
+        rtp.m_pPacketBuffer = nullptr;
+        frameBufferSizeBytes = frame_width*data_height*sizeof(uint16_t);
+        timeoutFrame = (uint16_t*)calloc(frameBufferSizeBytes, 1);
+        timeoutFrame[0] = 0x0045; timeoutFrame[1] = 0x0084; timeoutFrame[2] = 0x004C;
+        for(unsigned int n=0; n < options.rtpShards; n++) {
+            shards.push_back(new rtpnextgen(options, n, this));
+        }
+        haveInitialized = true;
+        LOG << "RTP NextGen receiving with " << shards.size() << " shards.";
+        std::cout.rdbuf(coutbuf);
+        return;
+    }
+
     if (initialize())
     {
         LOG << "RTP NextGen initialize successful";
@@ -53,6 +99,33 @@ rtpnextgen::~rtpnextgen() {
     g_bRunning = false;
     if(camcontrol != NULL)
         camcontrol->exit = true;
+    // and make sure a waiting consumer sees it:
+    frameReadySeq.fetch_add(1);
+    wakeFrameWaiters();
+
+    if(!shards.empty()) {
+        for(size_t n=0; n < shardThreads.size(); n++) {
+            if(shardThreads[n].joinable())
+                shardThreads[n].join();
+        }
+        LOG << "RTP NextGen shard merge: frames delivered: " << framesDeliveredCounter
+            << ", reorder window expired: " << reorderTimeoutCounter
+            << ", delivered out of order: " << outOfOrderCounter
+            << ", dropped as overrun: " << lapEventCounter;
+        for(size_t n=0; n < shards.size(); n++) {
+            delete shards[n];
+        }
+        senderClockStats sc = senderClock.stats();
+        LOG << "Sender frame rate: " << sc.fps << " fps, jitter: " << sc.jitterMicros << " us, clock drift: " << sc.driftPpm
+            << " ppm, frames stamped but not received: " << sc.skippedFrames << ", rate changes: " << sc.rateChanges;
+        free(timeoutFrame);
+        return;
+    }
+
+    if(ring != NULL) {
+        ring->logStatistics();
+        ring->close();
+    }
 
     // close socket
     if((rtp.m_nHostSocket != -1 ) && (rtp.m_nHostSocket != 0) ) {
@@ -82,22 +155,48 @@ rtpnextgen::~rtpnextgen() {
     LL(3) << "Done freeing RTP Frame buffer";
 
     LL(3) << "Freeing RTP LargePacketBuffer:";
-    for(int b =0; b < networkPacketBufferFrames; b++) {
-        if(largePacketBuffer[b] != NULL) {
-            // EHL TODO: CAREFUL
-            free(largePacketBuffer[b]);
-        }
-    }
+    releaseRing();
     LL(3) << "Done freeing RTP LPB.";
 
     LOG << "RTP NextGen Final Report: ";
     LOG << "Lag events: " << lagEventCounter;
     LOG << "LAP events: " << lapEventCounter;
+    if(missedMarkerCounter != 0) {
+        LOG << "Frames ended without their end-of-frame marker: " << missedMarkerCounter;
+    }
+    if(batchCallCounter != 0) {
+        LOG << "Packets per receive call: " << std::fixed << std::setprecision(1) << (double)batchPacketCounter / batchCallCounter
+            << " (" << batchPacketCounter << " packets, " << batchCallCounter << " calls)";
+    }
+    if(directPlacement && (ring == NULL) && (replay == NULL)) {
+        LOG << "Payloads moved after misprediction: " << directMoveCounter;
+    }
+    if(truncatedPacketCounter != 0) {
+        LOG << "Truncated packets: " << truncatedPacketCounter;
+    }
+    LOG << "Complete frames: " << completeFrameCounter.load() << ", incomplete frames: " << incompleteFrameCounter.load()
+        << ", lost packets: " << lostPacketCounter.load() << ", late packets: " << latePacketCounter.load();
+    LOG << "Frame waits satisfied by spinning: " << frameWaitSpinCounter << ", by sleeping: " << frameWaitBlockCounter;
     LOG << "Network frame count:    " << frameCounterNetworkSocket;
     LOG << "Delivered frame count:  " << framesDeliveredCounter;
     LOG << "Definitely lost frames: " << frameCounterNetworkSocket-framesDeliveredCounter;
-    LOG << "Network frame buffer size: " << networkPacketBufferFrames << " frames";
+    if(parentCam == NULL) {
+        // A shard's frames are timed by the merge's clock.
+        senderClockStats sc = senderClock.stats();
+        LOG << "Sender frame rate: " << sc.fps << " fps, jitter: " << sc.jitterMicros << " us, clock drift: " << sc.driftPpm
+            << " ppm, frames stamped but not received: " << sc.skippedFrames << ", rate changes: " << sc.rateChanges;
+    }
+    LOG << "Network frame buffer size: " << ringFrames << " frames of " << slotBytes << " bytes"
+        << (ringHugePages ? " in huge pages" : "");
     LOG << "Frame construction buffer size: " << rtpConstructedFrameBufferCount << " frames";
+    if(ring != NULL) {
+        delete ring;
+        ring = NULL;
+    }
+    if(replay != NULL) {
+        delete replay;
+        replay = NULL;
+    }
     LL(4) << "Done with RTP NextGen destructor";
 }
 
@@ -141,31 +240,11 @@ bool rtpnextgen::initialize() {
         }
     }
 
-    // Allocate large packet buffer, into which packets are received.
-    // At this stage in the game, we have no idea how many chunks will
-    // be needed per frame, so we make a generous estimate and live with it.
-    // We are going to allocate 2x the frame size for the packets.
-    // Generally we are using 12 bytes for the packet header, and perhaps 500 packets per frame
-    // worst case, so perhaps 600kbyte of overhead is actually needed. Oh well, memory is cheap
-    LL(5) << "Allocating LargePacketBuffer";
-    for(int f = 0; f < networkPacketBufferFrames; f++)
-    {
-        largePacketBuffer[f] = (uint8_t*)calloc(frameBufferSizeBytes*2, 1); // 2x overhead allowed
-        if(largePacketBuffer[f] == NULL) {
-            LOG << "ERROR, cannot allocate memory for RTP NextGen Large Packet Buffer. Asked for " << frameBufferSizeBytes*2 << " bytes.";
-            LOG << "ERROR, calling abort(). Program will crash.";
-            abort();
-        }
-    }
-
-    // Here we prepare the secondary buffer which stores only the size of each packet:
-    LL(5) << "Initalizing PacketSizeBuffer";
-    for(int f = 0; f < networkPacketBufferFrames; f++)
-    {
-        for(int n = 0; n < 1024; n++) {
-            packetSizeBuffer[f][n] = 0;
-        }
-    }
+    // The large packet buffer, into which packets are received, and the per-packet
+    // tables are allocated by allocateRing() once the stream has been measured.
+    ringSized = false;
+    sizingFrames = -1;
+    sizingStarted = false;
 
 
 
@@ -173,8 +252,57 @@ bool rtpnextgen::initialize() {
     rtp.m_uRTPChunkCnt = 0;
     rtp.m_uSequenceNumber = 0;
     rtp.m_uFrameStartSeq = 0;
+    rtp.m_uNextFrameStartSeq = 0;
+    rtp.m_bNextFrameStartKnown = false;
+    rtp.m_uFrameTimestamp = 0;
     rtp.m_bFirstPacket = true;
     firstChunk = true;
+    if(options.rtpReplayFile != NULL) {
+        if(!openReplay())
+            return false;
+    } else if(!openSocket()) {
+        return false;
+    }
+
+    batchSize = options.rtpBatchSize;
+    if(batchSize < 1)
+        batchSize = 1;
+    if(batchSize > RTPNG_MAX_BATCH) {
+        LOG << "Warning, RTP batch size " << batchSize << " is too large, using " << RTPNG_MAX_BATCH;
+        batchSize = RTPNG_MAX_BATCH;
+    }
+    batchStride = 0;
+    directPlacement = options.rtpDirectPlacement;
+    directChunkSize = 0;
+    if(directPlacement) {
+        LOG << "RTP NextGen placing payloads directly into frames.";
+    }
+    LL(3) << "RTP NextGen receiving up to " << batchSize << " packets per call, timeout " << options.rtpRecvTimeoutMs << " ms.";
+
+    // Prepare buffer:
+    currentFrameNumber = 0;
+    frameCounterNetworkSocket = 0;
+    // The consumer starts over at the last slot once the first frame is done, see getFrameWait.
+    doneFrameNumber.store(0);
+    lastFrameDelivered = 0;
+    spinBudgetMicros = options.rtpSpinMicros;
+    //rtp.m_pOutputBuffer = (uint8_t *)guaranteedBufferFrames[0];
+    rtp.m_uOutputBufferSize = frameBufferSizeBytes;
+
+    // RTPGetNextOutputBuffer( rtp, false );
+    rtp.m_bInitOK = true;
+    lpbPos = 0;
+    psbPos = 0;
+    psbFramePos = 0;
+    lpbFramePos = 0;
+
+    haveInitialized = true;
+    LL(4) << "Completed RTP NextGen init";
+
+    return true;
+}
+
+bool rtpnextgen::openSocket() {
     LL(3) << "Setting up socket";
     // Set up the network listening socket:
     rtp.m_nHostSocket = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
@@ -219,6 +347,13 @@ bool rtpnextgen::initialize() {
         rtp.m_siHost.sin_addr.s_addr = htonl(INADDR_ANY);
     }
 
+    if(reusePort) {
+        int one = 1;
+        if(setsockopt(rtp.m_nHostSocket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+            LOG << "ERROR, cannot set SO_REUSEPORT on RTP socket: " << strerror(errno);
+        }
+    }
+
     int nBinding = bind( rtp.m_nHostSocket, (const sockaddr*)&rtp.m_siHost, sizeof(rtp.m_siHost) );
     if( nBinding == -1 )
     {
@@ -230,24 +365,59 @@ bool rtpnextgen::initialize() {
         LOG << "RTP NextGen bind to UDP socket success. Network ready.";
     }
 
-    // Prepare buffer:
-    currentFrameNumber = 0;
-    frameCounterNetworkSocket = 0;
-    doneFrameNumber = networkPacketBufferFrames-1; // last position. Data not valid anyway.
-    lastFrameDelivered = doneFrameNumber;
-    //rtp.m_pOutputBuffer = (uint8_t *)guaranteedBufferFrames[0];
-    rtp.m_uOutputBufferSize = frameBufferSizeBytes;
+    // Have the kernel stamp each packet as it comes in, so that network delay and jitter
+    // can be told apart from our own processing time.
+    int stampOn = 1;
+    if(setsockopt(rtp.m_nHostSocket, SOL_SOCKET, SO_TIMESTAMPNS, &stampOn, sizeof(stampOn)) != 0) {
+        LOG << "Warning, no kernel receive timestamps on RTP socket: " << strerror(errno);
+    }
 
-    // RTPGetNextOutputBuffer( rtp, false );
-    rtp.m_bInitOK = true;
-    lpbPos = 0;
-    psbPos = 0;
-    psbFramePos = 0;
-    lpbFramePos = 0;
+    // With a timeout, the receive thread wakes up now and then even when no data arrives,
+    // so that it can notice the exit flag.
+    if(options.rtpRecvTimeoutMs != 0) {
+        struct timeval tv;
+        tv.tv_sec = options.rtpRecvTimeoutMs / 1000;
+        tv.tv_usec = (options.rtpRecvTimeoutMs % 1000) * 1000;
+        if(setsockopt(rtp.m_nHostSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
+            LOG << "Warning, could not set RTP socket receive timeout: " << strerror(errno);
+        }
+    }
 
-    haveInitialized = true;
-    LL(4) << "Completed RTP NextGen init";
+    if(options.rtpPacketRing) {
+        ring = new packet_ring();
+        const char *ifname = (options.havertpInterface) ? options.rtpInterface : NULL;
+        if(ring->open(ifname, options.rtpPort, rtp.m_siHost.sin_addr.s_addr)) {
+            // Everything is read from the ring, so the socket should not queue a copy of each packet.
+            struct sock_filter dropAll = { BPF_RET | BPF_K, 0, 0, 0 };
+            struct sock_fprog prog;
+            prog.len = 1;
+            prog.filter = &dropAll;
+            if(setsockopt(rtp.m_nHostSocket, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0) {
+                LOG << "Warning, could not attach filter to RTP socket: " << strerror(errno);
+            }
+            LOG << "RTP NextGen receiving through the packet ring.";
+        } else {
+            LOG << "ERROR, cannot use the RTP packet ring, receiving from the UDP socket instead.";
+            delete ring;
+            ring = NULL;
+        }
+    }
+    return true;
+}
 
+bool rtpnextgen::openReplay() {
+    // Packets come from a capture file instead of the network.
+    replay = new pcap_reader();
+    if(!replay->open(options.rtpReplayFile, options.rtpPort)) {
+        LOG << "ERROR, cannot replay RTP capture " << options.rtpReplayFile;
+        delete replay;
+        replay = NULL;
+        return false;
+    }
+    replayStarted = false;
+    LOG << "RTP NextGen replaying " << options.rtpReplayFile
+        << (options.rtpReplayFast ? " as fast as possible" : " at the captured packet timing")
+        << (options.rtpReplayLoop ? ", looping." : ".");
     return true;
 }
 
@@ -306,10 +476,88 @@ void rtpnextgen::RTPGetNextOutputBuffer( SRTPData& rtp, bool bLastBufferReady )
     // which is also picked up as a "new frame event" by the watching
     // thread when the number changes.
 
-    doneFrameNumber = currentFrameNumber; // position
-    currentFrameNumber = (currentFrameNumber+1) % (networkPacketBufferFrames);
+    unsigned int finished = currentFrameNumber; // position
+    currentFrameNumber = (currentFrameNumber+1) % (ringFrames);
     frameCounterNetworkSocket++;
-    waitingForFirstFrame = false;
+    doneFrameNumber.store(finished, std::memory_order_release);
+    waitingForFirstFrame.store(false, std::memory_order_release);
+    publishFrame();
+    if(parentCam != NULL) {
+        assembling.store(false, std::memory_order_release);
+        parentCam->shardFrameReady(shardIndex, finished, rtp.m_uFrameTimestamp);
+    }
+}
+
+void rtpnextgen::publishFrame() {
+    // Called after doneFrameNumber is stored. The release store above makes the frame data
+    // visible to a consumer that loads doneFrameNumber with acquire ordering.
+    // The seq_cst increment and load pair with those in waitForFrame(), so either the
+    // consumer sees the new sequence number before it sleeps, or we see it waiting here.
+    frameReadySeq.fetch_add(1, std::memory_order_seq_cst);
+    if(frameWaiters.load(std::memory_order_seq_cst) != 0)
+        wakeFrameWaiters();
+}
+
+void rtpnextgen::wakeFrameWaiters() {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&frameReadySeq), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void rtpnextgen::sleepOnFrameSeq(uint32_t seq, long timeoutMicros) {
+    // Sleep until frameReadySeq is bumped, or the timeout. Returns at once if frameReadySeq is no longer seq.
+    // The caller must have incremented frameWaiters before reading seq.
+    struct timespec ts;
+    ts.tv_sec = timeoutMicros / 1000000L;
+    ts.tv_nsec = (timeoutMicros % 1000000L) * 1000L;
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&frameReadySeq), FUTEX_WAIT_PRIVATE, seq, &ts, NULL, 0);
+}
+
+bool rtpnextgen::waitForFrame(unsigned int lastDelivered) {
+    // Wait until doneFrameNumber moves away from lastDelivered, or until a timeout,
+    // so that the caller can check the exit flag. Returns true if a new frame is ready.
+    //
+    // With --rtpspin, first spin for up to spinBudgetMicros. The budget grows when a
+    // frame arrives shortly after we went to sleep, and shrinks when sleeping was the
+    // right call, so the consumer only burns CPU when frames come quickly.
+    if(doneFrameNumber.load(std::memory_order_acquire) != lastDelivered)
+        return true;
+
+    if(spinBudgetMicros != 0) {
+        steady_clock::time_point spinEnd = steady_clock::now() + microseconds(spinBudgetMicros);
+        do {
+            for(int p=0; p < 64; p++) {
+                if(doneFrameNumber.load(std::memory_order_acquire) != lastDelivered) {
+                    frameWaitSpinCounter++;
+                    return true;
+                }
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#endif
+            }
+        } while(steady_clock::now() < spinEnd);
+    }
+
+    steady_clock::time_point sleepStart = steady_clock::now();
+    frameWaiters.fetch_add(1, std::memory_order_seq_cst);
+    uint32_t seq = frameReadySeq.load(std::memory_order_seq_cst);
+    if(doneFrameNumber.load(std::memory_order_acquire) == lastDelivered) {
+        sleepOnFrameSeq(seq, RTPNG_TIMEOUT_DURATION*1000L);
+    }
+    frameWaiters.fetch_sub(1, std::memory_order_seq_cst);
+
+    bool ready = (doneFrameNumber.load(std::memory_order_acquire) != lastDelivered);
+    if(ready) {
+        frameWaitBlockCounter++;
+        if(options.rtpSpinMicros != 0) {
+            unsigned int slept = duration_cast<microseconds>(steady_clock::now() - sleepStart).count();
+            if(slept < options.rtpSpinMicros) {
+                // Would have been caught by a longer spin.
+                spinBudgetMicros = std::min(options.rtpSpinMicros, std::max(1u, spinBudgetMicros*2));
+            } else {
+                spinBudgetMicros /= 2;
+            }
+        }
+    }
+    return ready;
 }
 
 bool rtpnextgen::RTPExtract( uint8_t* pBuffer, size_t uSize, bool& bMarker,
@@ -346,45 +594,234 @@ bool rtpnextgen::RTPExtract( uint8_t* pBuffer, size_t uSize, bool& bMarker,
     return true;
 }
 
+void rtpnextgen::RTPPumpMeasure(SRTPData& rtp) {
+    // Receive a packet to measure the stream with. The data are not kept.
+    receiveFromWaiting = true;
+    ssize_t uRxSize = recvfrom(rtp.m_nHostSocket, (void*)rtp.m_pPacketBuffer, rtp.m_uPacketBufferSize, 0, nullptr, nullptr);
+    receiveFromWaiting = false;
+    if(uRxSize == -1) {
+        if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            LOG << "ERROR, Received size -1 from RTP UDP socket.";
+        }
+        return;
+    }
+    RTPMeasurePacket(rtp.m_pPacketBuffer, uRxSize, steady_clock::now());
+}
+
+void rtpnextgen::RTPMeasurePacket(uint8_t* pPacket, size_t uRxSize, steady_clock::time_point now) {
+    // Count the packets of each frame, and the largest packet, over RTPNG_SIZING_FRAMES
+    // whole frames, then size the packet buffers to match. The first frame is usually
+    // joined part way through, so measuring starts at the first end of frame marker.
+    uint8_t* pData = nullptr;
+    bool bMarker = false; bool bPadding = false; bool bExtension = false; uint8_t uCRSCCount = 0;
+    uint8_t uPayloadType = 0; uint32_t uTimeStamp = 0; uint32_t uSource = 0; uint8_t uVer = 0;
+    size_t uChunkSize = 0; uint16_t uSeqNumber = 0;
+    if(!RTPExtract(pPacket, uRxSize, bMarker, &pData, uChunkSize, uSeqNumber,
+                   uVer, bPadding, bExtension, uCRSCCount, uPayloadType, uTimeStamp, uSource)) {
+        return;
+    }
+
+    if(parentCam != NULL) {
+        // Frames from other shards wait for the frames this one is measuring, as they would for
+        // a frame being assembled, so that the first frames after measuring are delivered in order.
+        assemblingTimestamp.store(uTimeStamp, std::memory_order_relaxed);
+        assembling.store(!bMarker, std::memory_order_release);
+    }
+
+    if(!sizingStarted) {
+        sizingStarted = true;
+        sizingFirstPacket = now;
+        LL(3) << "Measuring RTP stream to size the packet buffers.";
+    }
+    if(uRxSize > sizingLargestPacket)
+        sizingLargestPacket = uRxSize;
+
+    if(sizingFrames >= 0)
+        sizingPackets++;
+    if(bMarker) {
+        if(sizingFrames < 0) {
+            sizingStart = now;
+        } else if(sizingPackets > sizingMaxPackets) {
+            sizingMaxPackets = sizingPackets;
+        }
+        sizingFrames++;
+        sizingPackets = 0;
+    }
+
+    if(sizingFrames >= RTPNG_SIZING_FRAMES) {
+        double seconds = duration_cast<microseconds>(now - sizingStart).count() / 1E6;
+        allocateRing(sizingLargestPacket, sizingMaxPackets, seconds > 0 ? sizingFrames / seconds : 0);
+    } else if(now - sizingFirstPacket > milliseconds(RTPNG_SIZING_TIMEOUT_MS)) {
+        // No frame boundaries seen. Size for a frame made of the largest packets seen.
+        LOG << "Warning, could not measure RTP frames, sizing the packet buffers from the frame size.";
+        size_t payload = (sizingLargestPacket > 12) ? sizingLargestPacket - 12 : 1;
+        allocateRing(sizingLargestPacket, (frameBufferSizeBytes + payload - 1) / payload, 0);
+    }
+}
+
+void rtpnextgen::allocateRing(size_t packetBytes, size_t packetsPerFrame, double fps) {
+    // Size the large packet buffer and the per-packet tables from the measured stream.
+    // Slots have room for a quarter more packets than the largest frame measured, and
+    // at least a whole frame of payload for direct placement.
+    const size_t payloadBytes = (packetBytes > 12) ? packetBytes - 12 : 1;
+    const size_t framePackets = (frameBufferSizeBytes + payloadBytes - 1) / payloadBytes;
+    if(packetsPerFrame < framePackets)
+        packetsPerFrame = framePackets;
+
+    packetStride = packetBytes;
+    packetsPerSlot = packetsPerFrame + packetsPerFrame/4 + 8;
+    slotBytes = packetsPerSlot * packetBytes;
+    if(slotBytes < frameBufferSizeBytes + packetBytes)
+        slotBytes = frameBufferSizeBytes + packetBytes;
+    slotBytes = (slotBytes + 4095) & ~(size_t)4095;
+
+    if(fps <= 0)
+        fps = RTPNG_SIZING_DEFAULT_FPS;
+    double frames = options.rtpBufferSeconds * fps;
+    if(frames < RTPNG_MIN_RING_FRAMES)
+        frames = RTPNG_MIN_RING_FRAMES;
+    if(frames > RTPNG_MAX_RING_FRAMES)
+        frames = RTPNG_MAX_RING_FRAMES;
+    ringFrames = (int)frames;
+
+    // Prefer explicit huge pages, then transparent huge pages.
+    ringRegionBytes = ((size_t)ringFrames * slotBytes + RTPNG_HUGE_PAGE_BYTES - 1) & ~(size_t)(RTPNG_HUGE_PAGE_BYTES - 1);
+    void *region = mmap(NULL, ringRegionBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    ringHugePages = (region != MAP_FAILED);
+    if(region == MAP_FAILED) {
+        region = mmap(NULL, ringRegionBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(region == MAP_FAILED) {
+            LOG << "ERROR, cannot allocate memory for RTP NextGen Large Packet Buffer. Asked for " << ringRegionBytes << " bytes.";
+            LOG << "ERROR, calling abort(). Program will crash.";
+            abort();
+        }
+        madvise(region, ringRegionBytes, MADV_HUGEPAGE);
+    }
+    ringRegion = (uint8_t*)region;
+
+    largePacketBuffer.resize(ringFrames);
+    for(int f = 0; f < ringFrames; f++) {
+        largePacketBuffer[f] = ringRegion + (size_t)f * slotBytes;
+    }
+    packetSizeTable.assign((size_t)ringFrames * packetsPerSlot, 0);
+    packetChunkTable.assign((size_t)ringFrames * packetsPerSlot, RTPNG_NO_CHUNK);
+    chunkMapWords = (framePackets + 63) / 64;
+    chunkMapTable.assign((size_t)ringFrames * chunkMapWords, 0);
+    slotChunkSize.assign(ringFrames, 0);
+    slotWireFirstNs.assign(ringFrames, 0);
+    slotWireLastNs.assign(ringFrames, 0);
+    frameReceive_microSec.assign(ringFrames, 0);
+    durationOfMemoryCopy_microSec.assign(ringFrames, 0);
+
+    lpbPos = 0;
+    psbPos = 0;
+    lpbFramePos = 0;
+    psbFramePos = 0;
+    ringSized = true;
+    LOG << "RTP NextGen measured " << packetsPerFrame << " packets of up to " << packetBytes << " bytes per frame at "
+        << std::fixed << std::setprecision(1) << fps << " frames per second.";
+    LOG << "RTP NextGen packet buffer: " << ringFrames << " frames (" << options.rtpBufferSeconds << " s) of "
+        << slotBytes << " bytes, " << ringRegionBytes / (1024*1024) << " MiB total"
+        << (ringHugePages ? " in huge pages." : ".");
+}
+
+void rtpnextgen::releaseRing() {
+    if(ringRegion != NULL) {
+        munmap(ringRegion, ringRegionBytes);
+        ringRegion = NULL;
+        ringRegionBytes = 0;
+    }
+    largePacketBuffer.clear();
+}
+
+bool rtpnextgen::RTPCheckRoom(size_t bytes) {
+    // Make sure the current large packet buffer slot can take another packet,
+    // and that its packet table has room for it and the zero after the last packet.
+    // If not, the end of frame was missed, and we move on to the next slot.
+    if(((size_t)lpbPos+bytes > slotBytes) || ((size_t)psbPos+1 >= packetsPerSlot)) {
+        LOG << "Error, cannot store this much data. Likely the end of frame was missed.";
+        // TODO: goto cleanup;
+        lpbFramePos = (lpbFramePos+1)%ringFrames;
+        psbFramePos = (psbFramePos+1)%ringFrames;
+        psbPos = 0;
+        lpbPos = 0;
+        return false;
+    }
+    return true;
+}
+
 void rtpnextgen::RTPPump(SRTPData& rtp ) {
     // This function is called over and over again.
     // The function requests to receive network data,
     // processes the data to extract the payload,
     // and then memcpys the data to an output buffer.
     //
-    // This function will hang here waiting for data without timeout.
+    // This function will hang here waiting for data until the
+    // socket timeout (--rtptimeout) expires.
     // Thus, it should be watched externally to see what is happening.
-    bool bMarker = false;
-    //std::chrono::steady_clock::time_point starttp;
-    //std::chrono::steady_clock::time_point endtp;
 
-    if((size_t)(lpbPos+rtp.m_uPacketBufferSize) > frameBufferSizeBytes*2) {
-        LOG << "Error, cannot store this much data. Likely the end of frame was missed.";
-        // TODO: goto cleanup;
-        lpbFramePos = (lpbFramePos+1)%networkPacketBufferFrames;
-        psbFramePos = (psbFramePos+1)%networkPacketBufferFrames;
-        psbPos = 0;
-        lpbPos = 0;
+    if(ring != NULL) {
+        RTPPumpRing(rtp);
+        return;
+    }
+
+    if(replay != NULL) {
+        RTPPumpReplay(rtp);
         return;
     }
 
+    if(!ringSized) {
+        RTPPumpMeasure(rtp);
+        return;
+    }
+
+    if(directPlacement) {
+        RTPPumpDirect(rtp);
+        return;
+    }
+
+    // Once a packet size is known, take many packets per call:
+    if((batchSize > 1) && (batchStride != 0)) {
+        RTPPumpBatch(rtp);
+        return;
+    }
+
+    if(!RTPCheckRoom(packetStride)) {
+        return;
+    }
+    // Packets larger than any seen while measuring may not fit, and are dropped.
+    size_t room = slotBytes - lpbPos;
+    if(room > (size_t)rtp.m_uPacketBufferSize)
+        room = rtp.m_uPacketBufferSize;
+
+    //std::chrono::steady_clock::time_point starttp;
+    //std::chrono::steady_clock::time_point endtp;
 
     // Receive from network into rtp.m_pPacketBuffer:
     //starttp = std::chrono::steady_clock::now();
     receiveFromWaiting = true; // for debug readout
     // Receive directly into the large packet buffer
     // at an offset:
-    ssize_t uRxSize = recvfrom(
-                rtp.m_nHostSocket, (void*)(largePacketBuffer[lpbFramePos]+lpbPos), rtp.m_uPacketBufferSize,
-                0, nullptr, nullptr
-                );
+    struct iovec iov;
+    iov.iov_base = largePacketBuffer[lpbFramePos]+lpbPos;
+    iov.iov_len = room;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    setBatchControl(mh, 0);
+    ssize_t uRxSize = recvmsg(rtp.m_nHostSocket, &mh, MSG_TRUNC);
     receiveFromWaiting = false;
     //endtp = std::chrono::steady_clock::now();
-    //frameReceive_microSec[lpbFramePos%networkPacketBufferFrames] = std::chrono::duration_cast<std::chrono::microseconds>(endtp - starttp).count();
+    //frameReceive_microSec[lpbFramePos%ringFrames] = std::chrono::duration_cast<std::chrono::microseconds>(endtp - starttp).count();
 
 
     if( uRxSize == -1 )
     {
+        if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+            // Timeout, no data right now.
+            return;
+        }
         // Handle error or cleanup.
         LOG << "ERROR, Received size -1 from RTP UDP socket.";
         //g_bRunning = false;
@@ -396,34 +833,205 @@ void rtpnextgen::RTPPump(SRTPData& rtp ) {
         //g_bRunning = false;
         return;
     }
+    if((size_t)uRxSize > room) {
+        truncatedPacketCounter++;
+        LOG << "Warning, RTP packet of " << uRxSize << " bytes is larger than the " << room << " bytes left in the frame slot, dropping it.";
+        return;
+    }
 
-    // The number of non-zero members at each primary position's sub entries
-    // tells how many chunks per frame.
-    // The number stored in each tells how large each chunk is.
-    packetSizeBuffer[psbFramePos][psbPos] = uRxSize;
+    packetWireNs = kernelReceiveNs(mh);
+    RTPProcessPacket(rtp, uRxSize);
+}
+
+void rtpnextgen::RTPPumpBatch(SRTPData& rtp) {
+    // Receive up to batchSize packets with one recvmmsg call.
+    // Each packet is given batchStride bytes of the current large packet buffer slot.
+    // Packets normally all have the same size, so they land exactly where RTPPump
+    // would have put them. A short packet (the end of a frame, usually) leaves a gap,
+    // and the packets after it are moved down, or into the next slot, before they are processed.
+    if(!RTPCheckRoom(batchStride)) {
+        return;
+    }
+
+    const size_t stride = batchStride;
+    unsigned int n = (slotBytes - lpbPos) / stride;
+    if(n > batchSize)
+        n = batchSize;
+    if(n > packetsPerSlot - 1 - psbPos)
+        n = packetsPerSlot - 1 - psbPos;
+
+    uint8_t *base = largePacketBuffer[lpbFramePos]+lpbPos;
+    for(unsigned int k=0; k < n; k++) {
+        batchIov[k].iov_base = base + k*stride;
+        batchIov[k].iov_len = stride;
+        memset(&batchMsgs[k].msg_hdr, 0, sizeof(batchMsgs[k].msg_hdr));
+        batchMsgs[k].msg_hdr.msg_iov = &batchIov[k];
+        batchMsgs[k].msg_hdr.msg_iovlen = 1;
+        setBatchControl(batchMsgs[k].msg_hdr, k);
+        batchMsgs[k].msg_len = 0;
+    }
+
+    receiveFromWaiting = true; // for debug readout
+    // MSG_WAITFORONE: block for the first packet only, then take whatever else is queued.
+    // MSG_TRUNC: report the real length of a packet that did not fit.
+    int got = recvmmsg(rtp.m_nHostSocket, batchMsgs, n, MSG_WAITFORONE | MSG_TRUNC, NULL);
+    receiveFromWaiting = false;
+
+    if(got == -1) {
+        if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+            return;
+        }
+        LOG << "ERROR, recvmmsg failed on RTP UDP socket: " << strerror(errno);
+        return;
+    }
+    batchCallCounter++;
+    batchPacketCounter += got;
+
+    size_t largestTruncated = 0;
+    for(int k=0; k < got; k++) {
+        size_t uRxSize = batchMsgs[k].msg_len;
+        if(batchMsgs[k].msg_hdr.msg_flags & MSG_TRUNC) {
+            // Larger than any packet seen before. The data are lost, but the
+            // next batch will leave enough room for a packet of this size.
+            truncatedPacketCounter++;
+            LOG << "Warning, RTP packet of " << uRxSize << " bytes was larger than the " << stride << " bytes expected, dropping it.";
+            if(uRxSize > largestTruncated)
+                largestTruncated = uRxSize;
+            continue;
+        }
+        if(uRxSize == 0) {
+            LOG << "ERROR, Received size 0 from RTP UDP socket.";
+            continue;
+        }
+
+        uint8_t *src = base + k*stride;
+        if(src != largePacketBuffer[lpbFramePos]+lpbPos) {
+            // The destination is always either earlier in the same slot or in a later slot,
+            // so the move never overwrites a packet that has not been processed yet.
+            RTPCheckRoom(uRxSize);
+            memmove(largePacketBuffer[lpbFramePos]+lpbPos, src, uRxSize);
+        }
+        packetWireNs = kernelReceiveNs(batchMsgs[k].msg_hdr);
+        RTPProcessPacket(rtp, uRxSize);
+    }
+
+    if(largestTruncated > batchStride) {
+        batchStride = largestTruncated;
+    }
+}
+
+void rtpnextgen::RTPPumpRing(SRTPData& rtp) {
+    // Take a block of packets from the packet ring and process each one in place.
+    // The ring block is given back to the kernel once every packet in it has been handled.
+    receiveFromWaiting = true; // for debug readout
+    bool haveBlock = ring->nextBlock(options.rtpRecvTimeoutMs ? (int)options.rtpRecvTimeoutMs : -1);
+    receiveFromWaiting = false;
+    if(!haveBlock)
+        return;
+    batchCallCounter++;
+
+    steady_clock::time_point now = steady_clock::now();
+    uint8_t *pPacket = NULL;
+    size_t uRxSize = 0;
+    uint64_t wireNs = 0;
+    while(ring->nextDatagram(&pPacket, &uRxSize, &wireNs)) {
+        batchPacketCounter++;
+        RTPIngestPacket(rtp, pPacket, uRxSize, now, wireNs);
+    }
+    ring->releaseBlock();
+}
+
+void rtpnextgen::RTPPumpReplay(SRTPData& rtp) {
+    // Feed up to batchSize packets from the capture file. At the captured timing, each packet
+    // is held back until it is as far from the first packet as it was in the capture.
+    if(replayDone) {
+        // Nothing left. Stay around so that the exit flag is noticed.
+        std::this_thread::sleep_for(milliseconds(RTPNG_TIMEOUT_DURATION));
+        return;
+    }
+    batchCallCounter++;
+    for(unsigned int n=0; n < batchSize; n++) {
+        uint8_t *pPacket = NULL;
+        size_t uRxSize = 0;
+        uint64_t captureNs = 0;
+        if(!replay->nextDatagram(&pPacket, &uRxSize, &captureNs)) {
+            if(options.rtpReplayLoop && (replay->datagramCount() != 0)) {
+                LL(3) << "Replay reached the end of the capture, starting over.";
+                replay->rewind();
+                replayStarted = false;
+                continue;
+            }
+            LOG << "Replay finished, " << replay->datagramCount() << " RTP packets and "
+                << replay->ignoredCount() << " other records read.";
+            replayDone = true;
+            return;
+        }
+        if(!replayStarted) {
+            replayStarted = true;
+            replayFirstNs = captureNs;
+            replayStart = steady_clock::now();
+        }
+        // When the packet arrived, on our clock.
+        steady_clock::time_point arrival = replayStart;
+        if(captureNs > replayFirstNs)
+            arrival += duration_cast<steady_clock::duration>(nanoseconds(captureNs - replayFirstNs));
+        if(!options.rtpReplayFast && (arrival > steady_clock::now())) {
+            std::this_thread::sleep_until(arrival);
+        }
+        batchPacketCounter++;
+        // The capture's own timestamps are from another time, so the replay is the wire.
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        RTPIngestPacket(rtp, pPacket, uRxSize, arrival, (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec);
+    }
+}
+
+void rtpnextgen::RTPIngestPacket(SRTPData& rtp, uint8_t* pPacket, size_t uRxSize, steady_clock::time_point arrival, uint64_t wireNs) {
+    // Handle one packet that is somewhere else in memory, in the packet ring or a capture file.
+    packetWireNs = wireNs;
+    if(uRxSize < 12) {
+        LOG << "ERROR, RTP packet too short: " << uRxSize << " bytes.";
+        return;
+    }
+    if(!ringSized) {
+        RTPMeasurePacket(pPacket, uRxSize, arrival);
+    } else if(directPlacement) {
+        RTPPlacePayload(rtp, pPacket, pPacket+12, uRxSize);
+    } else {
+        if(uRxSize > slotBytes) {
+            truncatedPacketCounter++;
+            return;
+        }
+        RTPCheckRoom(uRxSize);
+        memcpy(largePacketBuffer[lpbFramePos]+lpbPos, pPacket, uRxSize);
+        RTPProcessPacket(rtp, uRxSize);
+    }
+}
 
+bool rtpnextgen::RTPAcceptHeader(SRTPData& rtp, uint8_t* pHeader, size_t uRxSize, bool& bMarker, size_t& uChunkSize, uint16_t& uSeqNumber) {
+    // Examine the header of a received packet, check that it is from the expected source,
+    // and keep track of the sequence number. Returns false if the packet should be ignored.
     uint8_t* pData = nullptr;
-    size_t uChunkSize = 0;
-    uint16_t uSeqNumber = 0;
     bool bPadding = false; bool bExtension = false; uint8_t uCRSCCount = 0;
     uint8_t uPayloadType = 0; uint32_t uTimeStamp = 0; uint32_t uSource = 0; uint8_t uVer = 0;
 
     // Examine the packet:
     // Essentially from m_pPacketBuffer to the payload, &pData. By reference of course.
     bool bChunkOK = RTPExtract(
-                largePacketBuffer[lpbFramePos]+lpbPos,  uRxSize, bMarker, &pData, uChunkSize, uSeqNumber,
+                pHeader,  uRxSize, bMarker, &pData, uChunkSize, uSeqNumber,
                 uVer, bPadding, bExtension, uCRSCCount, uPayloadType, uTimeStamp, uSource
                 );
 
-    lpbPos = lpbPos+uRxSize;
-    psbPos++;
-
     if( !bChunkOK )
     {
         LOG << "ERROR, bad RTP packet!";
-        return;
+        return false;
     }
     rtp.m_uSource = uSource;
+    // A shard sees only some of the frames, so the sequence numbers of the
+    // others are missing between its frames. Only gaps within a frame count there.
+    const bool shardFrameStart = (parentCam != NULL) &&
+            ((rtp.m_uOutputBufferUsed == 0) || (uTimeStamp != rtp.m_timestamp));
     rtp.m_timestamp = uTimeStamp;
 
     // We have to be careful here. The FPIE-D could reboot and we will not be
@@ -436,11 +1044,11 @@ void rtpnextgen::RTPPump(SRTPData& rtp ) {
     } else {
         if(rtp.m_uSource != this->sourceNumber) {
             LOG << "Warning, rejecting chunk. Message source does not match. Initial: [" << std::setfill('0') << std::setw(8) << std::right << std::hex << this->sourceNumber << "], this chunk: [" << rtp.m_uSource << "]." << std::dec;
-            return;
+            return false;
         }
     }
 
-    if( !rtp.m_bFirstPacket )
+    if( !rtp.m_bFirstPacket && !shardFrameStart )
     {
         uint16_t uNext = rtp.m_uSequenceNumber + 1;
         if( uNext != uSeqNumber )
@@ -453,77 +1061,436 @@ void rtpnextgen::RTPPump(SRTPData& rtp ) {
     }
     rtp.m_bFirstPacket = false;
     rtp.m_uSequenceNumber = uSeqNumber;
+    return true;
+}
 
+bool rtpnextgen::RTPChunkOffset(SRTPData& rtp, uint16_t uSeqNumber, size_t uChunkSize, size_t& uOffset, size_t& uChunkIndex) {
+    // Where this chunk belongs in the frame, in bytes and in chunks.
+    // Returns false for a packet that belongs before the start of the frame being assembled,
+    // or that has already been received. Those are counted as late and not used.
     if( rtp.m_uOutputBufferUsed == 0 ) // Make a note of chunk size on first packet of frame so we can data that is missing in the right place
     {
-        // First packet of this frame
+        // First packet of this frame. The frame begins right after the previous one, so
+        // if its first packets were lost, the ones that did arrive still go in the right place.
+        // A packet more than a frame away is after a break in the stream (or, on a shard, from
+        // the shard's next frame) and begins the frame itself.
+        uint16_t uStart = uSeqNumber;
+        if(rtp.m_bNextFrameStartKnown && (rtp.m_uRTPChunkSize != 0)) {
+            const int frameChunks = (int)RTPFrameChunks(rtp);
+            const int ahead = (int16_t)(uSeqNumber - rtp.m_uNextFrameStartSeq);
+            if((ahead < 0) && (ahead >= -frameChunks)) {
+                // Straggler from the frame that was just finished.
+                latePacketCounter++;
+                return false;
+            }
+            if((ahead >= 0) && (ahead < frameChunks)) {
+                uStart = rtp.m_uNextFrameStartSeq;
+                uChunkSize = rtp.m_uRTPChunkSize; // this may be the short last chunk
+            }
+        }
         rtp.m_uRTPChunkSize = uChunkSize; // size of first packet minus 12 bytes header.
-        rtp.m_uFrameStartSeq = uSeqNumber; // sequence number from first packet.
+        rtp.m_uFrameStartSeq = uStart;
+        rtp.m_uFrameTimestamp = rtp.m_timestamp;
+        slotChunkSize[lpbFramePos] = uChunkSize;
+        memset(chunkMap(lpbFramePos), 0, chunkMapWords*sizeof(uint64_t));
+        if(parentCam != NULL) {
+            assemblingTimestamp.store(rtp.m_timestamp, std::memory_order_relaxed);
+            assembling.store(true, std::memory_order_release);
+        }
+    }
+    if( (int16_t)(uSeqNumber - rtp.m_uFrameStartSeq) < 0 ) {
+        latePacketCounter++;
+        return false;
+    }
+    uChunkIndex = (uint16_t)(uSeqNumber - rtp.m_uFrameStartSeq);
+    if( (uChunkIndex < chunkMapWords*64) && (chunkMap(lpbFramePos)[uChunkIndex/64] & (1ULL << (uChunkIndex%64))) ) {
+        latePacketCounter++;
+        return false;
+    }
+    uOffset = uChunkIndex * rtp.m_uRTPChunkSize;
+    return true;
+}
+
+size_t rtpnextgen::RTPFrameChunks(SRTPData& rtp) {
+    // Packets per frame, from the chunk size of the frame being assembled.
+    if(rtp.m_uRTPChunkSize == 0)
+        return 0;
+    return (rtp.m_uOutputBufferSize + rtp.m_uRTPChunkSize - 1) / rtp.m_uRTPChunkSize;
+}
+
+bool rtpnextgen::RTPNextFrameStarted(SRTPData& rtp, uint16_t uSeqNumber, size_t uChunkSize) {
+    // Returns true if this packet is from a later frame than the one being assembled,
+    // which means the end-of-frame marker was lost. That shows as a newer RTP timestamp,
+    // or, for senders that do not stamp each frame, as a packet past the end of the frame.
+    // The next frame is then expected to begin where this one should have ended.
+    if(rtp.m_uOutputBufferUsed == 0)
+        return false;
+    const bool newer = timestampPerFrame && timestampBefore(rtp.m_uFrameTimestamp, rtp.m_timestamp);
+    const int index = (int16_t)(uSeqNumber - rtp.m_uFrameStartSeq);
+    const bool beyond = (index >= 0) && ((size_t)index * rtp.m_uRTPChunkSize + uChunkSize > rtp.m_uOutputBufferSize);
+    if(!newer && !beyond)
+        return false;
+
+    if(missedMarkerCounter++ == 0) {
+        LOG << "Warning, an end of frame marker was missed. Frame timestamp: " << rtp.m_uFrameTimestamp
+            << ", this packet: " << rtp.m_timestamp << ", chunk " << index << " of a frame of " << RTPFrameChunks(rtp)
+            << ". Ending the frame and starting the next one with this packet."
+            << " Please check adapter MTU, net.core.rmem_default, and net.core.rmem_max.";
+    }
+    rtp.m_uNextFrameStartSeq = rtp.m_uFrameStartSeq + RTPFrameChunks(rtp);
+    rtp.m_bNextFrameStartKnown = true;
+    return true;
+}
+
+void rtpnextgen::RTPMarkerSeen(SRTPData& rtp, uint16_t uSeqNumber) {
+    // The marker is the last packet of the frame, so the next frame begins right after it.
+    rtp.m_uNextFrameStartSeq = uSeqNumber + 1;
+    rtp.m_bNextFrameStartKnown = true;
+    // Only trust a change of timestamp to mean a new frame if the sender keeps it for a whole frame.
+    timestampPerFrame = (rtp.m_timestamp == rtp.m_uFrameTimestamp);
+}
+
+void rtpnextgen::RTPMarkChunk(size_t uChunkIndex) {
+    // One good chunk of the current frame has arrived.
+    if(uChunkIndex < chunkMapWords*64)
+        chunkMap(lpbFramePos)[uChunkIndex/64] |= (1ULL << (uChunkIndex%64));
+    if(packetWireNs != 0) {
+        if(frameWireFirstNs == 0)
+            frameWireFirstNs = packetWireNs;
+        frameWireLastNs = packetWireNs;
+    }
+}
+
+size_t rtpnextgen::expectedChunks(int slot) {
+    size_t chunk = slotChunkSize[slot];
+    if(chunk == 0)
+        return 0;
+    size_t n = (frameBufferSizeBytes + chunk - 1) / chunk;
+    if(n > chunkMapWords*64) {
+        if(!chunkMapOverflowWarned) {
+            LOG << "Warning, frames of " << n << " chunks are larger than measured, tracking packet loss for the first " << chunkMapWords*64;
+            chunkMapOverflowWarned = true;
+        }
+        n = chunkMapWords*64;
+    }
+    return n;
+}
+
+void rtpnextgen::zeroMissingChunks(uint8_t *frame, int slot) {
+    // Zero the parts of the frame whose packets never arrived.
+    const size_t chunk = slotChunkSize[slot];
+    const size_t n = expectedChunks(slot);
+    for(size_t w=0; w*64 < n; w++) {
+        uint64_t have = chunkMap(slot)[w];
+        if(have == ~0ULL)
+            continue;
+        for(size_t c = w*64; (c < n) && (c < (w+1)*64); c++) {
+            if(!(have & (1ULL << (c%64)))) {
+                size_t start = c*chunk;
+                size_t len = std::min(chunk, frameBufferSizeBytes - start);
+                memset(frame + start, 0, len);
+            }
+        }
+    }
+}
+
+void rtpnextgen::RTPEndOfFrame(SRTPData& rtp, const uint8_t* pFrameData) {
+    if(options.debug) {
+        LL(3) << "MARK end of network frame #" << frameCounterNetworkSocket
+              << ", write frame position: " << lpbFramePos
+              << ", chunk count: " << rtp.m_uRTPChunkCnt << " chunks.";
+        // This will only work if the packets are at least 40 bytes each.
+        // This is because it is a quick hack and looks at the packet buffer, not the actual assembled frame.
+        for(int b=0; b < 40; b++) {
+            std::cout << std::setfill('0') << std::setw(2) << std::right << std::hex << (int)(pFrameData[b]) << std::dec << " ";
+        }
+        std::cout << std::endl;
     }
-    size_t uChunkIndex;
-    if( uSeqNumber >= rtp.m_uFrameStartSeq ) {
-        uChunkIndex = uSeqNumber - rtp.m_uFrameStartSeq;
+    chunksPerFramePrior = rtp.m_uRTPChunkCnt;
+
+    // Account for missing chunks, and find which rows they cover.
+    const size_t expected = expectedChunks(lpbFramePos);
+    size_t missing = 0;
+    size_t firstMissing = 0;
+    size_t lastMissing = 0;
+    for(size_t c=0; c < expected; c++) {
+        if(!(chunkMap(lpbFramePos)[c/64] & (1ULL << (c%64)))) {
+            if(missing == 0)
+                firstMissing = c;
+            lastMissing = c;
+            missing++;
+        }
+    }
+    if(missing == 0) {
+        completeFrameCounter++;
     } else {
-        uChunkIndex = 0x10000 - ((size_t)rtp.m_uFrameStartSeq - (size_t)uSeqNumber);
+        incompleteFrameCounter++;
+        lostPacketCounter += missing;
+        const size_t rowBytes = frame_width*sizeof(uint16_t);
+        const size_t chunk = slotChunkSize[lpbFramePos];
+        int lastRow = std::min((size_t)data_height-1, ((lastMissing+1)*chunk - 1) / rowBytes);
+        lastDamagedFirstRow.store((firstMissing*chunk) / rowBytes);
+        lastDamagedLastRow.store(lastRow);
+        if(directPlacement) {
+            // The consumer reads this slot as it is.
+            zeroMissingChunks(largePacketBuffer[lpbFramePos], lpbFramePos);
+        }
+    }
+
+    if((rtp.m_uFrameTimestamp < lastTimeStamp) && (lastTimeStamp != 0) && (rtp.m_uFrameTimestamp != 0)) {
+        LOG << "Error, frame timestamp decreased. Prior frame: " << lastTimeStamp << ", this frame: " << rtp.m_uFrameTimestamp << ", keeping anyway.";
+        // keep the frame anyway.
+    }
+    lastTimeStamp = rtp.m_uFrameTimestamp;
+    // Stored before the frame is published, so the consumer sees them with it.
+    slotWireFirstNs[lpbFramePos] = frameWireFirstNs;
+    slotWireLastNs[lpbFramePos] = frameWireLastNs;
+    // Every frame received goes to the sender clock, also those the consumer never gets,
+    // so that frames dropped here are not counted as skipped by the sender.
+    uint64_t arrivalNs = frameWireLastNs;
+    if(arrivalNs == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        arrivalNs = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+    }
+    (parentCam != NULL ? parentCam->senderClock : senderClock).frame(rtp.m_uFrameTimestamp, arrivalNs);
+    frameWireFirstNs = 0;
+    frameWireLastNs = 0;
+    RTPGetNextOutputBuffer( rtp, true ); // This is where the frame is advanced.
+    // Reset buffer
+    rtp.m_uRTPChunkCnt = 0;
+    rtp.m_uOutputBufferUsed = 0;
+    // Mark the next spot as zero:
+    packetSizes(psbFramePos)[psbPos] = 0; // psbPos has been ++ already.
+    // Advance to next slot of large packet buffer, and reset sub index
+    lpbFramePos = (lpbFramePos+1)%ringFrames;
+    psbFramePos = (psbFramePos+1)%ringFrames;
+
+    psbPos = 0;
+    lpbPos = 0;
+}
+
+void rtpnextgen::RTPProcessPacket(SRTPData& rtp, ssize_t uRxSize) {
+    // The packet has been received into largePacketBuffer[lpbFramePos]+lpbPos.
+    bool bMarker = false;
+    size_t uChunkSize = 0;
+    uint16_t uSeqNumber = 0;
+
+    uint8_t* pPacket = largePacketBuffer[lpbFramePos]+lpbPos;
+    const bool bAccepted = RTPAcceptHeader(rtp, pPacket, uRxSize, bMarker, uChunkSize, uSeqNumber);
+    if(bAccepted && RTPNextFrameStarted(rtp, uSeqNumber, uChunkSize)) {
+        // Finish the frame without this packet, and begin the next slot with it.
+        RTPEndOfFrame(rtp, largePacketBuffer[lpbFramePos]+12);
+        memcpy(largePacketBuffer[lpbFramePos], pPacket, uRxSize);
+        pPacket = largePacketBuffer[lpbFramePos];
     }
-    size_t uOffset = uChunkIndex * rtp.m_uRTPChunkSize;
+
+    // The number of non-zero members at each primary position's sub entries
+    // tells how many chunks per frame.
+    // The number stored in each tells how large each chunk is.
+    packetSizes(psbFramePos)[psbPos] = uRxSize;
+    uint16_t &chunkIndexOut = packetChunkIndex(psbFramePos)[psbPos];
+    chunkIndexOut = RTPNG_NO_CHUNK; // until it is known to be good
+    lpbPos = lpbPos+uRxSize;
+    psbPos++;
+
+    if(!bAccepted)
+        return;
+
+    size_t uOffset = 0;
+    size_t uChunkIndex = 0;
+    if(!RTPChunkOffset(rtp, uSeqNumber, uChunkSize, uOffset, uChunkIndex))
+        return;
     // Offset is how far into the frame data we are.
     // The offset must not exceed the size of a frame!
     if( ( uOffset + uChunkSize ) > rtp.m_uOutputBufferSize ) {
-        LOG << "An end of frame marker was missed, or the frame being received is larger than expected, or the chunks are not all the same size. Not keeping this chunk: " << rtp.m_uRTPChunkCnt+1;
+        // Even the first packet of a frame does not fit, so the chunks are larger than the frame,
+        // or not all the same size.
+        LOG << "The frame being received is larger than expected, or the chunks are not all the same size. Not keeping this chunk: " << rtp.m_uRTPChunkCnt+1;
         LOG << "  Chunk count for last good frame was " << chunksPerFramePrior << ". Size (bytes) of this chunk: " << rtp.m_uRTPChunkSize << ", offset into frame: " << uOffset << ", size of buffer for single frame storage: " << rtp.m_uOutputBufferSize;
-        LOG << "  Forcing end-of-frame MARK. Please check adapter MTU, net.core.rmem_default, and net.core.rmem_max.";
         if(uRxSize-uRxSizePrior != 0) {
             LOG << "  Size (bytes) of this UDP transaction: " << uRxSize << ", size of prior transaction: " << uRxSizePrior << ". Delta: " << uRxSize-uRxSizePrior;
         }
-        // At this point, we've received more data than we expected in this frame. We probably missed a MARK packet,
-        // and to recover, we will fake the MARK and take the data at the quantity we expected, and move on.
-        // There is no need to memcpy since we're dealing with corrupted data anyway. How would we know where to put it?
-        bMarker = true;
-        // We also don't need to record the size of this packet since it may be in error anyway.
-        // A consequence of this is that the next frame received may be offset by the error,
-        // but it will all get straightened out once the next MARK is received.
     } else {
         // VALID data for a frame!! Let's keep it!
         // TODO
         //memcpy( rtp.m_pOutputBuffer + uOffset, pData, uChunkSize );
+        chunkIndexOut = uChunkIndex; // buildFrameFromPackets puts it at uChunkIndex * chunk size
+        RTPMarkChunk(uChunkIndex);
         uRxSizePrior = uRxSize;
+        // Batched receives give each packet as much room as the largest good packet.
+        if((size_t)uRxSize > batchStride) {
+            batchStride = uRxSize;
+        }
     }
     rtp.m_uRTPChunkCnt++;
     rtp.m_uOutputBufferUsed += uChunkSize;
     if( bMarker ) // EoF (Frame complete)
     {
-        if(options.debug) {
-            LL(3) << "MARK end of network frame #" << frameCounterNetworkSocket
-                  << ", write frame position: " << lpbFramePos
-                  << ", chunk count: " << rtp.m_uRTPChunkCnt << " chunks.";
-            // This will only work if the packets are at least 40 bytes each.
-            // This is because it is a quick hack and looks at the packet buffer, not the actual assembled frame.
-            for(int b=0; b < 40; b++) {
-                std::cout << std::setfill('0') << std::setw(2) << std::right << std::hex << (int)(largePacketBuffer[lpbFramePos][12+b]) << std::dec << " ";
+        RTPMarkerSeen(rtp, uSeqNumber);
+        RTPEndOfFrame(rtp, largePacketBuffer[lpbFramePos]+12);
+    }
+}
+
+void rtpnextgen::RTPPumpDirect(SRTPData& rtp) {
+    // Direct placement: the header of each packet goes to a small scratch area, and the payload
+    // goes straight to where we expect it to belong in the frame, which is the next chunk after
+    // the last one received. With no loss, every payload is already in place once it arrives,
+    // and the completed frame can be handed to the consumer as it is.
+    //
+    // Until the chunk size is known, packets are received whole into rtp.m_pPacketBuffer
+    // and the payload is copied into place.
+    if(directChunkSize == 0) {
+        struct iovec iov;
+        iov.iov_base = rtp.m_pPacketBuffer;
+        iov.iov_len = rtp.m_uPacketBufferSize;
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        setBatchControl(mh, 0);
+        receiveFromWaiting = true;
+        ssize_t uRxSize = recvmsg(rtp.m_nHostSocket, &mh, 0);
+        receiveFromWaiting = false;
+        if(uRxSize == -1) {
+            if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+                LOG << "ERROR, Received size -1 from RTP UDP socket.";
             }
-            std::cout << std::endl;
+            return;
         }
-        chunksPerFramePrior = rtp.m_uRTPChunkCnt;
+        directBatchGot = 0;
+        packetWireNs = kernelReceiveNs(mh);
+        RTPPlacePayload(rtp, rtp.m_pPacketBuffer, rtp.m_pPacketBuffer+12, uRxSize);
+        if(rtp.m_uOutputBufferUsed != 0) {
+            directChunkSize = rtp.m_uRTPChunkSize;
+        }
+        return;
+    }
 
-        if((rtp.m_timestamp < lastTimeStamp) && (lastTimeStamp != 0) && (rtp.m_timestamp != 0)) {
-            LOG << "Error, frame timestamp decreased. Prior frame: " << lastTimeStamp << ", this frame: " << rtp.m_timestamp << ", keeping anyway.";
-            // keep the frame anyway.
-            // Also, there is a minor issue that the timestamp is only compared from the last packet of the frame versus all packets of a frame, etc.
+    // Predict where each packet of the batch will go. A frame is expected
+    // to have as many chunks as the last one did.
+    const size_t chunk = directChunkSize;
+    size_t index = 0;
+    if(rtp.m_uOutputBufferUsed != 0) {
+        index = (uint16_t)(rtp.m_uSequenceNumber + 1 - rtp.m_uFrameStartSeq);
+    }
+    unsigned int n = 0;
+    for(; n < batchSize; n++, index++) {
+        size_t slotAdvance = 0;
+        size_t idx = index;
+        if(chunksPerFramePrior != 0) {
+            slotAdvance = idx / chunksPerFramePrior;
+            idx = idx % chunksPerFramePrior;
         }
-        lastTimeStamp = rtp.m_timestamp;
-        RTPGetNextOutputBuffer( rtp, true ); // This is where the frame is advanced.
-        // Reset buffer
-        rtp.m_uRTPChunkCnt = 0;
-        rtp.m_uOutputBufferUsed = 0;
-        // Mark the next spot as zero:
-        packetSizeBuffer[psbFramePos][psbPos] = 0; // psbPos has been ++ already.
-        // Advance to next slot of large packet buffer, and reset sub index
-        lpbFramePos = (lpbFramePos+1)%networkPacketBufferFrames;
-        psbFramePos = (psbFramePos+1)%networkPacketBufferFrames;
+        if((idx+1)*chunk > slotBytes)
+            break;
+        uint8_t *slot = largePacketBuffer[(lpbFramePos+slotAdvance)%ringFrames];
+        directIov[n][0].iov_base = directHeaders[n];
+        directIov[n][0].iov_len = 12;
+        directIov[n][1].iov_base = slot + idx*chunk;
+        directIov[n][1].iov_len = chunk;
+        memset(&batchMsgs[n].msg_hdr, 0, sizeof(batchMsgs[n].msg_hdr));
+        batchMsgs[n].msg_hdr.msg_iov = directIov[n];
+        batchMsgs[n].msg_hdr.msg_iovlen = 2;
+        setBatchControl(batchMsgs[n].msg_hdr, n);
+        batchMsgs[n].msg_len = 0;
+    }
+    if(n == 0) {
+        // The frame is already larger than expected. Fall back to the whole-packet path until the next frame.
+        directChunkSize = 0;
+        return;
+    }
 
-        psbPos = 0;
-        lpbPos = 0;
+    receiveFromWaiting = true;
+    int got = recvmmsg(rtp.m_nHostSocket, batchMsgs, n, MSG_WAITFORONE | MSG_TRUNC, NULL);
+    receiveFromWaiting = false;
+    if(got == -1) {
+        if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            LOG << "ERROR, recvmmsg failed on RTP UDP socket: " << strerror(errno);
+        }
+        return;
+    }
+    batchCallCounter++;
+    batchPacketCounter += got;
+
+    directBatchGot = got;
+    directBatchStaged = false;
+    for(int k=0; k < got; k++) {
+        directBatchNext = k+1;
+        size_t uRxSize = batchMsgs[k].msg_len;
+        if(batchMsgs[k].msg_hdr.msg_flags & MSG_TRUNC) {
+            // The packet is larger than the chunk size. Start learning again.
+            truncatedPacketCounter++;
+            LOG << "Warning, RTP packet of " << uRxSize << " bytes was larger than the expected " << chunk+12 << " bytes, dropping it.";
+            directChunkSize = 0;
+            continue;
+        }
+        if(uRxSize < 12) {
+            LOG << "ERROR, RTP packet too short: " << uRxSize << " bytes.";
+            continue;
+        }
+        packetWireNs = kernelReceiveNs(batchMsgs[k].msg_hdr);
+        RTPPlacePayload(rtp, directHeaders[k], (uint8_t*)directIov[k][1].iov_base, uRxSize);
+    }
+    directBatchGot = 0;
+}
+
+void rtpnextgen::RTPStageBatchTail() {
+    // A payload of the current batch is about to be moved. Copy the payloads that
+    // have not been placed yet out of the way first, since the move may land on them.
+    if(directBatchStaged || (directBatchNext >= directBatchGot))
+        return;
+    directScratch.resize((size_t)(directBatchGot - directBatchNext) * directIov[0][1].iov_len);
+    uint8_t *dst = directScratch.data();
+    for(int k = directBatchNext; k < directBatchGot; k++) {
+        size_t len = directIov[k][1].iov_len;
+        memcpy(dst, directIov[k][1].iov_base, len);
+        directIov[k][1].iov_base = dst;
+        dst += len;
+    }
+    directBatchStaged = true;
+}
+
+void rtpnextgen::RTPPlacePayload(SRTPData& rtp, uint8_t* pHeader, uint8_t* pPayload, size_t uRxSize) {
+    // Put the payload of one packet at its place in the frame, largePacketBuffer[lpbFramePos].
+    bool bMarker = false;
+    size_t uChunkSize = 0;
+    uint16_t uSeqNumber = 0;
+
+    if(!RTPAcceptHeader(rtp, pHeader, uRxSize, bMarker, uChunkSize, uSeqNumber))
+        return;
+    if(RTPNextFrameStarted(rtp, uSeqNumber, uChunkSize)) {
+        // Finish the frame, and move this payload to its place in the next one below.
+        RTPEndOfFrame(rtp, largePacketBuffer[lpbFramePos]);
+    }
+
+    size_t uOffset = 0;
+    size_t uChunkIndex = 0;
+    if(!RTPChunkOffset(rtp, uSeqNumber, uChunkSize, uOffset, uChunkIndex))
+        return;
+    if( ( uOffset + uChunkSize ) > rtp.m_uOutputBufferSize ) {
+        LOG << "The frame being received is larger than expected. Not keeping this chunk: " << rtp.m_uRTPChunkCnt+1
+            << ", offset into frame: " << uOffset << ".";
+    } else {
+        uint8_t *dest = largePacketBuffer[lpbFramePos] + uOffset;
+        if((ring != NULL) || (replay != NULL)) {
+            // Payloads in the packet ring or a capture file are always copied out.
+            memcpy(dest, pPayload, uChunkSize);
+        } else if(dest != pPayload) {
+            // Lost or reordered packet, or the frame ended early.
+            directMoveCounter++;
+            RTPStageBatchTail();
+            memmove(dest, pPayload, uChunkSize);
+        }
+        RTPMarkChunk(uChunkIndex);
+        uRxSizePrior = uRxSize;
+    }
+    rtp.m_uRTPChunkCnt++;
+    rtp.m_uOutputBufferUsed += uChunkSize;
+    if( bMarker ) // EoF (Frame complete)
+    {
+        RTPMarkerSeen(rtp, uSeqNumber);
+        RTPEndOfFrame(rtp, largePacketBuffer[lpbFramePos]);
     }
 }
 
@@ -548,7 +1515,7 @@ bool rtpnextgen::buildFrameFromPackets(int pos) {
     // For each chunk stored,
     // there are 12 bytes of header
     // and N bytes of frame, where N
-    // is the packetSize, as stored in packetSizeBuffer,
+    // is the packetSize, as stored in packetSizes(pos),
     // minus the 12 bytes of header.
     // Indeed, we are not even needing to read the header.
 
@@ -556,29 +1523,35 @@ bool rtpnextgen::buildFrameFromPackets(int pos) {
     // we pass the position variable because it is possible
     // that the frame advances significantly while we are here.
 
+    // Each payload goes to its chunk index times the chunk size, so a lost
+    // packet leaves a gap, which is zeroed, rather than shifting the rest of the frame.
+
     // We must be much faster than 1/FPS to keep up.
 
     // Keeping some of these volatile for debug purposes.
     // std::chrono::steady_clock::time_point starttp;
     // std::chrono::steady_clock::time_point endtp;
-    volatile size_t frameBytesMoved = 0;
+    uint8_t *frame = (uint8_t *)guaranteedBufferFrames[constructedFramePosition];
+    const size_t chunkSize = slotChunkSize[pos];
     volatile int chunk = 0;
     int headerOffsetBytes = 12;
     volatile int startOffset = 0;
     // starttp = std::chrono::steady_clock::now();
 
-    for(; packetSizeBuffer[pos][chunk] !=0; chunk++) {
-        if(packetSizeBuffer[pos][chunk] > 65535) {
-            LOG << "ERROR, packet size recorded is too large. Corruption likely. packetSizeBuffer[" << pos << "][" << chunk << "]: " << packetSizeBuffer[pos][chunk];
+    const uint32_t *sizes = packetSizes(pos);
+    const uint16_t *indexes = packetChunkIndex(pos);
+    for(; ((size_t)chunk < packetsPerSlot) && (sizes[chunk] != 0); chunk++) {
+        if(sizes[chunk] > 65535) {
+            LOG << "ERROR, packet size recorded is too large. Corruption likely. packetSizes(" << pos << ")[" << chunk << "]: " << sizes[chunk];
             return false;
-        } else {
-            memcpy(((uint8_t *)guaranteedBufferFrames[constructedFramePosition])+frameBytesMoved,
+        } else if(indexes[chunk] != RTPNG_NO_CHUNK) {
+            memcpy(frame + indexes[chunk]*chunkSize,
                    largePacketBuffer[pos]+startOffset+headerOffsetBytes,
-                   packetSizeBuffer[pos][chunk]-headerOffsetBytes);
+                   sizes[chunk]-headerOffsetBytes);
         }
-        startOffset += packetSizeBuffer[pos][chunk];
-        frameBytesMoved += packetSizeBuffer[pos][chunk]-headerOffsetBytes;
+        startOffset += sizes[chunk];
     }
+    zeroMissingChunks(frame, pos);
 
     // Capture the time spent copying for benchmark purposes:
     // endtp = std::chrono::steady_clock::now();
@@ -589,6 +1562,17 @@ bool rtpnextgen::buildFrameFromPackets(int pos) {
 void rtpnextgen::streamLoop() {
     // This will run until we are closing.
 
+    if(!shards.empty()) {
+        // Run each shard's receive loop in its own thread. They stop on camcontrol->exit.
+        for(size_t n=0; n < shards.size(); n++) {
+            shardThreads.push_back(std::thread(&rtpnextgen::streamLoop, shards[n]));
+            std::string name = "RTPNG Shard " + std::to_string(n);
+            pthread_setname_np(shardThreads.back().native_handle(), name.c_str());
+        }
+        LL(3) << "Started " << shards.size() << " RTP NextGen shard threads.";
+        return;
+    }
+
     LL(3) << "Starting RTPPump()";
     volatile uint64_t pumpCount=0;
     g_bRunning = true;
@@ -602,7 +1586,7 @@ void rtpnextgen::streamLoop() {
             if(camcontrol->pause) {
                 // debug opportunity:
                 if(options.debug) {
-                    for(int n=0; n < networkPacketBufferFrames; n++) {
+                    for(int n=0; n < ringFrames; n++) {
                         LOG << "[" << n << "]: " << frameReceive_microSec[n];
                     }
                 }
@@ -613,16 +1597,144 @@ void rtpnextgen::streamLoop() {
     LL(3) << "Finished RTPPump() with pumpCount = " << pumpCount;
 }
 
+void rtpnextgen::shardFrameReady(int shard, unsigned int slot, uint32_t timestamp) {
+    // Called by a shard's receive thread for each frame it finishes.
+    {
+        std::lock_guard<std::mutex> lock(shardMutex);
+
+        // If the consumer is so far behind on this shard that its slot could be
+        // reused before delivery, drop this shard's oldest waiting frame.
+        if((int)shardQueued[shard] + 4 >= shards[shard]->ringFrames) {
+            for(std::deque<shardFrame>::iterator it = orderedFrames.begin(); it != orderedFrames.end(); ++it) {
+                if(it->shard == shard) {
+                    orderedFrames.erase(it);
+                    shardQueued[shard]--;
+                    lapEventCounter++;
+                    break;
+                }
+            }
+        }
+
+        shardFrame f;
+        f.timestamp = timestamp;
+        f.shard = shard;
+        f.slot = slot;
+        f.arrival = steady_clock::now();
+        // Usually the newest frame, so search from the back.
+        std::deque<shardFrame>::iterator pos = orderedFrames.end();
+        while((pos != orderedFrames.begin()) && timestampBefore(timestamp, (pos-1)->timestamp))
+            --pos;
+        orderedFrames.insert(pos, f);
+        shardQueued[shard]++;
+    }
+    publishFrame();
+}
+
+uint16_t* rtpnextgen::shardFrameData(unsigned int slot) {
+    // Runs on the consumer thread.
+    if(directPlacement)
+        return (uint16_t*)largePacketBuffer[slot];
+    constructedFramePosition = (constructedFramePosition+1)%rtpConstructedFrameBufferCount;
+    buildFrameFromPackets(slot);
+    return guaranteedBufferFrames[constructedFramePosition];
+}
+
+uint16_t* rtpnextgen::getShardedFrameWait(camStatusEnum *stat) {
+    // Deliver the waiting frame with the earliest timestamp, unless another shard is
+    // part way through a frame with an earlier timestamp. Then wait for that shard,
+    // but for no longer than RTPNG_REORDER_WINDOW_US.
+    while(true) {
+        if(camcontrol->exit) {
+            *stat = CameraModel::camDone;
+            LL(4) << "Returning timeout frame due to camcontrol->exit flag.";
+            return timeoutFrame;
+        }
+
+        frameWaiters.fetch_add(1, std::memory_order_seq_cst);
+        uint32_t seq = frameReadySeq.load(std::memory_order_seq_cst);
+        long sleepMicros = RTPNG_TIMEOUT_DURATION*1000L;
+        bool haveFrame = false;
+        shardFrame f;
+        {
+            std::lock_guard<std::mutex> lock(shardMutex);
+            if(!orderedFrames.empty()) {
+                f = orderedFrames.front();
+                bool earlierPending = false;
+                for(size_t n=0; n < shards.size(); n++) {
+                    if((int)n == f.shard)
+                        continue;
+                    if(shards[n]->assembling.load(std::memory_order_acquire) &&
+                            timestampBefore(shards[n]->assemblingTimestamp.load(std::memory_order_relaxed), f.timestamp)) {
+                        earlierPending = true;
+                        break;
+                    }
+                }
+                long waited = duration_cast<microseconds>(steady_clock::now() - f.arrival).count();
+                if(!earlierPending || (waited >= RTPNG_REORDER_WINDOW_US)) {
+                    if(earlierPending)
+                        reorderTimeoutCounter++;
+                    if(deliveredAny && timestampBefore(f.timestamp, lastDeliveredTimestamp)) {
+                        // Finished after a later frame was already delivered. Keep it anyway.
+                        outOfOrderCounter++;
+                    } else {
+                        lastDeliveredTimestamp = f.timestamp;
+                    }
+                    orderedFrames.pop_front();
+                    shardQueued[f.shard]--;
+                    lagLevel = orderedFrames.size();
+                    if(lagLevel > maxLagLevel)
+                        maxLagLevel = lagLevel;
+                    deliveredAny = true;
+                    haveFrame = true;
+                } else {
+                    sleepMicros = RTPNG_REORDER_WINDOW_US - waited;
+                }
+            }
+        }
+        if(haveFrame) {
+            frameWaiters.fetch_sub(1, std::memory_order_seq_cst);
+            *stat = camPlaying;
+            framesDeliveredCounter++;
+            noteDelivered(shards[f.shard], f.slot);
+            return shards[f.shard]->shardFrameData(f.slot);
+        }
+
+        *stat = camWaiting;
+        sleepOnFrameSeq(seq, sleepMicros);
+        frameWaiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+}
+
 uint16_t* rtpnextgen::getFrameWait(unsigned int lastFrameNumber, camStatusEnum *stat) {
     // This is a new function that attempts to mitigate situations of extreme buffer lag.
 
-    // Note, doneFrameNumber is initialized to guaranteedBufferFramesCount_rtpng-1,
-    // but we write the first frame in at index zero. Thus, we do not get trapped waiting
+    if(!shards.empty()) {
+        return getShardedFrameWait(stat);
+    }
+
+    // Note, lastFrameDelivered is set to ringFrames-1 once the first frame is done,
+    // and we write the first frame in at index zero. Thus, we do not get trapped waiting
     // for the buffer to move.
-    // lastFrameDelivered is set equal to doneFrameNumber at init.
 
-    int writeFrame = doneFrameNumber; // latest available fully-written frame.
-    int frameToDeliver = (lastFrameDelivered+1)%networkPacketBufferFrames;
+    if(waitingForFirstFrame.load(std::memory_order_acquire)) {
+        // Wait here until we are actually receiving some data.
+        // The receive thread sizes the ring once it has measured the stream,
+        // and wakes us when the first frame is done.
+        while(waitingForFirstFrame.load(std::memory_order_acquire)) {
+            *stat = camWaiting;
+            waitForFrame(lastFrameDelivered);
+            if(camcontrol->exit) {
+                *stat = CameraModel::camDone;
+                LL(4) << "Returning timeout frame due to camcontrol->exit flag.";
+                return timeoutFrame;
+            }
+        }
+        // The first frame is written at index zero.
+        lastFrameDelivered = ringFrames-1;
+    }
+
+    int writeFrame = doneFrameNumber.load(std::memory_order_acquire); // latest available fully-written frame.
+    int frameToDeliver = (lastFrameDelivered+1)%ringFrames;
     volatile int waitTaps = 0; // metric to track how long we wait
     bool lagCorectionApplied = false;
 
@@ -634,8 +1746,10 @@ uint16_t* rtpnextgen::getFrameWait(unsigned int lastFrameNumber, camStatusEnum *
         percentBufferUsed = 0;
     } else {
         // First frame will get here. writeFrame = 0 and frameToDeliver will be 0. LastFrameDelivered will be bufsize-1.
-        lagLevel = (((writeFrame-frameToDeliver)%networkPacketBufferFrames)+networkPacketBufferFrames)%networkPacketBufferFrames;
-        percentBufferUsed = 100.0*lagLevel / networkPacketBufferFrames;
+        lagLevel = (((writeFrame-frameToDeliver)%ringFrames)+ringFrames)%ringFrames;
+        percentBufferUsed = 100.0*lagLevel / ringFrames;
+        if(lagLevel > maxLagLevel)
+            maxLagLevel = lagLevel;
     }
 
     if(camcontrol->exit) {
@@ -650,20 +1764,6 @@ uint16_t* rtpnextgen::getFrameWait(unsigned int lastFrameNumber, camStatusEnum *
         std::this_thread::sleep_for(std::chrono::microseconds(100));
     }
 
-    while(waitingForFirstFrame) {
-        // Wait here until we are actually receiving some data.
-        // A little delay keeps the processor happy
-        // Frames are available on the order of tens of microseconds.
-        *stat = camWaiting;
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        if(camcontrol->exit) {
-            *stat = CameraModel::camDone;
-            LL(4) << "Returning timeout frame due to camcontrol->exit flag.";
-            return timeoutFrame;
-        }
-        // re-evaluate the current frame:
-        writeFrame = doneFrameNumber;
-    }
     // Lap detection:
 
     // The lag level can either:
@@ -680,9 +1780,9 @@ uint16_t* rtpnextgen::getFrameWait(unsigned int lastFrameNumber, camStatusEnum *
             << ", lastFrameDelivered: " << lastFrameDelivered << ", writeFrame: " << writeFrame
             << ", FrameCounter: " << framesDeliveredCounter
             << ". Advancing frameToDeliver from initial=" << frameToDeliver
-            << " to " << (frameToDeliver+4)%networkPacketBufferFrames;
+            << " to " << (frameToDeliver+4)%ringFrames;
         // Skip ahead by 4 frames:
-        frameToDeliver = (frameToDeliver+4)%networkPacketBufferFrames;
+        frameToDeliver = (frameToDeliver+4)%ringFrames;
         aboutToLap = true;
         lagCorectionApplied = true;
         lapEventCounter++;
@@ -703,13 +1803,13 @@ uint16_t* rtpnextgen::getFrameWait(unsigned int lastFrameNumber, camStatusEnum *
             // and thus should not end up inside here.
             waitingForFreshFrame = true;
             *stat = camWaiting;
-            // Idea, wait only if less than 10ns have passed.
 //            if((waitTaps%1000) == 0) {
 //                LOG << "TAP " << waitTaps << ", " << "writeFrame: " << writeFrame << ", lastFrame: " << lastFrameDelivered << ", lag: " << lagLevel << ", priorLag: " << lagLevelPrior << ", frames delivered: " << framesDeliveredCounter;
 //            }
-            std::this_thread::sleep_for(std::chrono::nanoseconds(10));
+            // Spins and/or sleeps until the receive thread publishes a frame:
+            waitForFrame(lastFrameDelivered);
             waitTaps++;
-            writeFrame = doneFrameNumber; // update
+            writeFrame = doneFrameNumber.load(std::memory_order_acquire); // update
             if(camcontrol->exit) {
                 LOG << "Exit within frame waiting loop";
                 return timeoutFrame;
@@ -722,10 +1822,10 @@ uint16_t* rtpnextgen::getFrameWait(unsigned int lastFrameNumber, camStatusEnum *
     waitingForFreshFrame = false;
 
 
-    lagLevel = (((writeFrame-frameToDeliver)%networkPacketBufferFrames)+networkPacketBufferFrames)%networkPacketBufferFrames;
-    percentBufferUsed = 100.0*lagLevel / networkPacketBufferFrames;
+    lagLevel = (((writeFrame-frameToDeliver)%ringFrames)+ringFrames)%ringFrames;
+    percentBufferUsed = 100.0*lagLevel / ringFrames;
 
-    if(lagLevel == networkPacketBufferFrames-1) {
+    if(lagLevel == (uint64_t)ringFrames-1) {
         // With the next delivered frame, we will have been lapped.
         LOG << "WARNING: Ring Buffer nearly full. LAP EVENT is imminent. lastFrameDelivered: " << lastFrameNumber << ", write frame: " << writeFrame << ", frameToDeliver: " << frameToDeliver  << ", frameCounter: " << framesDeliveredCounter;;
         //aboutToLap = true;
@@ -733,20 +1833,20 @@ uint16_t* rtpnextgen::getFrameWait(unsigned int lastFrameNumber, camStatusEnum *
 
     if(percentBufferUsed > 75) {
         LOG << "WARN, buffer LAG,  utilization is " << std::fixed << std::setprecision(1) << percentBufferUsed << "%, " << lagLevel << "/"
-            << networkPacketBufferFrames << ", prior: " << lagLevelPrior << ", wait taps:" << waitTaps << ", frameCounter: " << framesDeliveredCounter
+            << ringFrames << ", prior: " << lagLevelPrior << ", wait taps:" << waitTaps << ", frameCounter: " << framesDeliveredCounter
             << ", frameDeliveredPosition: " << frameToDeliver << ", writeFrame: " << writeFrame << ", Correction applied? " << lagCorectionApplied;
         lagEventCounter++;
     } else if (options.debug) {
         if(lagLevel == 0) {
             if(options.debug) {
                 LOG << "NOTE, buffer SYNC, utilization is " << std::fixed << std::setprecision(1) << percentBufferUsed << "%, " << lagLevel << "/"
-                    << networkPacketBufferFrames << ", prior: " << lagLevelPrior << ", wait taps:" << waitTaps << ", frameCounter: " << framesDeliveredCounter
+                    << ringFrames << ", prior: " << lagLevelPrior << ", wait taps:" << waitTaps << ", frameCounter: " << framesDeliveredCounter
                     << ", frameDeliveredPosition: " << frameToDeliver << ", writeFrame: " << writeFrame << ", Correction applied? " << lagCorectionApplied;
             }
         } else {
             if(options.debug) {
                 LOG << "NOTE, buffer LAG,  utilization is " << std::fixed << std::setprecision(1) << percentBufferUsed << "%, " << lagLevel << "/"
-                    << networkPacketBufferFrames << ", prior: " << lagLevelPrior << ", wait taps:" << waitTaps << ", frameCounter: " << framesDeliveredCounter
+                    << ringFrames << ", prior: " << lagLevelPrior << ", wait taps:" << waitTaps << ", frameCounter: " << framesDeliveredCounter
                     << ", frameDeliveredPosition: " << frameToDeliver << ", writeFrame: " << writeFrame << ", Correction applied? " << lagCorectionApplied;
             }
             lagEventCounter++;
@@ -754,6 +1854,17 @@ uint16_t* rtpnextgen::getFrameWait(unsigned int lastFrameNumber, camStatusEnum *
     }
 
     framesDeliveredCounter++;
+    noteDelivered(this, frameToDeliver);
+    if(directPlacement) {
+        // The payloads were placed into the frame as they arrived.
+        lastFrameDelivered = frameToDeliver;
+        if(lagCorectionApplied) {
+            lagLevelPrior = 0; // anti-double-trip protection
+        } else {
+            lagLevelPrior = lagLevel;
+        }
+        return (uint16_t*)largePacketBuffer[frameToDeliver];
+    }
     constructedFramePosition = (constructedFramePosition+1)%rtpConstructedFrameBufferCount;
     bool successBuilding = buildFrameFromPackets(frameToDeliver);
     lastFrameDelivered = frameToDeliver;
@@ -779,8 +1890,91 @@ camControlType* rtpnextgen::getCamControlPtr()
     return this->camcontrol;
 }
 
+void rtpnextgen::setBatchControl(struct msghdr &mh, unsigned int k) {
+    mh.msg_control = batchControl[k];
+    mh.msg_controllen = RTPNG_CONTROL_BYTES;
+}
+
+uint64_t rtpnextgen::kernelReceiveNs(struct msghdr &mh) {
+    // The SO_TIMESTAMPNS receive time of a packet, 0 if it has none.
+    for(struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+        if((cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_TIMESTAMPNS)) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+            return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+        }
+    }
+    return 0;
+}
+
+void rtpnextgen::noteDelivered(rtpnextgen *source, unsigned int slot) {
+    // Runs on the consumer thread, as the frame in slot of source is handed out.
+    deliveredWireFirstNs = source->slotWireFirstNs[slot];
+    deliveredWireLastNs = source->slotWireLastNs[slot];
+}
+
+bool rtpnextgen::getFrameArrival(uint64_t *firstPacketNs, uint64_t *lastPacketNs)
+{
+    *firstPacketNs = deliveredWireFirstNs;
+    *lastPacketNs = deliveredWireLastNs;
+    return deliveredWireLastNs != 0;
+}
+
+camStreamStatsType rtpnextgen::getStreamStats()
+{
+    camStreamStatsType st;
+    if(!shards.empty()) {
+        for(size_t n=0; n < shards.size(); n++) {
+            camStreamStatsType sh = shards[n]->getStreamStats();
+            st.completeFrames += sh.completeFrames;
+            st.incompleteFrames += sh.incompleteFrames;
+            st.lostPackets += sh.lostPackets;
+            st.latePackets += sh.latePackets;
+            if(sh.lastDamagedFirstRow >= 0) {
+                st.lastDamagedFirstRow = sh.lastDamagedFirstRow;
+                st.lastDamagedLastRow = sh.lastDamagedLastRow;
+            }
+            st.bufferFrames += sh.bufferFrames;
+        }
+        st.lagFrames = lagLevel;
+        st.maxLagFrames = maxLagLevel;
+        {
+            // Frames the merge dropped because the consumer fell behind.
+            std::lock_guard<std::mutex> lock(shardMutex);
+            st.lapEvents = lapEventCounter;
+        }
+        addSenderStats(st);
+        return st;
+    }
+    st.completeFrames = completeFrameCounter.load();
+    st.incompleteFrames = incompleteFrameCounter.load();
+    st.lostPackets = lostPacketCounter.load();
+    st.latePackets = latePacketCounter.load();
+    st.lastDamagedFirstRow = lastDamagedFirstRow.load();
+    st.lastDamagedLastRow = lastDamagedLastRow.load();
+    st.bufferFrames = ringFrames;
+    st.lagFrames = lagLevel;
+    st.maxLagFrames = maxLagLevel;
+    st.lapEvents = lapEventCounter;
+    addSenderStats(st);
+    return st;
+}
+
+void rtpnextgen::addSenderStats(camStreamStatsType &st)
+{
+    senderClockStats sc = senderClock.stats();
+    st.senderFps = sc.fps;
+    st.senderJitterMicros = sc.jitterMicros;
+    st.senderDriftPpm = sc.driftPpm;
+    st.senderSkippedFrames = sc.skippedFrames;
+    st.senderRateChanges = sc.rateChanges;
+}
+
 void rtpnextgen::setCamControlPtr(camControlType* p)
 {
     this->camcontrol = p;
+    for(size_t n=0; n < shards.size(); n++) {
+        shards[n]->setCamControlPtr(p);
+    }
 }
 
@@ -0,0 +1,138 @@
+#include "sender_clock.hpp"
+
+#include <cmath>
+
+// A timestamp step longer than this, either way, is a restart of the sender.
+// A shorter step back is a frame that finished late.
+#define SENDER_CLOCK_MAX_GAP_SECONDS (5)
+// The drift is not reported until the measurement spans this long, since
+// network delay swamps it over short intervals.
+#define SENDER_CLOCK_DRIFT_SETTLE_SECONDS (10)
+// Frames in a row with a different period before the new period is believed.
+#define SENDER_CLOCK_RATE_CHANGE_FRAMES (4)
+
+sender_clock::sender_clock(uint32_t clockRate) : rate(clockRate)
+{
+    reset();
+}
+
+void sender_clock::reset()
+{
+    std::lock_guard<std::mutex> l(lock);
+    started = false;
+    lastTimestamp = 0;
+    lastLocalNs = 0;
+    baseLocalNs = 0;
+    elapsedTicks = 0;
+    periodTicks = 0;
+    periodMisses = 0;
+    candidatePeriod = 0;
+    pendingSkips = 0;
+    jitterNs = 0;
+    st = senderClockStats();
+}
+
+void sender_clock::restart(uint32_t rtpTimestamp, uint64_t localNs)
+{
+    // Keeps the frame period and the counters, drops the drift baseline.
+    started = true;
+    lastTimestamp = rtpTimestamp;
+    lastLocalNs = localNs;
+    baseLocalNs = localNs;
+    elapsedTicks = 0;
+    st.driftPpm = 0;
+}
+
+void sender_clock::frame(uint32_t rtpTimestamp, uint64_t localNs)
+{
+    std::lock_guard<std::mutex> l(lock);
+    st.frames++;
+    if(!started)
+    {
+        restart(rtpTimestamp, localNs);
+        return;
+    }
+
+    // Unsigned difference, so that the 32 bit timestamp may wrap.
+    uint32_t ticks = rtpTimestamp - lastTimestamp;
+    if(ticks == 0)
+        return; // same frame stamp twice, nothing to learn
+    if((uint32_t)(lastTimestamp - rtpTimestamp) <= (uint32_t)SENDER_CLOCK_MAX_GAP_SECONDS * rate)
+    {
+        // Older than the last frame, so it finished late, most likely on another shard.
+        // It was counted as skipped when the frame after it arrived.
+        if(pendingSkips > 0)
+            pendingSkips--;
+        if(st.skippedFrames > 0)
+            st.skippedFrames--;
+        return;
+    }
+    // Frames from different threads may also be fed a little out of arrival order.
+    const int64_t localDeltaNs = (int64_t)(localNs - lastLocalNs);
+    if((ticks > (uint32_t)SENDER_CLOCK_MAX_GAP_SECONDS * rate) ||
+            (localDeltaNs < -(int64_t)SENDER_CLOCK_MAX_GAP_SECONDS * 1000000000LL))
+    {
+        st.discontinuities++;
+        restart(rtpTimestamp, localNs);
+        return;
+    }
+
+    // How many frame periods this step covers. Anything past one was never
+    // seen, unless the steps keep coming at the same new length, in which
+    // case the sensor rate has changed.
+    if(periodTicks == 0)
+        periodTicks = ticks;
+    unsigned int steps = (unsigned int)std::lround(ticks / periodTicks);
+    double fit = steps ? std::fabs((double)ticks / steps - periodTicks) : periodTicks;
+    if((steps == 1) && (fit <= 0.1 * periodTicks))
+    {
+        periodMisses = 0;
+        pendingSkips = 0;
+        periodTicks += (ticks - periodTicks) / 16.0;
+    } else {
+        if((periodMisses > 0) && (std::fabs(ticks - candidatePeriod) <= 0.1 * candidatePeriod))
+        {
+            periodMisses++;
+        } else {
+            periodMisses = 1;
+            pendingSkips = 0;
+            candidatePeriod = ticks;
+        }
+        if(periodMisses >= SENDER_CLOCK_RATE_CHANGE_FRAMES)
+        {
+            // Take back the frames counted as skipped during the run.
+            st.skippedFrames -= pendingSkips;
+            periodTicks = candidatePeriod;
+            periodMisses = 0;
+            pendingSkips = 0;
+            st.rateChanges++;
+        } else if((steps > 1) && (fit <= 0.1 * periodTicks)) {
+            st.skippedFrames += steps - 1;
+            pendingSkips += steps - 1;
+        }
+    }
+
+    // RFC 3550 section 6.4.1: the difference in transit time between this
+    // frame and the last, smoothed with a gain of 1/16.
+    double senderNs = (double)ticks * 1e9 / rate;
+    jitterNs += (std::fabs((double)localDeltaNs - senderNs) - jitterNs) / 16.0;
+
+    elapsedTicks += ticks;
+    double localElapsedNs = (double)(localNs - baseLocalNs);
+    if(localElapsedNs > SENDER_CLOCK_DRIFT_SETTLE_SECONDS * 1e9)
+    {
+        double senderElapsedNs = (double)elapsedTicks * 1e9 / rate;
+        st.driftPpm = (senderElapsedNs - localElapsedNs) / localElapsedNs * 1e6;
+    }
+
+    lastTimestamp = rtpTimestamp;
+    lastLocalNs = localNs;
+    st.fps = rate / periodTicks;
+    st.jitterMicros = jitterNs / 1000.0;
+}
+
+senderClockStats sender_clock::stats()
+{
+    std::lock_guard<std::mutex> l(lock);
+    return st;
+}
@@ -33,7 +33,7 @@ void take_object::initialSetup(int channel_num, int number_of_buffers,
     this->numbufs = number_of_buffers;
     this->filter_refresh_rate = filter_refresh_rate;
 
-    frame_ring_buffer = new frame_c[CPU_FRAME_BUFFER_SIZE];
+    frame_ring_buffer = NULL;
 
     //For the filters
     dsfMaskCollected = false;
@@ -57,7 +57,8 @@ void take_object::initialSetup(int channel_num, int number_of_buffers,
     save_framenum = 0;
     save_count=0;
     save_num_avgs=1;
-    saving_list.clear();
+    save_dropped = 0;
+    save_stalls = 0;
 
     camStatus = CameraModel::camUnknown;
 }
@@ -100,6 +101,10 @@ take_object::~take_object()
 
     delete[] frame_ring_buffer;
 
+    delete saving_queue;
+    delete saving_free;
+    free(saving_pool);
+
 #ifdef RESET_GPUS
     printf("reseting GPUs!\n");
     int count;
@@ -222,6 +227,20 @@ void take_object::shmSetup()
             shm->frameBuffer[f][p] = 0;
         }
     }
+    shm->latencyStageCount = 0;
+    memset(shm->stageLatency, 0, sizeof(shm->stageLatency));
+    shm->streamCompleteFrames = 0;
+    shm->streamIncompleteFrames = 0;
+    shm->streamLostPackets = 0;
+    shm->streamLatePackets = 0;
+    shm->streamDamagedFirstRow = -1;
+    shm->streamDamagedLastRow = -1;
+    shm->streamSenderFps = 0;
+    shm->streamSenderJitterMicros = 0;
+    shm->streamSenderDriftPpm = 0;
+    shm->streamSenderSkippedFrames = 0;
+    shm->saveDroppedFrames = 0;
+
     shm->statusByte = SHM_STATUS_WAITING;
     shmValid = true;
     goto cleanup;
@@ -316,10 +335,67 @@ void take_object::start()
     std::cout << "About to start threads..." << std::endl;
 #endif
 
+    // Allocate the frame ring buffer now that the geometry is known:
+    ringDepth = options.ringBufferFrames;
+    if(ringDepth == 0)
+    {
+        ringDepth = CPU_FRAME_BUFFER_SIZE;
+    } else if(ringDepth < MIN_CPU_FRAME_BUFFER_SIZE) {
+        warningMessage(std::string("Requested ring buffer is too small, using ") + std::to_string(MIN_CPU_FRAME_BUFFER_SIZE) + " frames.");
+        ringDepth = MIN_CPU_FRAME_BUFFER_SIZE;
+    }
+    if(options.zeroCopySave && (ringDepth < ZERO_COPY_MIN_FRAME_BUFFER_SIZE))
+    {
+        // With zeroCopySave every queued frame pins a ring slot. The ring must hold a full
+        // saving queue and still have room for acquisition, or it would wait on the writer.
+        warningMessage(std::string("Ring buffer is too small for zero-copy saving, using ") + std::to_string(ZERO_COPY_MIN_FRAME_BUFFER_SIZE) + " frames.");
+        ringDepth = ZERO_COPY_MIN_FRAME_BUFFER_SIZE;
+    }
+    frame_ring_buffer = new frame_c[ringDepth];
+    // With numaLocal, the ring is allocated and faulted in on the CPUs of the thread
+    // that will fill it, so that its pages come from that thread's memory node.
+    const char *fillCpus = (options.rtpCam || options.rtpNextGen || options.xioCam) ? options.cpuConsume : options.cpuAcquire;
+    cpu_set_t takeCpus;
+    bool ringPlaced = false;
+    if(options.numaLocal && (fillCpus != NULL) &&
+            (pthread_getaffinity_np(pthread_self(), sizeof(takeCpus), &takeCpus) == 0))
+    {
+        std::string error;
+        ringPlaced = os::tuneThread(fillCpus, 0, error);
+        if(!ringPlaced)
+            warningMessage("Could not place frame ring buffer, " + error + ".");
+    }
+    ring_arena.allocate(frame_ring_buffer, ringDepth, frWidth, dataHeight);
+    if(ringPlaced)
+    {
+        clearAllRingBuffer();
+        pthread_setaffinity_np(pthread_self(), sizeof(takeCpus), &takeCpus);
+        statusMessage(std::string("Frame ring buffer placed from CPUs ") + fillCpus + ".");
+    }
+    statusMessage(std::string("Frame ring buffer: ") + std::to_string(ringDepth) + " frames of " +
+                  std::to_string(frWidth) + "x" + std::to_string(dataHeight) + ".");
+
     // Initialize the filters
+    setupPipeline();
     dsf = new dark_subtraction_filter(frWidth,frHeight);
     sdvf = new std_dev_filter(frWidth,frHeight);
 
+    // Frames waiting to be saved live in a fixed pool that is handed back and forth
+    // between the acquisition loop and the saving thread. calloc keeps the pages
+    // untouched until a recording actually uses them.
+    saving_pool = (uint16_t *)calloc((size_t)SAVE_QUEUE_DEPTH * frWidth * dataHeight, sizeof(uint16_t));
+    if(saving_pool == NULL)
+    {
+        errorMessage("Could not allocate frame saving buffer.");
+        abort();
+    }
+    saving_queue = new spsc_queue<saveQueueItem>(SAVE_QUEUE_DEPTH);
+    saving_free = new spsc_queue<uint16_t *>(SAVE_QUEUE_DEPTH);
+    for(size_t f=0; f < SAVE_QUEUE_DEPTH; f++)
+    {
+        saving_free->push(saving_pool + f * frWidth * dataHeight);
+    }
+
     // Initial dimensions for calculating the mean that can be updated later
     meanStartRow = 0;
     meanStartCol = 0;
@@ -682,14 +758,16 @@ void take_object::startSavingRaws(std::string raw_file_name, unsigned int frames
 #ifdef VERBOSE
     printf("ssr called\n");
 #endif
-    while(!saving_list.empty())
+    while(!saving_queue->empty())
     {
 #ifdef VERBOSE
-        printf("Waiting for empty saving list...\n");
+        printf("Waiting for empty saving queue...\n");
 #endif
+        usleep(250);
     }
     save_framenum.store(frames_to_save,std::memory_order_seq_cst);
     save_count.store(0, std::memory_order_seq_cst);
+    save_dropped.store(0, std::memory_order_seq_cst);
     save_num_avgs=num_avgs_save;
 #ifdef VERBOSE
     printf("Begin frame save! @ %s\n", raw_file_name.c_str());
@@ -726,6 +804,10 @@ unsigned int take_object::getFrameWidth()
 {
     return frWidth;
 }
+unsigned int take_object::getRingDepth()
+{
+    return ringDepth;
+}
 bool take_object::std_dev_ready()
 {
     return sdvf->outputReady();
@@ -811,7 +893,10 @@ void take_object::prepareRTPNGCamera() {
 void take_object::fileImageReadingLoop()
 {
     // This thread makes the camera keep reading files
-    // readLoop() runs readFile() inside.
+    // readLoop() queues frames until the directory runs out of files, waiting
+    // for getFrame() whenever it is far enough ahead. The pause between passes
+    // is only to pick up files added to the directory later.
+    tuneThread(options.cpuAcquire, "READING");
 
     if(Camera)
     {
@@ -930,7 +1015,7 @@ void take_object::clearAllRingBuffer()
         abort();
     }
 
-    for(size_t f=0; f < CPU_FRAME_BUFFER_SIZE; f++)
+    for(size_t f=0; f < ringDepth; f++)
     {
         curFrame = &frame_ring_buffer[f];
         curFrame->reset();
@@ -939,11 +1024,30 @@ void take_object::clearAllRingBuffer()
     statusMessage("Done zero-setting memory in frame_ring_buffer");
 }
 
+void take_object::tuneThread(const char *cpuList, const char *threadName)
+{
+    // Each acquisition thread calls this as it starts, so that whatever it allocates
+    // or faults in from then on comes from the memory closest to its CPUs.
+    if((cpuList == NULL) && (options.rtPriority == 0))
+        return;
+    std::string error;
+    if(os::tuneThread(cpuList, options.rtPriority, error))
+    {
+        std::string info = std::string(threadName) + " thread on CPUs " + (cpuList ? cpuList : "(any)");
+        if(options.rtPriority > 0)
+            info += ", SCHED_FIFO priority " + std::to_string(options.rtPriority);
+        statusMessage(info);
+    } else {
+        warningMessage(std::string("Could not tune the ") + threadName + " thread, " + error + ".");
+    }
+}
+
 void take_object::fileImageCopyLoop()
 {
     // This thread copies data from the XIO Camera's buffer
     // and into curFrane of take_object. It is the "consumer"
     // thread in a way.
+    tuneThread(options.cpuConsume, "XIOCAM");
 
     bool good = false;
     uint16_t *zeroFrame = NULL;
@@ -976,11 +1080,11 @@ void take_object::fileImageCopyLoop()
         uint16_t last_framecount = 0;
         (void)last_framecount; // use count
 
-        mean_filter * mf = new mean_filter(curFrame,count,meanStartCol,meanWidth,\
-                                           meanStartRow,meanHeight,frWidth,useDSF,\
-                                           whichFFT, lh_start, lh_end,\
-                                           cent_start, cent_end,\
-                                           rh_start, rh_end);
+        mf = new mean_filter(curFrame,count,meanStartCol,meanWidth,\
+                             meanStartRow,meanHeight,frWidth,useDSF,\
+                             whichFFT, lh_start, lh_end,\
+                             cent_start, cent_end,\
+                             rh_start, rh_end);
         setup_filter(frHeight, frWidth);
 
         if(options.targetFPS == 0.0)
@@ -992,7 +1096,10 @@ void take_object::fileImageCopyLoop()
 
         std::chrono::steady_clock::time_point begintp;
         std::chrono::steady_clock::time_point endtp;
-        std::chrono::steady_clock::time_point finaltp;
+    
+        if(shmValid) {
+            shm->statusByte = SHM_STATUS_READY;
+        }
 
         xioCount = 0;
         int ngFrameCount = 0;
@@ -1005,7 +1112,8 @@ void take_object::fileImageCopyLoop()
             begintp = std::chrono::steady_clock::now();
 
             grabbing = true;
-            curFrame = &frame_ring_buffer[count % CPU_FRAME_BUFFER_SIZE];
+            curFrame = &frame_ring_buffer[count % ringDepth];
+            waitForSaveRelease(curFrame);
             curFrame->reset();
 
             if(closing)
@@ -1059,54 +1167,11 @@ void take_object::fileImageCopyLoop()
 
             if(temp_frame)
             {
-                memcpy(curFrame->raw_data_ptr,temp_frame,frWidth*dataHeight*2);
+                processFrame(curFrame, temp_frame, begintp);
             } else {
                 hasBeenNull = true;
                 errorMessage("Frame was NULL!");
-                memcpy(curFrame->raw_data_ptr,zeroFrame,frWidth*dataHeight*2);
-            }
-
-            // From here on out, the code should be
-            // very similar to the EDT frame grabber code.
-
-
-            if(pixRemap)
-            {
-                apply_chroma_translate_filter(curFrame->raw_data_ptr);
-                curFrame->image_data_ptr = curFrame->raw_data_ptr;
-            }
-
-//            if(cam_type == CL_6604A)
-//                curFrame->image_data_ptr = curFrame->raw_data_ptr + frWidth;
-//            else
-            curFrame->image_data_ptr = curFrame->raw_data_ptr;
-            if(inverted)
-            { // record the data from high to low. Store the pixel buffer in INVERTED order from the camera link
-                for(uint i = 0; i < frHeight*frWidth; i++ )
-                    curFrame->image_data_ptr[i] = invFactor - curFrame->image_data_ptr[i];
-            }
-
-
-            // Calculating the filters for this frame
-            if(runStdDev)
-            {
-                sdvf->update_GPU_buffer(curFrame,std_dev_filter_N);
-            }
-            dsf->update(curFrame->raw_data_ptr,curFrame->dark_subtracted_data);
-            mf->update(curFrame,count,meanStartCol,meanWidth,\
-                       meanStartRow,meanHeight,frWidth,useDSF,\
-                       whichFFT, lh_start, lh_end,\
-                                               cent_start, cent_end,\
-                                               rh_start, rh_end);
-
-            mf->start_mean();
-
-            if((save_framenum > 0) || continuousRecording)
-            {
-                uint16_t * raw_copy = new uint16_t[frWidth*dataHeight];
-                memcpy(raw_copy,curFrame->raw_data_ptr,frWidth*dataHeight*sizeof(uint16_t));
-                saving_list.push_front(raw_copy);
-                save_framenum--;
+                processFrame(curFrame, zeroFrame, begintp);
             }
 
             framecount = *(curFrame->raw_data_ptr + 160); // The framecount is stored 160 bytes offset from the beginning of the data
@@ -1142,9 +1207,7 @@ void take_object::fileImageCopyLoop()
                 //warningMessage("Cannot guarentee requested frame rate. Frame rate is too fast or computation is too slow.");
                 //warningMessage(std::string("Requested deltaT: ") + std::to_string(deltaT_micros) + std::string(", measured delta microseconds: ") + std::to_string(measuredDelta_micros));
             }
-            finaltp = std::chrono::steady_clock::now();
-            measuredDelta_micros_final = std::chrono::duration_cast<std::chrono::microseconds>(finaltp-begintp).count();
-            meanDeltaArray[(++meanDeltaArrayPos)%meanDeltaSize] = measuredDelta_micros_final;
+            finishFrame(begintp);
         }
         statusMessage("Done providing frames");
     } else {
@@ -1200,11 +1263,14 @@ camControlType* take_object::getCamControl()
 
 void take_object::rtpStreamLoop()
 {
+    tuneThread(options.cpuAcquire, "RTP Stream");
     LOG << "Entering streamLoop";
     Camera->streamLoop();
 }
 
 void take_object::rtpNGStreamLoop() {
+    // Receive shards are started from here and inherit this thread's CPUs.
+    tuneThread(options.cpuAcquire, "RTPNG Stream");
     LOG << "Entering streamLoop";
     Camera->streamLoop();
 }
@@ -1215,19 +1281,19 @@ void take_object::rtpConsumeFrames()
     // guarenteed buffer into the take object.
     // The frames are copied using Camera->getFrameWait
     // which waits for new frames.
+    tuneThread(options.cpuConsume, options.rtpNextGen ? "RTPNG Consume" : "RTP Consume");
 
     // Initializers just in case:
     save_framenum = 0;
     continuousRecording = false;
 
-    mean_filter * mf = new mean_filter(curFrame,count,meanStartCol,meanWidth,\
-                                       meanStartRow,meanHeight,frWidth,useDSF,\
-                                       whichFFT, lh_start, lh_end,\
-                                       cent_start, cent_end,\
-                                       rh_start, rh_end);
+    mf = new mean_filter(curFrame,count,meanStartCol,meanWidth,\
+                         meanStartRow,meanHeight,frWidth,useDSF,\
+                         whichFFT, lh_start, lh_end,\
+                         cent_start, cent_end,\
+                         rh_start, rh_end);
 
     std::chrono::steady_clock::time_point begintp;
-    std::chrono::steady_clock::time_point finaltp;
 
     int framecount = 0;
     int last_framecount __attribute__((unused)) = 0;
@@ -1245,60 +1311,11 @@ void take_object::rtpConsumeFrames()
     {
         begintp = std::chrono::steady_clock::now();
         grabbing = true;
-        curFrame = &frame_ring_buffer[count % CPU_FRAME_BUFFER_SIZE];
+        curFrame = &frame_ring_buffer[count % ringDepth];
+        waitForSaveRelease(curFrame);
         curFrame->reset();
         temp_frame = Camera->getFrameWait(lastFrameNumber, &this->camStatus);
-        memcpy(curFrame->raw_data_ptr,temp_frame,frWidth*dataHeight*2);
-
-
-        if(pixRemap)
-        {
-            apply_chroma_translate_filter(curFrame->raw_data_ptr);
-            //curFrame->image_data_ptr = curFrame->raw_data_ptr;
-        }
-
-
-        curFrame->image_data_ptr = curFrame->raw_data_ptr;
-        if(inverted)
-        { // record the data from high to low. Store the pixel buffer in INVERTED order from the camera link
-            for(uint i = 0; i < frHeight*frWidth; i++ )
-                curFrame->image_data_ptr[i] = invFactor - curFrame->image_data_ptr[i];
-        }
-
-        if(setDarkStatusInFrame) {
-            curFrame->image_data_ptr[obcStatusPixel] = darkStatusPixelVal;
-        }
-
-        shmBufferPosition = (shmBufferPositionPrior + 1)%shmFrameBufferSize;
-        if(shmValid) {
-            shm->writingFrameNum = shmBufferPosition;
-            memcpy(shm->frameBuffer[shmBufferPosition],curFrame->raw_data_ptr, frHeight*frWidth*2);
-        }
-
-
-        // Calculating the filters for this frame
-        if(!options.noGPU) {
-            if(runStdDev)
-            {
-                sdvf->update_GPU_buffer(curFrame,std_dev_filter_N);
-            }
-            dsf->update(curFrame->raw_data_ptr,curFrame->dark_subtracted_data);
-            mf->update(curFrame,count,meanStartCol,meanWidth,\
-                       meanStartRow,meanHeight,frWidth,useDSF,\
-                       whichFFT, lh_start, lh_end,\
-                       cent_start, cent_end,\
-                       rh_start, rh_end);
-
-            mf->start_mean();
-        }
-
-        if((save_framenum > 0) || continuousRecording)
-        {
-            uint16_t * raw_copy = new uint16_t[frWidth*dataHeight];
-            memcpy(raw_copy,curFrame->raw_data_ptr,frWidth*dataHeight*sizeof(uint16_t));
-            saving_list.push_front(raw_copy);
-            save_framenum--;
-        }
+        processFrame(curFrame, temp_frame, begintp);
 
         framecount = *(curFrame->raw_data_ptr + 160); // The framecount is stored 160 bytes offset from the beginning of the data
         /*
@@ -1311,18 +1328,7 @@ void take_object::rtpConsumeFrames()
         }
         */
 
-        finaltp = std::chrono::steady_clock::now();
-        measuredDelta_micros_final = std::chrono::duration_cast<std::chrono::microseconds>(finaltp-begintp).count();
-        meanDeltaArray[(++meanDeltaArrayPos)%meanDeltaSize] = measuredDelta_micros_final;
-
-        if(shmValid) {
-            if(measuredDelta_micros_final != 0)
-                shm->fps = 1E6/measuredDelta_micros_final;
-            shm->frameTime[shmBufferPosition] = finaltp.time_since_epoch() / std::chrono::milliseconds(1);
-            shm->counter = count;
-        }
-        shmBufferPositionPrior = shmBufferPosition;
-
+        finishFrame(begintp);
 
         last_framecount = framecount;
         count++;
@@ -1333,6 +1339,7 @@ void take_object::rtpConsumeFrames()
 
 void take_object::pdv_loop() //Producer Thread (pdv_thread)
 {
+    tuneThread(options.cpuAcquire, "PDVCAM");
 	count = 0;
 
     uint16_t framecount = 1;
@@ -1340,13 +1347,12 @@ void take_object::pdv_loop() //Producer Thread (pdv_thread)
     unsigned char* wait_ptr = NULL;
 
 
-    mean_filter * mf = new mean_filter(curFrame,count,meanStartCol,meanWidth,\
-                                       meanStartRow,meanHeight,frWidth,useDSF,\
-                                       whichFFT, lh_start, lh_end,\
-                                       cent_start, cent_end,\
-                                       rh_start, rh_end);
+    mf = new mean_filter(curFrame,count,meanStartCol,meanWidth,\
+                         meanStartRow,meanHeight,frWidth,useDSF,\
+                         whichFFT, lh_start, lh_end,\
+                         cent_start, cent_end,\
+                         rh_start, rh_end);
 
-    std::chrono::steady_clock::time_point finaltp;
     std::chrono::steady_clock::time_point begintp;
 
     if(shmValid) {
@@ -1356,7 +1362,8 @@ void take_object::pdv_loop() //Producer Thread (pdv_thread)
     {	
         grabbing = true;
         begintp = std::chrono::steady_clock::now();
-        curFrame = &frame_ring_buffer[count % CPU_FRAME_BUFFER_SIZE];
+        curFrame = &frame_ring_buffer[count % ringDepth];
+        waitForSaveRelease(curFrame);
         curFrame->reset();
         if(closing)
         {
@@ -1382,84 +1389,305 @@ void take_object::pdv_loop() //Producer Thread (pdv_thread)
          * Third, we may need to invert the data range if a cable is inverting the magnitudes
          * that arrive from the ADC. This feature is also modified from the preference window.
          */
-        memcpy(curFrame->raw_data_ptr,wait_ptr,frWidth*dataHeight*sizeof(uint16_t));
-        if(pixRemap)
-            apply_chroma_translate_filter(curFrame->raw_data_ptr);
-
-        curFrame->image_data_ptr = curFrame->raw_data_ptr;
-        if(inverted)
-        { // record the data from high to low. Store the pixel buffer in INVERTED order from the camera link
-            for(uint i = 0; i < frHeight*frWidth; i++ )
-                curFrame->image_data_ptr[i] = invFactor - curFrame->image_data_ptr[i];
-        }
+        processFrame(curFrame, (uint16_t *)wait_ptr, begintp);
 
-        if(setDarkStatusInFrame) {
-            curFrame->image_data_ptr[obcStatusPixel] = darkStatusPixelVal;
+        framecount = *(curFrame->raw_data_ptr + 160); // The framecount is stored 160 bytes offset from the beginning of the data
+        if(CHECK_FOR_MISSED_FRAMES_6604A && cam_type == CL_6604A)
+        {
+            if( (framecount - 1 != last_framecount) && (last_framecount != UINT16_MAX) )
+            {
+                std::cerr << "WARNING: MISSED FRAME " << framecount << std::endl;
+            }
         }
+        last_framecount = framecount;
+        count++;
 
+        finishFrame(begintp);
+
+        grabbing = false;
+        if(closing)
+        {
+            pdv_thread_run = 0;
+            break;
+        }
+    }
+}
+void take_object::setupPipeline()
+{
+    // The per-frame work shared by every camera source, in order.
+    // The acquisition loops only hand the camera's buffer to processFrame().
+    // The acquire and frame timers are filled in by processFrame() and finishFrame().
+    acquireTimer = pipeline.addTimer("acquire");
+    pipeline.addStage("correct", [this](frame_c * frame) {
+        // Copy out of the camera buffer, 2s compliment flip, inversion, and
+        // the status pixel, all in one pass.
+        apply_raw_correction(frame->raw_data_ptr, ingestSource, (size_t)frWidth*dataHeight,
+                             pixRemap, inverted, invFactor,
+                             setDarkStatusInFrame ? obcStatusPixel : -1, darkStatusPixelVal);
+        recordWireLatency(wireFrameTimer, frame);
+    }, [this](frame_c * frame) {
+        // Switched off, the frame is used exactly as the camera sent it.
+        memcpy(frame->raw_data_ptr, ingestSource, frWidth*dataHeight*sizeof(uint16_t));
+        recordWireLatency(wireFrameTimer, frame);
+    });
+    pipeline.addStage("shm", [this](frame_c * frame) {
         shmBufferPosition = (shmBufferPositionPrior + 1)%shmFrameBufferSize;
         if(shmValid) {
             shm->writingFrameNum = shmBufferPosition;
-            memcpy(shm->frameBuffer[shmBufferPosition],curFrame->raw_data_ptr, frHeight*frWidth*2);
+            memcpy(shm->frameBuffer[shmBufferPosition],frame->raw_data_ptr, frHeight*frWidth*2);
+            recordWireLatency(wireShmTimer, frame);
         }
-
-        // Calculating the filters for this frame
-        if(!options.noGPU) {
-
-            if(runStdDev)
-            {
-                sdvf->update_GPU_buffer(curFrame,std_dev_filter_N);
-            }
-            dsf->update(curFrame->raw_data_ptr,curFrame->dark_subtracted_data);
-            mf->update(curFrame,count,meanStartCol,meanWidth,\
+    });
+    pipeline.addStage("stddev", [this](frame_c * frame) {
+        if(!options.noGPU && runStdDev)
+        {
+            sdvf->update_GPU_buffer(frame,std_dev_filter_N);
+        }
+    });
+    pipeline.addStage("darksub", [this](frame_c * frame) {
+        if(!options.noGPU)
+        {
+            dsf->update(frame->raw_data_ptr,frame->dark_subtracted_data);
+        }
+    });
+    pipeline.addStage("mean", [this](frame_c * frame) {
+        if(!options.noGPU)
+        {
+            mf->update(frame,count,meanStartCol,meanWidth,\
                        meanStartRow,meanHeight,frWidth,useDSF,\
                        whichFFT, lh_start, lh_end,\
                        cent_start, cent_end,\
                        rh_start, rh_end);
-
             mf->start_mean();
         }
-
+    });
+    pipeline.addStage("save", [this](frame_c * frame) {
         if((save_framenum > 0) || continuousRecording)
         {
-            uint16_t * raw_copy = new uint16_t[frWidth*dataHeight];
-            memcpy(raw_copy,curFrame->raw_data_ptr,frWidth*dataHeight*sizeof(uint16_t));
-            saving_list.push_front(raw_copy);
-            save_framenum--;
+            // A dropped frame does not count towards the requested number,
+            // so the recording still ends up with save_framenum frames.
+            if(queueFrameForSaving(frame))
+                save_framenum--;
         }
+    });
+    frameTimer = pipeline.addTimer("frame");
+    wireSpreadTimer = pipeline.addTimer("wire spread");
+    wireFrameTimer = pipeline.addTimer("wire>frame");
+    wireShmTimer = pipeline.addTimer("wire>shm");
+    wireSaveTimer = pipeline.addTimer("wire>save");
+    lastLatencyPublish = std::chrono::steady_clock::now();
+    lastLatencyDump = lastLatencyPublish;
+}
 
-        framecount = *(curFrame->raw_data_ptr + 160); // The framecount is stored 160 bytes offset from the beginning of the data
-        if(CHECK_FOR_MISSED_FRAMES_6604A && cam_type == CL_6604A)
+void take_object::processFrame(frame_c * frame, const uint16_t * source,
+                               std::chrono::steady_clock::time_point begintp)
+{
+    // begintp is when the loop started waiting for this frame.
+    if(pipeline.timingEnabled())
+    {
+        pipeline.record(acquireTimer, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now()-begintp).count());
+    }
+
+    frame->wire_first_ns = 0;
+    frame->wire_last_ns = 0;
+    if(pipeline.timingEnabled() && (Camera != NULL)
+            && Camera->getFrameArrival(&frame->wire_first_ns, &frame->wire_last_ns)
+            && (frame->wire_first_ns != 0) && (frame->wire_last_ns >= frame->wire_first_ns))
+    {
+        pipeline.record(wireSpreadTimer, frame->wire_last_ns - frame->wire_first_ns);
+    }
+
+    // The correct stage copies the frame out of source.
+    ingestSource = source;
+    frame->image_data_ptr = frame->raw_data_ptr;
+    pipeline.run(frame);
+}
+
+void take_object::finishFrame(std::chrono::steady_clock::time_point begintp)
+{
+    std::chrono::steady_clock::time_point finaltp = std::chrono::steady_clock::now();
+    measuredDelta_micros_final = std::chrono::duration_cast<std::chrono::microseconds>(finaltp-begintp).count();
+    meanDeltaArray[(++meanDeltaArrayPos)%meanDeltaSize] = measuredDelta_micros_final;
+    if(pipeline.timingEnabled())
+    {
+        pipeline.record(frameTimer, std::chrono::duration_cast<std::chrono::nanoseconds>(finaltp-begintp).count());
+        publishLatency(finaltp);
+    }
+
+    if(shmValid) {
+        if(measuredDelta_micros_final != 0)
+            shm->fps = 1E6/measuredDelta_micros_final;
+        shm->frameTime[shmBufferPosition] = finaltp.time_since_epoch() / std::chrono::milliseconds(1);
+        shm->counter = count;
+        shm->saveDroppedFrames = save_dropped.load(std::memory_order_relaxed);
+    }
+    shmBufferPositionPrior = shmBufferPosition;
+}
+
+void take_object::publishLatency(std::chrono::steady_clock::time_point now)
+{
+    // Called once per frame, but only does work about once a second.
+    if(shmValid && (now - lastLatencyPublish > std::chrono::seconds(1)))
+    {
+        lastLatencyPublish = now;
+        unsigned int n = pipeline.stageCount();
+        if(n > shmLatencyStageCount)
+            n = shmLatencyStageCount;
+        for(unsigned int st=0; st < n; st++)
         {
-            if( (framecount - 1 != last_framecount) && (last_framecount != UINT16_MAX) )
-            {
-                std::cerr << "WARNING: MISSED FRAME " << framecount << std::endl;
-            }
+            latency_histogram * h = pipeline.getStageHistogram(st);
+            shmStageLatency &out = shm->stageLatency[st];
+            strncpy(out.name, pipeline.stageName(st).c_str(), shmLatencyNameLength-1);
+            out.name[shmLatencyNameLength-1] = '\0';
+            out.frames = h->count();
+            out.meanMicros = out.frames ? h->sum() / 1000.0 / out.frames : 0.0;
+            out.p50Micros = h->percentile(0.50) / 1000.0;
+            out.p90Micros = h->percentile(0.90) / 1000.0;
+            out.p99Micros = h->percentile(0.99) / 1000.0;
+            out.maxMicros = h->max() / 1000.0;
         }
-        last_framecount = framecount;
-        count++;
+        shm->latencyStageCount = n;
 
-        finaltp = std::chrono::steady_clock::now();
-        measuredDelta_micros_final = std::chrono::duration_cast<std::chrono::microseconds>(finaltp-begintp).count();
-        meanDeltaArray[(++meanDeltaArrayPos)%meanDeltaSize] = measuredDelta_micros_final;
+        if(Camera != NULL)
+        {
+            camStreamStatsType st = Camera->getStreamStats();
+            shm->streamCompleteFrames = st.completeFrames;
+            shm->streamIncompleteFrames = st.incompleteFrames;
+            shm->streamLostPackets = st.lostPackets;
+            shm->streamLatePackets = st.latePackets;
+            shm->streamDamagedFirstRow = st.lastDamagedFirstRow;
+            shm->streamDamagedLastRow = st.lastDamagedLastRow;
+            shm->streamSenderFps = st.senderFps;
+            shm->streamSenderJitterMicros = st.senderJitterMicros;
+            shm->streamSenderDriftPpm = st.senderDriftPpm;
+            shm->streamSenderSkippedFrames = st.senderSkippedFrames;
+        }
+    }
 
-        if(shmValid) {
-            if(measuredDelta_micros_final != 0)
-                shm->fps = 1E6/measuredDelta_micros_final;
-            shm->frameTime[shmBufferPosition] = finaltp.time_since_epoch() / std::chrono::milliseconds(1);
-            shm->counter = count;
+    if((options.latencyDumpSeconds != 0) &&
+            (now - lastLatencyDump > std::chrono::seconds(options.latencyDumpSeconds)))
+    {
+        lastLatencyDump = now;
+        std::string report = std::string("Pipeline latency:\n") + pipeline.latencyReport();
+        camStreamStatsType st = getStreamStats();
+        if(st.senderFps != 0)
+        {
+            // The sensor's own rate next to ours, to tell a slow sensor from a slow pipeline.
+            std::ostringstream s;
+            s << std::fixed << std::setprecision(2) << "Sender: " << st.senderFps << " fps, jitter " << st.senderJitterMicros
+              << " us, drift " << st.senderDriftPpm << " ppm, " << st.senderSkippedFrames << " frames not received. Loop: "
+              << (measuredDelta_micros_final ? 1E6/measuredDelta_micros_final : 0.0) << " fps\n";
+            report += s.str();
         }
-        shmBufferPositionPrior = shmBufferPosition;
+        statusMessage(report);
+    }
+}
 
+std::string take_object::getLatencyReport()
+{
+    return pipeline.latencyReport();
+}
 
-        grabbing = false;
-        if(closing)
+camStreamStatsType take_object::getStreamStats()
+{
+    if(Camera == NULL)
+        return camStreamStatsType();
+    return Camera->getStreamStats();
+}
+
+frame_pipeline * take_object::getPipeline()
+{
+    return &pipeline;
+}
+
+bool take_object::setPipelineStageEnabled(std::string name, bool enabled)
+{
+    if(!pipeline.setStageEnabled(name, enabled))
+    {
+        warningMessage(std::string("No pipeline stage named ") + name);
+        return false;
+    }
+    return true;
+}
+
+bool take_object::queueFrameForSaving(frame_c * frame)
+{
+    // Called from the acquisition thread. Never blocks: if the saving thread has
+    // fallen a full queue behind, the frame is dropped and counted instead.
+    saveQueueItem item;
+    if(options.zeroCopySave)
+    {
+        // The saving thread reads straight out of the ring buffer. The slot is
+        // pinned until it has been written, see waitForSaveRelease().
+        item.data = frame->raw_data_ptr;
+        item.pinnedFrame = frame;
+        frame->save_pinned.store(1, std::memory_order_release);
+        if(saving_queue->push(item))
         {
-            pdv_thread_run = 0;
-            break;
+            recordWireLatency(wireSaveTimer, frame);
+            return true;
+        }
+        frame->save_pinned.store(0, std::memory_order_release);
+    } else {
+        item.pinnedFrame = NULL;
+        if(saving_free->try_pop(item.data))
+        {
+            memcpy(item.data,frame->raw_data_ptr,frWidth*dataHeight*sizeof(uint16_t));
+            saving_queue->push(item);
+            recordWireLatency(wireSaveTimer, frame);
+            return true;
         }
     }
+
+    if(save_dropped++ == 0)
+    {
+        warningMessage("Frame saving queue is full, dropping frames.");
+    }
+    return false;
+}
+
+void take_object::recordWireLatency(unsigned int timer, frame_c * frame)
+{
+    // Time since the kernel received the frame's last packet. The wire
+    // timestamps are on the realtime clock, so this one is too.
+    if((frame->wire_last_ns == 0) || !pipeline.timingEnabled())
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+    if(now > frame->wire_last_ns)
+        pipeline.record(timer, now - frame->wire_last_ns);
+}
+
+void take_object::releaseSavedFrame(const saveQueueItem &item)
+{
+    // Called from the saving thread once item.data has been written.
+    if(item.pinnedFrame != NULL)
+    {
+        item.pinnedFrame->save_pinned.store(0, std::memory_order_release);
+    } else {
+        saving_free->push(item.data);
+    }
+}
+
+void take_object::waitForSaveRelease(frame_c * frame)
+{
+    // At most SAVE_QUEUE_DEPTH slots can be pinned, so as long as the ring is
+    // deeper than that, this only waits if the writer has stalled outright.
+    if(frame->save_pinned.load(std::memory_order_acquire) == 0)
+        return;
+
+    if(save_stalls++ == 0)
+    {
+        warningMessage("Acquisition is waiting for the saving thread to release a frame buffer.");
+    }
+    while((frame->save_pinned.load(std::memory_order_acquire) != 0) && !closing)
+    {
+        usleep(10);
+    }
 }
+
 void take_object::savingLoop(std::string fname, unsigned int num_avgs, unsigned int num_frames) 
 {
     // Frame Save Thread (saving_thread)
@@ -1509,128 +1737,160 @@ void take_object::savingLoop(std::string fname, unsigned int num_avgs, unsigned
         hdr_fname=fname+".hdr";
     }
 
-    FILE * file_target = fopen(fname.c_str(), "wb");
     int sv_count = 0;
+    const size_t frameSize = frWidth*dataHeight;
+    const bool averaging = (num_avgs != 0) && (num_avgs != 1);
+
+    // With --directio, frames are batched by direct_writer and written around
+    // the page cache. Otherwise, or if that cannot be set up, use stdio.
+    FILE * file_target = NULL;
+    direct_writer * dwriter = NULL;
+    if(options.directIO)
+    {
+        size_t expectedBytes = 0;
+        if(num_frames != 0)
+        {
+            expectedBytes = averaging ? (num_frames/num_avgs)*frameSize*sizeof(float)
+                                      : num_frames*frameSize*sizeof(uint16_t);
+        }
+        dwriter = new direct_writer();
+        if(!dwriter->open(fname, expectedBytes))
+        {
+            warningMessage("Could not open file for direct I/O, using buffered writes.");
+            delete dwriter;
+            dwriter = NULL;
+        }
+    }
+    if(dwriter == NULL)
+    {
+        file_target = fopen(fname.c_str(), "wb");
+    }
+    bool writeFailed = (dwriter == NULL) && (file_target == NULL);
+    if(writeFailed)
+    {
+        warningMessage("Could not open file for saving, frames will not be recorded.");
+    }
+    auto writeOut = [&](const void * data, size_t bytes) -> bool {
+        // After the first failure, keep draining the queue so the frames are
+        // released, but stop writing to the file.
+        if(writeFailed)
+            return false;
+        bool written;
+        if(dwriter != NULL)
+        {
+            written = dwriter->write(data, bytes);
+        } else {
+            written = (fwrite(data, 1, bytes, file_target) == bytes); //It is ok if this blocks
+        }
+        if(!written)
+        {
+            writeFailed = true;
+            warningMessage("Writing the recording failed, the remaining frames will not be saved.");
+        }
+        return written;
+    };
 
-    while(  (save_framenum != 0) || continuousRecording)
+    float * avg_data = averaging ? new float[frameSize] : NULL;
+    frame_accumulator * accumulator = averaging ? new frame_accumulator(frWidth, dataHeight, SAVE_AVERAGING_BANDS) : NULL;
+    saveQueueItem item;
+    bool primaryLoop = true;
+
+    while(true)
     {
-        if(saving_list.size() > 2)
+        if(primaryLoop)
         {
-            if(num_avgs == 1)
+            if(!((save_framenum != 0) || continuousRecording))
             {
-                // This is our not-averaging save, where most saves go:
-                if(saving_list.size() > 2) {
-                    // We refuse to take the last item off the list.
-                    // it can wait until we are completely done recording.
-                    // This way the list remains valid in memory.
-                    uint16_t * data = saving_list.back();
-                    saving_list.pop_back();
-                    fwrite(data,sizeof(uint16_t),frWidth*dataHeight,file_target); //It is ok if this blocks
-                    delete[] data;
-                    sv_count++;
-                    if(sv_count == 1) {
-                        save_count.store(1, std::memory_order_seq_cst);
-                    }
-                    else {
-                        save_count++;
-                    }
-                }
+                // Almost done, let's take care of anything left in the queue.
+                primaryLoop = false;
+                statusMessage("Finished primary saving loop.");
+                char message[128];
+                sprintf(message, "Size of buffer: %ld", (long)saving_queue->size());
+                statusMessage(message);
+                continue;
             }
-            else if(saving_list.size() >= num_avgs && num_avgs != 1)
+            if(!saving_queue->wait_pop(item, std::chrono::milliseconds(1)))
             {
-                float * data = new float[frWidth*dataHeight];
-                for(unsigned int i2 = 0; i2 < num_avgs; i2++)
-                {
-                    uint16_t * data2 = saving_list.back();
-                    saving_list.pop_back();
-                    if(i2 == 0)
-                    {
-                        for(unsigned int i = 0; i < frWidth*dataHeight; i++)
-                        {
-                            data[i] = (float)data2[i];
-                        }
-                    }
-                    else if(i2 == num_avgs-1)
-                    {
-                        for(unsigned int i = 0; i < frWidth*dataHeight; i++)
-                        {
-                            data[i] = (data[i] + (float)data2[i])/num_avgs;
-                        }
-                    }
-                    else
-                    {
-                        for(unsigned int i = 0; i < frWidth*dataHeight; i++)
-                        {
-                            data[i] += (float)data2[i];
-                        }
-                    }
-                    delete[] data2;
-                }
-                fwrite(data,sizeof(float),frWidth*dataHeight,file_target); //It is ok if this blocks
-                delete[] data;
-                sv_count++;
-                if(sv_count == 1) {
-                    save_count.store(1, std::memory_order_seq_cst);
-                }
-                else {
-                    save_count++;
-                }
-                //std::cout << "save_count: " << std::to_string(save_count) << "\n";
-                //std::cout << "list size: " << std::to_string(saving_list.size() ) << "\n";
-                //std::cout << "save_framenum: " << std::to_string(save_framenum) << "\n";
+                // Nothing arrived, check again whether we are still recording.
+                continue;
             }
-            else if(save_framenum == 0 && saving_list.size() < num_avgs)
-            {
-                warningMessage("Erasing saving_list");
-                saving_list.erase(saving_list.begin(),saving_list.end());
+        } else {
+            if(!saving_queue->try_pop(item))
+                break;
+        }
+
+        if(!averaging)
+        {
+            // This is our not-averaging save, where most saves go:
+            bool written = writeOut(item.data, frameSize*sizeof(uint16_t));
+            releaseSavedFrame(item);
+            if(!written)
+                continue;
+            sv_count++;
+            if(sv_count == 1) {
+                save_count.store(1, std::memory_order_seq_cst);
             }
-            else
-            {
-                //We're waiting for data to get added to the list...
-                usleep(250);
+            else {
+                save_count++;
             }
+            continue;
         }
-        else
+
+        // Averaging save: accumulate as the frames arrive rather than waiting
+        // for num_avgs of them to pile up.
+        accumulator->add(item.data);
+        releaseSavedFrame(item);
+
+        if(accumulator->count() == num_avgs)
         {
-            //We're waiting for data to get added to the list...
-            usleep(250);
+            accumulator->mean(avg_data);
+            if(!writeOut(avg_data, frameSize*sizeof(float)))
+                continue;
+            sv_count++;
+            if(sv_count == 1) {
+                save_count.store(1, std::memory_order_seq_cst);
+            }
+            else {
+                save_count++;
+            }
         }
     }
 
-    // Almost done, let's take care of anything left in the buffer.
-
-    statusMessage("Finished primary saving loop.");
-    char message[128];
-    sprintf(message, "Size of buffer: %ld", saving_list.size());
-    statusMessage(message);
-    if( (num_avgs==1) || (num_avgs==0)) {
-        statusMessage("Finishing write...");
-        while(saving_list.size() > 0) {
-            statusMessage("Writing additional frame");
-            uint16_t * data = saving_list.back();
-            if(saving_list.size() > 0)
-                saving_list.pop_back();
-            fwrite(data,sizeof(uint16_t),frWidth*dataHeight,file_target);
-            sv_count++;
-            delete[] data;
-        }
-        statusMessage("Done with write.");
-    } else {
-        while(saving_list.size() > 0) {
-            //statusMessage("Dropping additional frame at end that does not meet average interval.");
-            uint16_t * data = saving_list.back();
-            if(saving_list.size() > 0)
-                saving_list.pop_back();
-            // Since averaging is typically many frames (>100),
-            // we cannot really average the last two or three frames
-            // in a meaningfull way. Writing the data out will just
-            // confuse people about the scale of the last few frames.
-            //fwrite(data,sizeof(float),frWidth*dataHeight,file_target);
-            delete[] data;
-        }
+    if(averaging && (accumulator->count() != 0))
+    {
+        // Since averaging is typically many frames (>100),
+        // we cannot really average the last two or three frames
+        // in a meaningfull way. Writing the data out will just
+        // confuse people about the scale of the last few frames.
+        statusMessage("Dropping additional frames at end that do not meet average interval.");
     }
+    delete[] avg_data;
+    delete accumulator;
 
-    fclose(file_target);
+    if(save_dropped != 0)
+    {
+        std::ostringstream dropss;
+        dropss << "Frame saving could not keep up, " << save_dropped << " frames were dropped from the recording.";
+        warningMessage(dropss.str());
+    }
+    if(save_stalls != 0)
+    {
+        std::ostringstream stallss;
+        stallss << "Acquisition waited " << save_stalls << " times for the saving thread to release a frame buffer.";
+        warningMessage(stallss.str());
+        save_stalls = 0;
+    }
+
+    if(dwriter != NULL)
+    {
+        if(!dwriter->close())
+        {
+            errorMessage("Errors occurred while writing the recording, the file may be incomplete.");
+        }
+        delete dwriter;
+    } else if(file_target != NULL) {
+        fclose(file_target);
+    }
     std::string hdr_text;
     if( (num_avgs !=0) && (num_avgs !=1) )
     {
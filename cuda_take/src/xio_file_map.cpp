@@ -0,0 +1,176 @@
+#include "xio_file_map.hpp"
+#include "osutils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+xio_file_map::xio_file_map()
+{
+    fd = -1;
+    map = NULL;
+    mapBytes = 0;
+    headerBytes = 0;
+    bytesPerFrame = 0;
+    frames = 0;
+}
+
+xio_file_map::~xio_file_map()
+{
+    close();
+}
+
+bool xio_file_map::open(const std::string &fname, size_t frameBytes, size_t xioHeaderBytes, unsigned int xioFrames)
+{
+    if(map != NULL)
+        close();
+    name = fname;
+
+    fd = ::open(fname.c_str(), O_RDONLY);
+    if(fd < 0)
+    {
+        LOG << "Could not open file " << fname << ": " << strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if((fstat(fd, &st) != 0) || (st.st_size == 0))
+    {
+        LOG << "File " << fname << " is empty or unreadable.";
+        close();
+        return false;
+    }
+    mapBytes = st.st_size;
+
+    std::string ext = os::getext(fname);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    size_t dataBytes = 0;
+    if(ext == "raw")
+    {
+        headerBytes = 0;
+        frames = (frameBytes == 0) ? 0 : mapBytes / frameBytes;
+        bytesPerFrame = frameBytes;
+        dataBytes = (size_t)frames * bytesPerFrame;
+    } else {
+        headerBytes = xioHeaderBytes;
+        frames = xioFrames;
+        if(mapBytes < headerBytes)
+        {
+            LL(8) << "Skipped file \"" << fname << "\", shorter than its header.";
+            close();
+            return false;
+        }
+        if(ext == "decomp")
+        {
+            dataBytes = mapBytes - headerBytes;
+        }
+        // .xio: read from the header below, once the file is mapped.
+    }
+
+    if(frames == 0)
+    {
+        LL(8) << "Skipped file \"" << fname << "\", it holds no whole frames.";
+        close();
+        return false;
+    }
+
+    void *m = mmap(NULL, mapBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(m == MAP_FAILED)
+    {
+        LOG << "Could not map file " << fname << ": " << strerror(errno);
+        close();
+        return false;
+    }
+    map = (uint8_t *)m;
+    madvise(map, mapBytes, MADV_SEQUENTIAL);
+
+    if((ext != "raw") && (ext != "decomp"))
+    {
+        dataBytes = (headerBytes >= 8) ? ((size_t)map[7] << 24 | (size_t)map[6] << 16 | (size_t)map[5] << 8 | map[4]) : 0;
+        LL(9) << "Data size read from header is: " << dataBytes;
+    }
+    bytesPerFrame = dataBytes / frames;
+    if(bytesPerFrame == 0)
+    {
+        // Happens when the header reports no data.
+        LL(8) << "Skipped file \"" << fname << "\" due to invalid data. size: " << dataBytes << ", nFrames: " << frames;
+        close();
+        return false;
+    }
+    if(headerBytes + (size_t)frames * bytesPerFrame > mapBytes)
+    {
+        unsigned int whole = (mapBytes - headerBytes) / bytesPerFrame;
+        LOG << "Warning, file " << fname << " is truncated, using " << whole << " of " << frames << " frames.";
+        frames = whole;
+        if(frames == 0)
+        {
+            close();
+            return false;
+        }
+    }
+
+    LOG << "Mapped " << fname << ": " << frames << " frames of " << bytesPerFrame << " bytes after a "
+        << headerBytes << " byte header.";
+    return true;
+}
+
+void xio_file_map::close()
+{
+    if(map != NULL)
+    {
+        munmap(map, mapBytes);
+        map = NULL;
+    }
+    mapBytes = 0;
+    frames = 0;
+    if(fd >= 0)
+    {
+        // Replay reads each file once, keep the page cache for something else.
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+const uint16_t *xio_file_map::frame(unsigned int n)
+{
+    if((map == NULL) || (n >= frames))
+        return NULL;
+    return (const uint16_t *)(map + headerBytes + (size_t)n * bytesPerFrame);
+}
+
+void xio_file_map::willNeed(unsigned int first, unsigned int count)
+{
+    if((map == NULL) || (first >= frames))
+        return;
+    count = std::min(count, frames - first);
+    // madvise wants a page-aligned start.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = headerBytes + (size_t)first * bytesPerFrame;
+    size_t end = start + (size_t)count * bytesPerFrame;
+    start -= start % page;
+    madvise(map + start, end - start, MADV_WILLNEED);
+}
+
+void xio_file_map::prefetch(size_t bytes)
+{
+    if(fd >= 0)
+        posix_fadvise(fd, 0, std::min(bytes, mapBytes), POSIX_FADV_WILLNEED);
+}
+
+void xio_file_map::load(unsigned int n)
+{
+    if((map == NULL) || (n >= frames))
+        return;
+    // One read per page is enough to bring the whole frame in.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const volatile uint8_t *p = map + headerBytes + (size_t)n * bytesPerFrame;
+    uint8_t sum = 0;
+    for(size_t off=0; off < bytesPerFrame; off += page)
+        sum += p[off];
+    sum += p[bytesPerFrame-1];
+    (void)sum;
+}
@@ -20,8 +20,6 @@ XIOCamera::XIOCamera(int frWidth,
     LOG << ": rsv - headsize: " << headsize << " frWidth: " << frWidth << ", data_height: " << data_height << ", size of pixel: " << int(sizeof(uint16_t));
     xioHeadsize = headsize;
     nFramesXio = nFrames;
-    header.resize(size_t(headsize));
-    std::fill(header.begin(), header.end(), 0);
 
     dummy.resize(size_t(frame_width * data_height));
     // dummyPtr is the size of two frames, this is just to make things safer.
@@ -46,8 +44,14 @@ XIOCamera::XIOCamera(int frWidth,
     std::fill(zero_vec.begin(), zero_vec.end(), 10000); // fill with value 10k so that I can spot it during debug.
 
     //std::fill(dummy.begin(), dummy.end(), 0);
+    const size_t pixels = size_t(frame_width * data_height);
+    startupFrames.resize(pixels * nFrames);
     for (int n = 0; n < nFrames; n++) {
-        frame_buf.emplace_back(std::vector<uint16_t>(size_t(frame_width * data_height), n*1000));
+        std::fill(startupFrames.begin() + n*pixels, startupFrames.begin() + (n+1)*pixels, n*1000);
+        xioFrameRef ref;
+        ref.index = n;
+        ref.data = startupFrames.data() + n*pixels;
+        frame_buf.push_back(ref);
     }
 
     // Frame buffer to hold guaranteed safe data. This buffer never chagnes size:
@@ -80,6 +84,11 @@ XIOCamera::~XIOCamera()
     running.store(false);
     //emit timeout();
     is_reading = false;
+    {
+        std::lock_guard<std::mutex> lock(frame_buf_lock);
+        dirGeneration++;
+    }
+    frame_buf_space.notify_all();
     while(frameVecLocked)
     {
         usleep(1);
@@ -103,10 +112,12 @@ void XIOCamera::setDir(const char *dirname)
     LOG << ": Clearing frame_buf. Initial size: " << frame_buf.size();
     {
         std::lock_guard<std::mutex> lock(frame_buf_lock);
+        dirGeneration++; // a reader still busy with the old directory stops
         while (!frame_buf.empty()) {
             frame_buf.pop_back();
         }
     }
+    frame_buf_space.notify_all();
 
     data_dir = dirname;
     if (data_dir.empty()) {
@@ -128,8 +139,6 @@ void XIOCamera::setDir(const char *dirname)
 
     fileListVecLocked = true;
     xio_files.clear();
-    dev_p.clear();
-    dev_p.close();
     image_no = 0;
     std::vector<std::string> fname_list;
     os::listdir(fname_list, data_dir);
@@ -245,158 +254,89 @@ std::string XIOCamera::getFname()
     return fname;
 }
 
-void XIOCamera::readFile()
+std::shared_ptr<xio_file_map> XIOCamera::openNextFile()
 {
-    // Reads a SINGLE file, processing all available frames within the file.
-    LOG << " Starting readfile";
-    bool isRawFile = false;
-    bool validFile = false;
-    while(!validFile) {
+    // Maps the next readable file of the directory, NULL once there are none left.
+    while(true) {
         ifname = getFname();
-        if (ifname.empty()) {
-            if (dev_p.is_open()) {
-                dev_p.close();
-            }
-
-            if (running.load()) {
-                running.store(false);
-                //emit timeout();
-            }
-            LOG << ": All out of files, give up. ifname from getFname() was an empty string.";
-            this->is_reading = false; // otherwise we get stuck reading and not reading.
-            return; //If we're out of files, give up
-        }
-        // otherwise check if data is valid
-        dev_p.open(ifname, std::ios::in | std::ios::binary);
-        if (!dev_p.is_open()) {
-            LOG << ": Could not open file" << ifname.data() << ". Does it exist?";
-            dev_p.clear();
-            return;
-        }
-
-        LOG << ": Successfully opened " << ifname.data();
+        if (ifname.empty())
+            return std::shared_ptr<xio_file_map>();
 
-        if(ifname.size() > 3 && ifname.compare(ifname.size()-3, 3, "raw") == 0)
-        {
-            isRawFile = true;
-        } else {
-            isRawFile = false;
+        std::shared_ptr<xio_file_map> file(new xio_file_map());
+        if (file->open(ifname, size_t(frame_width * frame_height) * sizeof(uint16_t), xioHeadsize, nFramesXio)) {
+            return file;
         }
+        // Unreadable, or no valid frames, so skip this file.
+    }
+}
 
-        dev_p.unsetf(std::ios::skipws);
+bool XIOCamera::queueFile(std::shared_ptr<xio_file_map> file, unsigned int generation)
+{
+    // Queues the frames of a SINGLE file, each once its data is in memory.
+    // Waits whenever XIO_READAHEAD_FRAMES are queued. Returns false if
+    // the directory was changed or the camera is closing.
+    nFrames = file->frameCount();
+    framesize = file->frameBytes();
+    LOG << ": File size is " << framesize * nFrames << " bytes, which corresponds to a framesize of " << framesize << " bytes.";
+    LOG << ": nFrames: " << nFrames;
+    file->willNeed(0, XIO_WILLNEED_FRAMES);
+    running.store(true);
 
-        dev_p.read(reinterpret_cast<char*>(header.data()), headsize);
+    for (int n = 0; n < nFrames; ++n) {
+        // Outside of the lock, so the copy loop is never held up by the disk.
+        file->load(n);
 
-        std::streampos filesize(0);
-        std::string ext = os::getext(ifname);
-        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-        if (!std::strcmp(ext.data(), "decomp")) {
-            headsize = xioHeadsize;
-            nFrames = nFramesXio;
-            dev_p.seekg(0, std::ios::end);
-            filesize = dev_p.tellg();
-            dev_p.seekg(headsize, std::ios::beg);
-            //filesize = filesize - headsize; // will this help?
-            LL(3) << ": decomp read, filesize read from actual file stream is: " << filesize;
-        } else if (isRawFile){
-            dev_p.seekg(0, std::ios::end);
-            filesize = dev_p.tellg();
-            nFrames = filesize / (frame_width * frame_height * sizeof(uint16_t));
-            headsize = 0;
-            dev_p.seekg(std::ios::beg);
-        } else {
-            headsize = xioHeadsize;
-            nFrames = nFramesXio;
-            // convert the raw hex string to decimal, one digit at a time.
-            filesize = int(header[7]) * 16777216 + int(header[6]) * 65536 + int(header[5]) * 256 + int(header[4]);
-            LL(9) << ": Not-decomp, filesize read from header is: " << filesize;
-        }
-
-        framesize = static_cast<size_t>(filesize / nFrames);
-        if (framesize == 0) { //If header reports a 0 filesize (invalid data), then skip this file.
-            dev_p.close();
-            LL(8) << ": Skipped file \"" << ifname.data() << "\" due to invalid data. size: "
-                               << framesize << ", nFrames: " << nFrames;
-        } else { //otherwise we load it
-            validFile = true;
-            LOG <<__PRETTY_FUNCTION__<< ": rsv - dev_p.seekg(): " << headsize;
-            dev_p.seekg(headsize, std::ios::beg);
-
-            LOG << ": File size is " << filesize << " bytes, which corresponds to a framesize of " << framesize << " bytes.";
-            LOG << ": nFrames: " << nFrames;
-/*
-            if( (int)(framesize / sizeof(uint16_t)) > (int)(frame_width * data_height))
-                abort();
-            std::vector<uint16_t> zero_vec(size_t(frame_width * data_height) - (size_t(framesize) / sizeof(uint16_t)));
-            std::fill(zero_vec.begin(), zero_vec.end(), 10000); // fill with value 10k so that I can spot it during debug.
-*/
-
-
-            // std::vector<uint16_t> copy_vec(size_t(framesize), 5000); // fill with value 5k so that I can spot it during debug.
-            std::vector<uint16_t> copy_vec(size_t(frame_height * frame_width * sizeof(uint16_t)), 5000); // fill with value 5k so that I can spot it during debug.
-
-            int read_size = 0;
-
-            {
-                std::lock_guard<std::mutex> lock(frame_buf_lock); // wait until we have a lock
-                for (volatile int n = 0; n < nFrames; ++n) {
-                    //copy_vec.clear();
-                    //copy_vec.resize(size_t(frame_height * frame_width * sizeof(uint16_t)));
-                    dev_p.read(reinterpret_cast<char*>(copy_vec.data()), std::streamsize(framesize));
-                    read_size = dev_p.gcount();
-                    LL(3)  << ": Read " << read_size << " bytes from frame " << n << ", copy_vec size is: " << copy_vec.size();
-                    LL(3)  << "Rows: " << read_size / frame_width;
-                    LL(2) << ": Size of frame_buf pre-push: " << frame_buf.size();
-
-                    if (framesize / sizeof(uint16_t) < size_t(frame_width * data_height)) {
-                        std::copy(zero_vec.begin(), zero_vec.begin() + ( ((frame_width * data_height)) - (framesize / sizeof(uint16_t)) ), copy_vec.data() + framesize / sizeof(uint16_t));
-                    }
-                    frameVecLocked = true;
-                    frame_buf.push_front(copy_vec);  // double-ended queue of a vector of uint_16.
-                    // each frame_buf unit is a frame vector.
-                    LL(2) << ": Size of frame_buf post-push: " << frame_buf.size();
-                    frameVecLocked = false;
-                }
-            } // end lock
-
-            running.store(true);
-            LOG << ": About done, emitting started signal.";
-            //emit started(); // doesn't seem to be needed?
-            dev_p.close();
+        std::unique_lock<std::mutex> lock(frame_buf_lock);
+        while((frame_buf.size() >= XIO_READAHEAD_FRAMES) && (generation == dirGeneration)) {
+            frame_buf_space.wait_for(lock, std::chrono::milliseconds(tmoutPeriod));
         }
+        if(generation != dirGeneration)
+            return false;
+        xioFrameRef ref;
+        ref.file = file;
+        ref.index = n;
+        ref.data = file->frame(n);
+        frame_buf.push_front(ref); // double-ended queue of frame views, oldest at the back
+        LL(2) << ": Size of frame_buf post-push: " << frame_buf.size();
+        frame_buf_ready.notify_one();
     }
-    LOG << ": is done.";
+    return true;
 }
 
 void XIOCamera::readLoop()
 {
+    // Runs the files of the directory through the frame queue until they run out.
+    // The next file is opened while the current one is queued, so that its
+    // start is already coming off the disk when it is needed.
     LOG << ": Entering readLoop()";
-    int waits = 1;
-    bool sizeSmall = false;
-
-    do {
-        {
-            std::lock_guard<std::mutex> lock(frame_buf_lock);
-            sizeSmall = (frame_buf.size() <= 96);
-        }
-        // if( we have fewer than 97 frames)
-        if (sizeSmall) {
-            waits = 1; //reset wait counter
-            readFile(); // read in the next files, runs getFname() over and over
-
-        } else {
-            waits++;
-            //LOG << ": Waiting: Wait step: " << waits++ << ", frame_buf.size(): " << frame_buf.size(); // hapens 8 times in between files.
-            //LOG << ": Waiting: Wait step: " << waits++; // hapens 8 times in between files.
+    unsigned int generation;
+    {
+        std::lock_guard<std::mutex> lock(frame_buf_lock);
+        generation = dirGeneration;
+    }
+    std::shared_ptr<xio_file_map> file = openNextFile();
+    while(file) {
+        std::shared_ptr<xio_file_map> next = openNextFile();
+        if(next)
+            next->prefetch(XIO_PREFETCH_BYTES);
+        if(!queueFile(file, generation))
+            break;
+        file = next;
+    }
+    if(!file) {
+        if (running.load()) {
+            running.store(false);
+            //emit timeout();
         }
-    } while (is_reading);
+        LOG << ": All out of files, give up. ifname from getFname() was an empty string.";
+        this->is_reading = false; // otherwise we get stuck reading and not reading.
+    }
     LOG << ": finished readLoop(). is_reading must be false now: " << is_reading;
 }
 
 uint16_t* XIOCamera::getFrame(CameraModel::camStatusEnum *stat)
 {
     // This seems to run constantly.
-    uint16_t *frameVecPtr = NULL;
 
     if(camcontrol->pause && *stat != camDone)
     {
@@ -408,7 +348,13 @@ uint16_t* XIOCamera::getFrame(CameraModel::camStatusEnum *stat)
 
     bool showOutput = ((getFrameCounter % 100) == 0);
     {
-        std::lock_guard<std::mutex> lock(frame_buf_lock); // gone once out of scope.
+        std::unique_lock<std::mutex> lock(frame_buf_lock); // gone once out of scope.
+        if(frame_buf.empty() && is_reading)
+        {
+            // The reader is behind. Give it up to the usual one second timeout.
+            frame_buf_ready.wait_for(lock, std::chrono::seconds(1),
+                                     [this]{ return !frame_buf.empty() || !is_reading; });
+        }
         if(showOutput)
         {
             LOG << ": Getting frame: " << getFrameCounter << ", empty status: " << frame_buf.empty() << ", is_reading: " << is_reading << ", locked: " << frameVecLocked;
@@ -418,24 +364,39 @@ uint16_t* XIOCamera::getFrame(CameraModel::camStatusEnum *stat)
         if ( (!frame_buf.empty()) ) {
             LL(4) << "Returning good data.";
             frameVecLocked = true;
-            //temp_frame = frame_buf.back();
-            frameVecPtr = frame_buf.back().data();
-            if(frameVecPtr == NULL)
-                abort();
-            // This memory was allocated with the class constructor; it is always valid and
-            // does not change size. Data are copied from the locked vector into
-            // this guarenteed space so that the calling function will never come up
-            // with invalid memory.
-            memcpy(guaranteedBufferFrames[gbPos%guaranteedBufferFramesCount], frameVecPtr, frame_height*frame_width*sizeof(uint16_t));
-
+            xioFrameRef ref = frame_buf.back();
             frame_buf.pop_back();
             frameVecLocked = false;
-            doneFramePtr = guaranteedBufferFrames[gbPos%guaranteedBufferFramesCount];
-            gbPos++;
+            frame_buf_space.notify_one();
+            if(ref.data == NULL)
+                abort();
+
+            const size_t frameBytes = size_t(frame_width * data_height) * sizeof(uint16_t);
+            const size_t fileFrameBytes = ref.file ? ref.file->frameBytes() : frameBytes;
+            if(ref.file && ((ref.index % XIO_WILLNEED_FRAMES) == 0)) {
+                ref.file->willNeed(ref.index + XIO_WILLNEED_FRAMES, XIO_WILLNEED_FRAMES);
+            }
+            if((fileFrameBytes >= frameBytes) && (((uintptr_t)ref.data % sizeof(uint16_t)) == 0)) {
+                // Handed out in place. doneFile keeps the mapping open until
+                // the next frame is asked for, and the caller only reads it.
+                doneFramePtr = const_cast<uint16_t*>(ref.data);
+            } else {
+                // A short (or oddly sized) frame is copied into guaranteed space
+                // and padded with 10k, so that the caller never reads past it.
+                uint16_t *out = guaranteedBufferFrames[gbPos%guaranteedBufferFramesCount];
+                size_t copyBytes = std::min(fileFrameBytes, frameBytes);
+                memcpy(out, ref.data, copyBytes);
+                std::copy(zero_vec.begin(), zero_vec.begin() + (frameBytes - copyBytes) / sizeof(uint16_t),
+                          out + copyBytes / sizeof(uint16_t));
+                doneFramePtr = out;
+                gbPos++;
+            }
+            doneFile = ref.file;
             *stat = camPlaying;
             return doneFramePtr;
         } else {
             //if(showOutput) cout << __PRETTY_FUNCTION__ << ": Returning dummy data. locked: " << frameVecLocked << ", is_reading: " << is_reading << "empty status: " << frame_buf.empty() << endl;
+            lock.unlock(); // the reader may still queue frames meanwhile
             usleep(1000 * 1000); // 1 FPS, "timeout" style framerate, like the PDV driver.
             *stat = camDone;
             return dummyPtr;
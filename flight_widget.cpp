@@ -298,6 +298,12 @@ void flight_widget::logFPSSlot() {
     // Called once per minute during flight mode
     emit statusMessage(QString("Logging FPS: %1, back-end frame count: %2").\
                        arg(fw->delta).arg(fw->frameCount));
+    if(fw->senderDelta > 0) {
+        camStreamStatsType st = fw->to.getStreamStats();
+        emit statusMessage(QString("Sensor FPS: %1, jitter: %2 us, clock drift: %3 ppm, frames not received: %4").
+                           arg(st.senderFps, 0, 'f', 2).arg(st.senderJitterMicros, 0, 'f', 1).
+                           arg(st.senderDriftPpm, 0, 'f', 1).arg(st.senderSkippedFrames));
+    }
     if(gps->haveData) {
         emit statusMessage(QString("GPS check: longitude: %1, latitude: %2, altitude: %3 (ft), "
                                    "ground speed: %4 (knots)").arg(gps->chk_longitude)
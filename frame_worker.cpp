@@ -116,6 +116,14 @@ void frameWorker::convertOptions()
     takeOptions.headless = options.headless;
     takeOptions.noGPU = options.noGPU;
     takeOptions.useSHM = options.useSHM;
+    takeOptions.zeroCopySave = options.zeroCopySave;
+    takeOptions.directIO = options.directIO;
+    takeOptions.ringBufferFrames = options.ringBufferFrames;
+    takeOptions.latencyDumpSeconds = options.latencyDumpSeconds;
+    takeOptions.cpuAcquire = options.cpuAcquire;
+    takeOptions.cpuConsume = options.cpuConsume;
+    takeOptions.rtPriority = options.rtPriority;
+    takeOptions.numaLocal = options.numaLocal;
     takeOptions.flightMode = options.flightMode;
     takeOptions.disableGPS = options.disableGPS;
     takeOptions.disableCamera = options.disableCamera;
@@ -127,6 +135,17 @@ void frameWorker::convertOptions()
     takeOptions.xioCam = options.xioCam;
     takeOptions.rtpCam = options.rtpCam;
     takeOptions.rtpNextGen = options.rtpNextGen;
+    takeOptions.rtpBatchSize = options.rtpBatchSize;
+    takeOptions.rtpRecvTimeoutMs = options.rtpRecvTimeoutMs;
+    takeOptions.rtpDirectPlacement = options.rtpDirectPlacement;
+    takeOptions.rtpSpinMicros = options.rtpSpinMicros;
+    takeOptions.rtpShards = options.rtpShards;
+    takeOptions.rtpShardPorts = options.rtpShardPorts;
+    takeOptions.rtpPacketRing = options.rtpPacketRing;
+    takeOptions.rtpBufferSeconds = options.rtpBufferSeconds;
+    takeOptions.rtpReplayFile = options.rtpReplayFile;
+    takeOptions.rtpReplayFast = options.rtpReplayFast;
+    takeOptions.rtpReplayLoop = options.rtpReplayLoop;
     if(options.rtpCam)
     {
         takeOptions.rtpHeight = options.rtpHeight;
@@ -235,9 +254,9 @@ void frameWorker::captureFrames()
     while(doRun) {
         QCoreApplication::processEvents(QEventLoop::AllEvents, 1); // 1ms maximum delay permitted
         usleep(50); //So that CPU utilization is not 100%
-        count = (to.count - 1) % CPU_FRAME_BUFFER_SIZE;
+        count = (to.count - 1) % to.getRingDepth();
         workingFrame = &to.frame_ring_buffer[count];
-        //workingFrame = &to.frame_ring_buffer[count % CPU_FRAME_BUFFER_SIZE];
+        //workingFrame = &to.frame_ring_buffer[count % to.getRingDepth()];
 
         if(std_dev_processing_frame != NULL) {
             if(std_dev_processing_frame->has_valid_std_dev == 2) {
@@ -272,6 +291,7 @@ void frameWorker::captureFrames()
                 if(microSecondsPerFrame != 0)
                 {
                     delta = 1000000.0f / microSecondsPerFrame;
+                    senderDelta = to.getStreamStats().senderFps;
                     emit updateFPS();
                 }
                 lastTime = clock.elapsed();
@@ -81,6 +81,7 @@ public:
     frame_c *std_dev_frame = NULL;
 
     float delta;
+    float senderDelta = 0; // frame rate from the camera's own timestamps, 0 if it sends none
     quint16 navgs = 1;
     uint64_t frameCount = 0;
 
@@ -104,13 +104,22 @@ DISTFILES +=    cuda_take/include/take_object.hpp \
                 cuda_take/include/constants.h \
                 cuda_take/include/camera_types.hpp \
                 cuda_take/include/xiocamera.h \
+                cuda_take/include/xio_file_map.hpp \
                 cuda_take/include/osutils.h \
                 cuda_take/include/alphanum.hpp \
                 cuda_take/include/camera_types.h \
                 cuda_take/include/cameramodel.h \
                 cuda_take/include/cudalog.h \
                 cuda_take/include/takeoptions.h \
-                cuda_take/include/rtpcamera.hpp
+                cuda_take/include/rtpcamera.hpp \
+                cuda_take/include/spsc_queue.hpp \
+                cuda_take/include/direct_writer.hpp \
+                cuda_take/include/packet_ring.hpp \
+                cuda_take/include/pcap_reader.hpp \
+                cuda_take/include/sender_clock.hpp \
+                cuda_take/include/frame_accumulator.hpp \
+                cuda_take/include/frame_pipeline.hpp \
+                cuda_take/include/latency_histogram.hpp
 
 DISTFILES +=    cuda_take/src/take_object.cpp \
                 cuda_take/src/std_dev_filter_device_code.cu \
@@ -121,7 +130,15 @@ DISTFILES +=    cuda_take/src/take_object.cpp \
                 cuda_take/src/dark_subtraction_filter.cpp \
                 cuda_take/src/chroma_translate_filter.cpp \
                 cuda_take/src/xiocamera.cpp \
-                cuda_take/src/rtpcamera.cpp
+                cuda_take/src/xio_file_map.cpp \
+                cuda_take/src/rtpcamera.cpp \
+                cuda_take/src/direct_writer.cpp \
+                cuda_take/src/packet_ring.cpp \
+                cuda_take/src/pcap_reader.cpp \
+                cuda_take/src/sender_clock.cpp \
+                cuda_take/src/frame_accumulator.cpp \
+                cuda_take/src/frame_pipeline.cpp \
+                cuda_take/src/latency_histogram.cpp
 
 
 
@@ -18,6 +18,7 @@
 #include "qcustomplot.h"
 #include "frame_worker.h"
 #include "startupOptions.h"
+#include "osutils.h"
 
 /* If the macros to define the development environment are not defined at compile time, use defaults */
 #ifndef HOST
@@ -82,7 +83,14 @@ int main(int argc, char *argv[])
                                "--rtpwidth 1280 "
                                "--rtpaddress 1.2.3.4 "
                                "--rtpinterface eth2 "
+                               "--rtpbatch 32 --rtptimeout 100 --rtpdirect --rtpspin 50 "
+                               "--rtpshards 4 --rtpshardports --rtpring --rtpbuffersecs 2.0 "
+                               "--rtpreplay capture.pcap --rtpreplayfast --rtpreplayloop "
                                "--er2 --headless "
+                               "--zerocopysave --directio "
+                               "--ringframes 1500 "
+                               "--latencydump 10 "
+                               "--cpuacquire 2 --cpuconsume 3 --cpugui 0-1,4-7 --rtpriority 50 --numalocal "
                                "--wfpreview "
                                "--wfpreviewcontinuous "
                                "--wfpreviewlocation /path/to/waterfallpreview/files/ "
@@ -377,6 +385,236 @@ int main(int argc, char *argv[])
             startupOptions.useSHM = true;
         }
 
+        if(currentArg == "--zerocopysave") {
+            startupOptions.zeroCopySave = true;
+        }
+
+        if(currentArg == "--directio") {
+            startupOptions.directIO = true;
+        }
+
+        if((currentArg == "--cpuacquire") || (currentArg == "--cpuconsume") || (currentArg == "--cpugui"))
+        {
+            cpu_set_t cpuSetTemp;
+            if((argc > c+1) && os::parseCpuList(argv[c+1], &cpuSetTemp))
+            {
+                if(currentArg == "--cpuacquire")
+                    startupOptions.cpuAcquire = argv[c+1];
+                else if(currentArg == "--cpuconsume")
+                    startupOptions.cpuConsume = argv[c+1];
+                else
+                    startupOptions.cpuGUI = argv[c+1];
+                c++;
+            } else {
+                std::cout << helptext.toStdString() << std::endl;
+                exit(-1);
+            }
+        }
+
+        if(currentArg == "--rtpriority")
+        {
+            if(argc > c)
+            {
+                unsigned int rtPriorityTemp = 0;
+                bool ok = false;
+                rtPriorityTemp = QString(argv[c+1]).toUInt(&ok);
+                if(ok && (rtPriorityTemp <= 99))
+                {
+                    startupOptions.rtPriority = rtPriorityTemp;
+                    c++;
+                } else {
+                    std::cout << helptext.toStdString() << std::endl;
+                    exit(-1);
+                }
+            } else {
+                std::cout << helptext.toStdString() << std::endl;
+                exit(-1);
+            }
+        }
+
+        if(currentArg == "--numalocal") {
+            startupOptions.numaLocal = true;
+        }
+
+        if(currentArg == "--latencydump")
+        {
+            if(argc > c)
+            {
+                unsigned int latencyDumpTemp = 0;
+                bool ok = false;
+                latencyDumpTemp = QString(argv[c+1]).toUInt(&ok);
+                if(ok)
+                {
+                    startupOptions.latencyDumpSeconds = latencyDumpTemp;
+                    c++;
+                } else {
+                    std::cout << helptext.toStdString() << std::endl;
+                    exit(-1);
+                }
+            } else {
+                std::cout << helptext.toStdString() << std::endl;
+                exit(-1);
+            }
+        }
+
+        if(currentArg == "--rtpshardports") {
+            startupOptions.rtpShardPorts = true;
+        }
+
+        if(currentArg == "--rtpring") {
+            startupOptions.rtpPacketRing = true;
+        }
+
+        if(currentArg == "--rtpreplay")
+        {
+            if(argc > c)
+            {
+                startupOptions.rtpReplayFile = argv[c+1];
+                c++;
+            } else {
+                std::cout << helptext.toStdString() << std::endl;
+                exit(-1);
+            }
+        }
+
+        if(currentArg == "--rtpreplayfast") {
+            startupOptions.rtpReplayFast = true;
+        }
+
+        if(currentArg == "--rtpreplayloop") {
+            startupOptions.rtpReplayLoop = true;
+        }
+
+        if(currentArg == "--rtpdirect") {
+            startupOptions.rtpDirectPlacement = true;
+        }
+
+        if(currentArg == "--rtpbatch")
+        {
+            if(argc > c)
+            {
+                unsigned int rtpBatchTemp = 0;
+                bool ok = false;
+                rtpBatchTemp = QString(argv[c+1]).toUInt(&ok);
+                if(ok && (rtpBatchTemp > 0))
+                {
+                    startupOptions.rtpBatchSize = rtpBatchTemp;
+                    c++;
+                } else {
+                    std::cout << helptext.toStdString() << std::endl;
+                    exit(-1);
+                }
+            } else {
+                std::cout << helptext.toStdString() << std::endl;
+                exit(-1);
+            }
+        }
+
+        if(currentArg == "--rtptimeout")
+        {
+            if(argc > c)
+            {
+                unsigned int rtpTimeoutTemp = 0;
+                bool ok = false;
+                rtpTimeoutTemp = QString(argv[c+1]).toUInt(&ok);
+                if(ok)
+                {
+                    startupOptions.rtpRecvTimeoutMs = rtpTimeoutTemp;
+                    c++;
+                } else {
+                    std::cout << helptext.toStdString() << std::endl;
+                    exit(-1);
+                }
+            } else {
+                std::cout << helptext.toStdString() << std::endl;
+                exit(-1);
+            }
+        }
+
+        if(currentArg == "--rtpspin")
+        {
+            if(argc > c)
+            {
+                unsigned int rtpSpinTemp = 0;
+                bool ok = false;
+                rtpSpinTemp = QString(argv[c+1]).toUInt(&ok);
+                if(ok)
+                {
+                    startupOptions.rtpSpinMicros = rtpSpinTemp;
+                    c++;
+                } else {
+                    std::cout << helptext.toStdString() << std::endl;
+                    exit(-1);
+                }
+            } else {
+                std::cout << helptext.toStdString() << std::endl;
+                exit(-1);
+            }
+        }
+
+        if(currentArg == "--rtpbuffersecs")
+        {
+            if(argc > c)
+            {
+                float rtpBufferSecondsTemp = 0;
+                bool ok = false;
+                rtpBufferSecondsTemp = QString(argv[c+1]).toFloat(&ok);
+                if(ok && (rtpBufferSecondsTemp > 0))
+                {
+                    startupOptions.rtpBufferSeconds = rtpBufferSecondsTemp;
+                    c++;
+                } else {
+                    std::cout << helptext.toStdString() << std::endl;
+                    exit(-1);
+                }
+            } else {
+                std::cout << helptext.toStdString() << std::endl;
+                exit(-1);
+            }
+        }
+
+        if(currentArg == "--rtpshards")
+        {
+            if(argc > c)
+            {
+                unsigned int rtpShardsTemp = 0;
+                bool ok = false;
+                rtpShardsTemp = QString(argv[c+1]).toUInt(&ok);
+                if(ok && (rtpShardsTemp > 0))
+                {
+                    startupOptions.rtpShards = rtpShardsTemp;
+                    c++;
+                } else {
+                    std::cout << helptext.toStdString() << std::endl;
+                    exit(-1);
+                }
+            } else {
+                std::cout << helptext.toStdString() << std::endl;
+                exit(-1);
+            }
+        }
+
+        if(currentArg == "--ringframes")
+        {
+            if(argc > c)
+            {
+                unsigned int ringFramesTemp = 0;
+                bool ok = false;
+                ringFramesTemp = QString(argv[c+1]).toUInt(&ok);
+                if(ok)
+                {
+                    startupOptions.ringBufferFrames = ringFramesTemp;
+                    c++;
+                } else {
+                    std::cout << helptext.toStdString() << std::endl;
+                    exit(-1);
+                }
+            } else {
+                std::cout << helptext.toStdString() << std::endl;
+                exit(-1);
+            }
+        }
+
         if( (currentArg == "--no-gpu") || (currentArg == "--nogpu") ) {
             startupOptions.noGPU = true;
             startupOptions.runStdDevCalculation = false;
@@ -426,6 +664,15 @@ int main(int argc, char *argv[])
 
         if(startupOptions.rtpNextGen) {
             std::cout << "Using RTP NextGen code" << std::endl;
+            std::cout << "rtpBatch:     " << startupOptions.rtpBatchSize << std::endl;
+            std::cout << "rtpTimeout:   " << startupOptions.rtpRecvTimeoutMs << " ms" << std::endl;
+            std::cout << "rtpSpin:      " << startupOptions.rtpSpinMicros << " us" << std::endl;
+            std::cout << "rtpShards:    " << startupOptions.rtpShards << (startupOptions.rtpShardPorts ? " (one port each)" : " (SO_REUSEPORT)") << std::endl;
+            std::cout << "rtpBuffer:    " << startupOptions.rtpBufferSeconds << " s" << std::endl;
+            if(startupOptions.rtpPacketRing)
+                std::cout << "rtpRing:      receiving through AF_PACKET ring" << std::endl;
+            if(startupOptions.rtpReplayFile != NULL)
+                std::cout << "rtpReplay:    " << startupOptions.rtpReplayFile << (startupOptions.rtpReplayFast ? " (fast)" : "") << std::endl;
         }
 
         if(widthSet && heightSet)
@@ -485,6 +732,23 @@ int main(int argc, char *argv[])
         std::cerr << "Warning, waterfall preview option enabled but --wfpreviewlocation was not set." << std::endl;
     }
 
+    if(startupOptions.cpuAcquire != NULL)
+        std::cout << "cpuAcquire:   " << startupOptions.cpuAcquire << std::endl;
+    if(startupOptions.cpuConsume != NULL)
+        std::cout << "cpuConsume:   " << startupOptions.cpuConsume << std::endl;
+    if(startupOptions.rtPriority > 0)
+        std::cout << "rtPriority:   SCHED_FIFO " << startupOptions.rtPriority << std::endl;
+    if(startupOptions.cpuGUI != NULL)
+    {
+        // Everything running so far, the GUI thread and Qt's own, moves to these CPUs.
+        // Threads started later inherit them, and the acquisition threads then move
+        // themselves on to --cpuacquire and --cpuconsume.
+        std::cout << "cpuGUI:       " << startupOptions.cpuGUI << std::endl;
+        std::string error;
+        if(!os::pinProcess(startupOptions.cpuGUI, error))
+            std::cerr << "Warning, could not move the GUI threads: " << error << std::endl;
+    }
+
     /* Step 2: Load the splash screen */
 
     QString logoPath;
@@ -41,6 +41,17 @@ struct startupOptionsType
     int rtpPort = 5004;
     bool rtpCam = false;
     bool rtpNextGen = false;
+    unsigned int rtpBatchSize = 32;
+    unsigned int rtpRecvTimeoutMs = 100;
+    bool rtpDirectPlacement = false;
+    unsigned int rtpSpinMicros = 0;
+    unsigned int rtpShards = 1;
+    bool rtpShardPorts = false;
+    bool rtpPacketRing = false;
+    float rtpBufferSeconds = 2.0;
+    const char* rtpReplayFile = NULL;
+    bool rtpReplayFast = false;
+    bool rtpReplayLoop = false;
     bool rtprgb = true;
 
     bool er2mode = false;
@@ -48,6 +59,16 @@ struct startupOptionsType
     bool noGPU = false;
 
     bool useSHM = false;
+    bool zeroCopySave = false;
+    bool directIO = false;
+    unsigned int ringBufferFrames = 0;
+    unsigned int latencyDumpSeconds = 0;
+
+    const char* cpuAcquire = NULL;
+    const char* cpuConsume = NULL;
+    const char* cpuGUI = NULL;
+    int rtPriority = 0;
+    bool numaLocal = false;
 
     bool wfPreviewEnabled = false;
     bool wfPreviewContinuousMode = false;
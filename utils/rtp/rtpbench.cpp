@@ -0,0 +1,340 @@
+// Loopback end-to-end benchmark for the RTP NextGen receiver.
+// Build and run the default sweep with:
+// make bench
+//
+// For every combination of frame width, height, chunks per frame and frame rate, an
+// rtpnextgen receiver is started headless and read the way take_object reads it
+// (getFrameWait in a loop, copying each frame out), and server-testpattern is launched
+// to send it a fixed number of frames over loopback. Every delivered frame is checked
+// against the test pattern, regenerated from the frame counter in its first bytes.
+//
+// Usage:
+// ./rtpbench [-s sender] [-p port] [-w widths] [-h heights] [-c chunks] [-f fps]
+//            [-n frames] [-b batch] [-d] [-r shards] [-R] [-x maxDropPercent]
+// widths, heights, chunks and fps are comma separated lists, e.g. -c 32,64 -f 100,250,400
+// -d, -r and -R turn on direct placement, receive shards and the packet ring (lo, needs CAP_NET_RAW).
+// With -r, each shard listens on its own port and the sender spreads the frames over them,
+// so that every shard receives and the shard merge has to put the frames back in order.
+//
+// The exit status is 1 if any frame held anything but the pattern (or zeros where chunks
+// were lost), if frames came out of order, or if more than maxDropPercent of the frames
+// sent after buffer sizing never reached the consumer. It is also 1 if no point of the
+// sweep could be run, because none of the frames divides evenly into its chunks.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rtpnextgen.hpp"
+#include "testpattern.h"
+
+struct benchPoint {
+    int width;
+    int height;
+    int chunks;
+    double fps;
+};
+
+struct benchResult {
+    benchPoint point;
+    unsigned int framesSent;
+    uint64_t delivered = 0;
+    uint64_t verified = 0; // exact matches
+    uint64_t zeroFilled = 0; // differ only where lost chunks were zeroed
+    uint64_t unidentified = 0; // first chunk lost and zero-filled, so the frame counter is unknown
+    uint64_t corrupt = 0;
+    uint64_t outOfOrder = 0;
+    double sustainedFps = 0;
+    double dropPercent = 0;
+    camStreamStatsType stats;
+    double senderCpu = 0; // seconds
+    double receiveCpu = 0;
+    double consumeCpu = 0;
+    double verifyCpu = 0;
+};
+
+static double cpuSeconds(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1E9;
+}
+
+static std::vector<double> parseList(const char *arg) {
+    std::vector<double> v;
+    std::string s(arg);
+    size_t pos = 0;
+    while(pos <= s.size()) {
+        size_t comma = s.find(',', pos);
+        if(comma == std::string::npos)
+            comma = s.size();
+        if(comma > pos)
+            v.push_back(atof(s.substr(pos, comma - pos).c_str()));
+        pos = comma + 1;
+    }
+    return v;
+}
+
+static pid_t startSender(const char *sender, int port, int ports, const benchPoint &pt, unsigned int frames) {
+    std::string p = std::to_string(port), w = std::to_string(pt.width), h = std::to_string(pt.height);
+    std::string c = std::to_string(pt.chunks), f = std::to_string(pt.fps), n = std::to_string(frames);
+    std::string r = std::to_string(ports);
+    pid_t pid = fork();
+    if(pid == 0) {
+        // The sender's progress messages would drown out ours. Warnings go to stderr and stay.
+        int devnull = open("/dev/null", O_WRONLY);
+        if(devnull >= 0)
+            dup2(devnull, STDOUT_FILENO);
+        execl(sender, sender, "-p", p.c_str(), "-w", w.c_str(), "-h", h.c_str(),
+              "-c", c.c_str(), "-f", f.c_str(), "-n", n.c_str(), "-r", r.c_str(), (char *)NULL);
+        perror("Could not start the test pattern sender");
+        _exit(127);
+    }
+    return pid;
+}
+
+static void checkFrame(const uint8_t *frame, uint8_t *reference, const benchPoint &pt, rtpnextgen *cam,
+                       int &lastCounter, benchResult &r) {
+    size_t bytes = (size_t)pt.width * pt.height * 2;
+    if(frame[2] != 0xff || frame[3] != 0xff || frame[4] != 0xff || frame[5] != 0xff) {
+        // The frame can only be identified from its first chunk. If that was lost, the receiver
+        // zero-filled it and counted packets as lost. Anything else is a misplaced chunk.
+        size_t chunkBytes = bytes / pt.chunks;
+        bool zeroed = true;
+        for(size_t b=0; zeroed && (b < chunkBytes); b++)
+            zeroed = (frame[b] == 0);
+        if(zeroed && (cam->getStreamStats().lostPackets != 0)) {
+            r.unidentified++;
+        } else {
+            r.corrupt++;
+        }
+        return;
+    }
+    int counter = frame[1];
+    if((lastCounter >= 0) && (((counter - lastCounter) & 0xff) > 128))
+        r.outOfOrder++;
+    lastCounter = counter;
+
+    genFrameOffset(reference, pt.height, pt.width, (uint8_t)counter);
+    insertFrameHeader(reference, counter);
+    if(memcmp(frame, reference, bytes) == 0) {
+        r.verified++;
+        return;
+    }
+    for(size_t b=0; b < bytes; b++) {
+        if((frame[b] != reference[b]) && (frame[b] != 0)) {
+            r.corrupt++;
+            return;
+        }
+    }
+    r.zeroFilled++;
+}
+
+static benchResult runPoint(const char *sender, takeOptionsType options, const benchPoint &pt, unsigned int frames) {
+    benchResult r;
+    r.point = pt;
+    r.framesSent = frames;
+    options.rtpWidth = pt.width;
+    options.rtpHeight = pt.height;
+
+    size_t bytes = (size_t)pt.width * pt.height * 2;
+    std::vector<uint8_t> copy(bytes);
+    std::vector<uint8_t> reference(bytes);
+
+    camControlType control;
+    rtpnextgen *cam = new rtpnextgen(options);
+    cam->setCamControlPtr(&control);
+    std::thread receiver([cam]{ cam->streamLoop(); });
+
+    double processStart = cpuSeconds(CLOCK_PROCESS_CPUTIME_ID);
+    double consumerStart = cpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+    pid_t pid = startSender(sender, options.rtpPort, options.rtpShards, pt, frames);
+
+    // Stop the receiver once the sender is done and the last frames have had time to arrive.
+    struct rusage senderUsage;
+    memset(&senderUsage, 0, sizeof(senderUsage));
+    std::thread watchdog([&]{
+        int status = 0;
+        wait4(pid, &status, 0, &senderUsage);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fprintf(stderr, "Test pattern sender failed, status %d\n", status);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2*RTPNG_TIMEOUT_DURATION));
+        control.exit = true;
+    });
+
+    CameraModel::camStatusEnum status = CameraModel::camWaiting;
+    unsigned int lastFrame = 0;
+    int lastCounter = -1;
+    double verifyCpu = 0;
+    std::chrono::steady_clock::time_point first, last;
+    while(!control.exit) {
+        uint16_t *frame = cam->getFrameWait(lastFrame, &status);
+        if(control.exit || (status != CameraModel::camPlaying))
+            continue;
+        last = std::chrono::steady_clock::now();
+        if(r.delivered == 0)
+            first = last;
+        r.delivered++;
+        memcpy(copy.data(), frame, bytes);
+
+        double v = cpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+        checkFrame(copy.data(), reference.data(), pt, cam, lastCounter, r);
+        verifyCpu += cpuSeconds(CLOCK_THREAD_CPUTIME_ID) - v;
+    }
+    watchdog.join();
+    receiver.join();
+
+    double consumerCpu = cpuSeconds(CLOCK_THREAD_CPUTIME_ID) - consumerStart;
+    r.receiveCpu = cpuSeconds(CLOCK_PROCESS_CPUTIME_ID) - processStart - consumerCpu;
+    r.consumeCpu = consumerCpu - verifyCpu;
+    r.verifyCpu = verifyCpu;
+    r.senderCpu = senderUsage.ru_utime.tv_sec + senderUsage.ru_utime.tv_usec / 1E6
+                + senderUsage.ru_stime.tv_sec + senderUsage.ru_stime.tv_usec / 1E6;
+    r.stats = cam->getStreamStats();
+    delete cam;
+
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>(last - first).count() / 1E6;
+    if((r.delivered > 1) && (seconds > 0))
+        r.sustainedFps = (r.delivered - 1) / seconds;
+    // The first frames only size the receive buffers and are never delivered.
+    // Each shard sizes its own buffers from the frames sent to its port.
+    double expected = (double)frames - (double)options.rtpShards * (RTPNG_SIZING_FRAMES + 1);
+    if(expected > 0)
+        r.dropPercent = 100.0 * (expected - r.delivered) / expected;
+    if(r.dropPercent < 0)
+        r.dropPercent = 0;
+    return r;
+}
+
+static void printHeading() {
+    printf("%6s %6s %6s %7s | %8s %7s %6s %6s %6s %5s %5s | %5s %6s %5s | %6s %6s %6s %6s | %s\n",
+           "width", "height", "chunks", "fps", "got fps", "snd fps", "jit us", "drop%", "frames", "lost", "late",
+           "buf", "maxlag", "laps", "send s", "recv s", "cons s", "chk s", "pixels");
+}
+
+static void printResult(const benchResult &r) {
+    char pixels[128];
+    snprintf(pixels, sizeof(pixels), "%lu ok, %lu zero-filled, %lu unknown, %lu corrupt, %lu out of order",
+             r.verified, r.zeroFilled, r.unidentified, r.corrupt, r.outOfOrder);
+    printf("%6d %6d %6d %7.1f | %8.1f %7.1f %6.0f %6.2f %6lu %5lu %5lu | %5lu %6lu %5lu | %6.2f %6.2f %6.2f %6.2f | %s\n",
+           r.point.width, r.point.height, r.point.chunks, r.point.fps,
+           r.sustainedFps, r.stats.senderFps, r.stats.senderJitterMicros, r.dropPercent, r.delivered, r.stats.lostPackets, r.stats.latePackets,
+           r.stats.bufferFrames, r.stats.maxLagFrames, r.stats.lapEvents,
+           r.senderCpu, r.receiveCpu, r.consumeCpu, r.verifyCpu, pixels);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    const char *sender = "./server-testpattern";
+    std::vector<double> widths = {640, 1280};
+    std::vector<double> heights = {480};
+    std::vector<double> chunks = {32, 64};
+    std::vector<double> rates = {100, 250};
+    unsigned int frames = 500;
+    double maxDropPercent = 1.0;
+
+    takeOptionsType options;
+    options.rtpNextGen = true;
+    options.rtpPort = 5004;
+
+    int opt;
+    while((opt = getopt(argc, argv, "s:p:w:h:c:f:n:b:dr:Rx:")) != -1) {
+        switch(opt) {
+        case 's': sender = optarg; break;
+        case 'p': options.rtpPort = atoi(optarg); break;
+        case 'w': widths = parseList(optarg); break;
+        case 'h': heights = parseList(optarg); break;
+        case 'c': chunks = parseList(optarg); break;
+        case 'f': rates = parseList(optarg); break;
+        case 'n': frames = strtoul(optarg, NULL, 10); break;
+        case 'b': options.rtpBatchSize = atoi(optarg); break;
+        case 'd': options.rtpDirectPlacement = true; break;
+        case 'r':
+            options.rtpShards = atoi(optarg);
+            options.rtpShardPorts = true;
+            break;
+        case 'R':
+            options.rtpPacketRing = true;
+            options.rtpInterface = "lo";
+            options.havertpInterface = true;
+            break;
+        case 'x': maxDropPercent = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-s sender] [-p port] [-w widths] [-h heights] [-c chunks] [-f fps]\n"
+                            "       [-n frames] [-b batch] [-d] [-r shards] [-R] [-x maxDropPercent]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(options.rtpPacketRing && (options.rtpShards > 1)) {
+        fprintf(stderr, "The packet ring is read by a single thread, -R and -r cannot be combined.\n");
+        return 2;
+    }
+    if((options.rtpShards < 1) || (options.rtpShards > RTPNG_MAX_SHARDS)) {
+        fprintf(stderr, "Use between 1 and %d shards.\n", RTPNG_MAX_SHARDS);
+        return 2;
+    }
+    if(access(sender, X_OK) != 0) {
+        fprintf(stderr, "Test pattern sender %s not found, build it with make server-testpattern or give its path with -s.\n", sender);
+        return 2;
+    }
+    if(frames <= RTPNG_SIZING_FRAMES + 1) {
+        fprintf(stderr, "Send more than %d frames, the first ones only size the receive buffers.\n", RTPNG_SIZING_FRAMES + 1);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<benchResult> results;
+    unsigned int skipped = 0;
+    for(size_t w=0; w < widths.size(); w++)
+        for(size_t h=0; h < heights.size(); h++)
+            for(size_t c=0; c < chunks.size(); c++)
+                for(size_t f=0; f < rates.size(); f++) {
+                    benchPoint pt;
+                    pt.width = (int)widths[w];
+                    pt.height = (int)heights[h];
+                    pt.chunks = (int)chunks[c];
+                    pt.fps = rates[f];
+                    if((pt.width*pt.height*2) % pt.chunks != 0) {
+                        fprintf(stderr, "Skipping %dx%d with %d chunks, the frame does not divide evenly.\n",
+                                pt.width, pt.height, pt.chunks);
+                        skipped++;
+                        continue;
+                    }
+                    printf("Running %dx%d, %d chunks per frame, %.1f FPS, %u frames.\n",
+                           pt.width, pt.height, pt.chunks, pt.fps, frames);
+                    fflush(stdout);
+                    results.push_back(runPoint(sender, options, pt, frames));
+                    printHeading();
+                    printResult(results.back());
+                }
+
+    bool failed = false;
+    printf("\nRTP NextGen loopback benchmark, batch %u%s%s, %u shard(s):\n", options.rtpBatchSize,
+           options.rtpDirectPlacement ? ", direct placement" : "", options.rtpPacketRing ? ", packet ring" : "",
+           options.rtpShards);
+    printHeading();
+    for(size_t n=0; n < results.size(); n++) {
+        printResult(results[n]);
+        if((results[n].corrupt > 0) || (results[n].outOfOrder > 0) || (results[n].dropPercent > maxDropPercent))
+            failed = true;
+    }
+    if(skipped)
+        printf("Skipped %u point(s) where the frame does not divide evenly into its chunks.\n", skipped);
+    if(results.empty()) {
+        printf("No point of the sweep could be run.\n");
+        failed = true;
+    }
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed ? 1 : 0;
+}
@@ -1,7 +1,10 @@
 // Server side implementation of UDP client-server model 
 // Compile:
-// clang++ -O3 -march=native server.cpp
-// Adjust frame rate and geometry within the source. 
+// clang++ -O3 -march=native server-testpattern.cpp -o server-testpattern
+// The defaults below can be overridden on the command line:
+// ./server-testpattern -p port -w width -h height -c chunksPerFrame -f fps -n frames -r ports
+// With -r, consecutive frames go to ports port, port+1, ... port+ports-1 in turn, one RTP
+// stream spread over the ports, as for a receiver using --rtpshards with --rtpshardports.
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -16,6 +19,9 @@
 #include <sys/socket.h> 
 #include <arpa/inet.h> 
 #include <netinet/in.h> 
+#include <getopt.h>
+
+#include "testpattern.h"
    
 #define PORT      5004
 #define MAXLINE 1024 
@@ -205,38 +211,7 @@ void genFrame(uint8_t* buffer, uint16_t height, uint16_t width) {
     }
 }
 
-void genFrameOffset(uint8_t* buffer, uint16_t height, uint16_t width, uint8_t offset) {
-    for(unsigned int p=0; p < height*width*2; p++) {
-        //buffer[p] = (uint16_t)p + offset; // straight column, moves sideways
-        buffer[p] = ((uint8_t)p + offset) + (p/width); // diagional pattern, moves diagionally 
-    }
-}
-
-void insertFrameHeader(uint8_t* frameImage, unsigned int frameCounter) {
-    frameImage[1] = (uint8_t)frameCounter&0x00ff;
-    frameImage[0] = (uint8_t)frameCounter&0xff00>>8;
-
-    //frameImage[1] = 0xf0;
-    //frameImage[0] = 0x00;
-
-    frameImage[2] = 0xff;
-    frameImage[3] = 0xff;
-    frameImage[4] = 0xff;
-    frameImage[5] = 0xff;
-
-    frameImage[6] = 0;
-    frameImage[7] = 0;
-    frameImage[8] = 0;
-    frameImage[9] = 0;
-
-    frameImage[10] = 0xff;
-    frameImage[11] = 0xff;
-    frameImage[12] = 0xff;
-    frameImage[13] = 0xff;
-}
-
-
-int main() { 
+int main(int argc, char *argv[]) { 
 
     std::chrono::steady_clock::time_point startMaintp;
     std::chrono::steady_clock::time_point begintp;
@@ -244,6 +219,37 @@ int main() {
 
     uint16_t height = 480;
     uint16_t width = 1280;
+    int port = PORT;
+    int chunksPerFrame = chunksPerFrame_d;
+    int framePeriod = framePeriod_microsec; // microseconds
+    unsigned int framesToDeliver = nFramesToDeliver;
+    int ports = 1;
+
+    int opt;
+    while((opt = getopt(argc, argv, "p:w:h:c:f:n:r:")) != -1) {
+        switch(opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'w': width = atoi(optarg); break;
+        case 'h': height = atoi(optarg); break;
+        case 'c': chunksPerFrame = atoi(optarg); break;
+        case 'f': framePeriod = (int)(1E6 / atof(optarg)); break;
+        case 'n': framesToDeliver = strtoul(optarg, NULL, 10); break;
+        case 'r': ports = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-w width] [-h height] [-c chunksPerFrame] [-f fps] [-n frames] [-r ports]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(ports < 1) {
+        fprintf(stderr, "The number of ports must be at least 1.\n");
+        exit(EXIT_FAILURE);
+    }
+    if((width == 0) || (height == 0) || (chunksPerFrame < 1) || (framePeriod < 1) ||
+            ((height*width*2) % chunksPerFrame != 0)) {
+        fprintf(stderr, "Frame size (%d bytes) must be integer divisible by the chunks per frame (%d).\n",
+                height*width*2, chunksPerFrame);
+        exit(EXIT_FAILURE);
+    }
     
     printf("Allocating memory for header and frame image. Height = %d, width = %d\n",
             height, width); 
@@ -276,7 +282,7 @@ int main() {
     // servaddr.sin_addr.s_addr = inet_addr("0.0.0.0");  // no traffic seen
     //servaddr.sin_addr.s_addr = inet_addr("10.10.10.1"); // traffic on both sides seen, good for fiber RTP testing
     //servaddr.sin_addr.s_addr = inet_addr("10.10.10.0"); // no traffic seen
-    servaddr.sin_port = htons(PORT); 
+    servaddr.sin_port = htons(port); 
        
     socklen_t len;
    
@@ -289,7 +295,6 @@ int main() {
 
     unsigned int frameSize = height*width*2; 
     bool marker = false; 
-    int chunksPerFrame = chunksPerFrame_d;
     size_t frameBytesPerPacket = frameSize/chunksPerFrame; 
     unsigned int chunksSent = 0;
     unsigned int chunks = 0;
@@ -316,13 +321,14 @@ int main() {
     // 3333 = 300 FPS (295 typically)
     // 2500 = 400 FPS (385 typically)
     // 2000 = 500 FPS (470 typically)
-    int framePeriod = framePeriod_microsec; // microseconds
     int underspeedEvents = 0;
     uintmax_t bytesSentTotal = 0;
 
     startMaintp = std::chrono::steady_clock::now();
-    while(framesSent < nFramesToDeliver) {
+    while(framesSent < framesToDeliver) {
         begintp = std::chrono::steady_clock::now();
+        // Stamp each frame with its start time on the 90 kHz RTP video clock.
+        timestamp = (uint32_t)(std::chrono::duration_cast<std::chrono::microseconds>(begintp - startMaintp).count() * 9 / 100);
 
         // Optional, modify frame to have a moving pattern
         genFrameOffset(frameImage, height, width, framesSent); // slows down loop
@@ -330,6 +336,9 @@ int main() {
         // Mark the frame, in case we save data and look at it later.
         insertFrameHeader(frameImage, framesSent);
 
+        // Spread the frames over the ports. The sequence numbers carry on across them.
+        servaddr.sin_port = htons(port + framesSent % ports);
+
         for(int c=0; c < chunksPerFrame; c++) {
 
             if( (chunks+1) * frameBytesPerPacket == frameSize) {
@@ -359,7 +368,6 @@ int main() {
             sequenceNumber++;
             std::this_thread::sleep_for(std::chrono::nanoseconds(packetDelay_ns));
         }
-        timestamp++;
         framesSent++;
         chunks = 0;
         endtp = std::chrono::steady_clock::now();
@@ -0,0 +1,39 @@
+// Test pattern shared by server-testpattern, which sends it, and rtpbench, which checks it.
+// Each frame is a diagonal ramp that moves by one step per frame, with the frame counter
+// and a fixed marker written over the first 14 bytes.
+#ifndef TESTPATTERN_H
+#define TESTPATTERN_H
+
+#include <stdint.h>
+
+static void genFrameOffset(uint8_t* buffer, uint16_t height, uint16_t width, uint8_t offset) {
+    for(unsigned int p=0; p < height*width*2; p++) {
+        //buffer[p] = (uint16_t)p + offset; // straight column, moves sideways
+        buffer[p] = ((uint8_t)p + offset) + (p/width); // diagional pattern, moves diagionally 
+    }
+}
+
+static void insertFrameHeader(uint8_t* frameImage, unsigned int frameCounter) {
+    frameImage[1] = (uint8_t)frameCounter&0x00ff;
+    frameImage[0] = (uint8_t)frameCounter&0xff00>>8;
+
+    //frameImage[1] = 0xf0;
+    //frameImage[0] = 0x00;
+
+    frameImage[2] = 0xff;
+    frameImage[3] = 0xff;
+    frameImage[4] = 0xff;
+    frameImage[5] = 0xff;
+
+    frameImage[6] = 0;
+    frameImage[7] = 0;
+    frameImage[8] = 0;
+    frameImage[9] = 0;
+
+    frameImage[10] = 0xff;
+    frameImage[11] = 0xff;
+    frameImage[12] = 0xff;
+    frameImage[13] = 0xff;
+}
+
+#endif // TESTPATTERN_H